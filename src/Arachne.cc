@@ -33,6 +33,13 @@
 #else
 #include <err.h>
 #endif
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
 namespace Arachne {
 
@@ -103,6 +110,149 @@ SpinLock coreExclusionMutex;
  */
 int stackSize = 1024 * 1024;
 
+/**
+ * A single mapping that holds the stacks of all ThreadContexts. It only
+ * reserves address space, so stack memory is committed as threads touch it,
+ * and a PROT_NONE guard page below each stack makes overflowing it fault
+ * immediately.
+ */
+static char* stackRegion = NULL;
+static size_t stackRegionSize = 0;
+
+/**
+ * True means that stackRegion and contextRegion are backed with 2 MB huge
+ * pages: from the hugetlbfs pool if it has enough pages reserved, and
+ * otherwise with transparent huge pages where the kernel provides them. A
+ * 4 KB guard page would split a huge page, so stacks have no guard pages in
+ * this mode.
+ */
+bool useHugePages = false;
+
+/**
+ * True means that init_static() faults in all of stackRegion and
+ * contextRegion, and locks it in memory if RLIMIT_MEMLOCK allows, so that
+ * threads do not take page faults the first time they touch their stacks.
+ */
+bool prefaultMemory = false;
+
+/**
+ * When useHugePages is set, a single mapping that holds the ThreadContexts of
+ * all cores; otherwise each ThreadContext is allocated separately and this is
+ * NULL.
+ */
+static char* contextRegion = NULL;
+static size_t contextRegionSize = 0;
+
+/**
+ * The size of the huge pages that useHugePages asks for.
+ */
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+/**
+ * Configurable maximum number of threads per core. Each core allocates this
+ * many contexts and stacks up front.
+ */
+int maxThreadsPerCore = 56;
+
+/**
+ * Number of words in each per-core context mask; derived from
+ * maxThreadsPerCore in init().
+ */
+int numContextWords = 1;
+
+/**
+ * True means that a core which finds no runnable threads will ask the most
+ * loaded core to hand it one of its runnable threads.
+ */
+bool enableWorkStealing = false;
+
+/**
+ * Minimum time in nanoseconds between two attempts by an idle core to steal
+ * work, which bounds the cache traffic idle cores impose on loaded ones.
+ */
+const uint64_t STEAL_INTERVAL_NS = 2000;
+
+/**
+ * How long, in nanoseconds, a core without the core arbiter spins in
+ * dispatch() looking for work before it parks its kernel thread. 0, the
+ * default, means that cores never park but spin as they always have.
+ */
+uint64_t idleSpinBudgetNs = 0;
+
+/**
+ * How long, in nanoseconds, runnable threads at one priority level may be
+ * passed over in favor of higher levels before dispatch() runs one of them
+ * anyway. ~0 means that lower levels may starve.
+ */
+uint64_t priorityAgingNs = 10000000;
+
+/**
+ * How many more threads than a randomly chosen core the creating core, or
+ * another core sharing its last-level cache, may host and still receive a
+ * thread placed with PLACE_NEARBY. A negative value disables the preference.
+ */
+int placementSlack = 2;
+
+/**
+ * For each core, an identifier for the group of cores that share its
+ * last-level cache: the lowest-numbered core in the group.
+ */
+std::vector<int> llcOfCore;
+
+/**
+ * For each thread class, the stack class its threads are created with by
+ * default, less OWN_STACK, so that classes never given one use OWN_STACK. It
+ * is a fixed array because thread creation reads it without a lock. See
+ * setStackClass().
+ */
+std::atomic<int> threadClassStackClasses[MAX_STACK_THREAD_CLASSES];
+
+/**
+ * True means that stacks are painted with STACK_PAINT when they are set up,
+ * and that the depth each thread's stack reached is recorded in
+ * stackUsageHistograms when the thread exits. Painting commits the memory of
+ * every stack, so this is meant for tuning stackSize and stack classes, not
+ * for production.
+ */
+bool profileStackUsage = false;
+
+/**
+ * The word that unused parts of stacks are filled with when profileStackUsage
+ * is set.
+ */
+static const uint64_t STACK_PAINT = 0xa5a5a5a55a5a5a5aULL;
+
+/**
+ * How many bytes below its own frame recordOwnStackUsage() leaves unpainted
+ * for the frames of the functions it calls.
+ */
+static const size_t SPACE_FOR_STACK_PROFILING = 1024;
+
+/**
+ * Histograms of stack depth, indexed by thread class; see getStackUsage().
+ */
+std::vector<StackUsageHistogram> stackUsageHistograms;
+
+/**
+ * Protects stackUsageHistograms, which threads exiting on any core update.
+ */
+SpinLock stackUsageMutex("stackUsageMutex", false);
+
+/**
+ * Number of keys that createFiberLocalKey() has handed out.
+ */
+static std::atomic<int> numFiberLocalKeys;
+
+/**
+ * The destructor for the values of each fiber-local key, or NULL.
+ */
+static void (*fiberLocalDestructors[NUM_FIBER_LOCAL_SLOTS])(void*);
+
+/**
+ * Where Linux exports the CPU topology that readCpuTopology() reads.
+ */
+static const char CPU_SYSFS_DIR[] = "/sys/devices/system/cpu";
+
 /**
  * Keep track of the kernel threads we are running so that we can join them on
  * destruction. Also, store a pointer to the original stacks to facilitate
@@ -130,17 +280,37 @@ volatile bool shutdown;
  */
 const int MAX_MIGRATION_RETRIES = 10;
 
+/**
+ * Resolution of the per-core timer wheels in nanoseconds. Sleeping threads
+ * may wake up to this much later than requested.
+ */
+const uint64_t TIMER_RESOLUTION_NS = 250;
+
 /**
  * The collection of possibly runnable contexts for each kernel thread.
  */
 std::vector<ThreadContext**> allThreadContexts;
 
+/**
+ * For each core, the deadlines of the threads in its contexts, packed by
+ * idInCore into a cache-aligned array of numContextWords * 64 entries.
+ * ThreadContext::deadlineInCycles points into these arrays.
+ */
+std::vector<uint64_t*> allDeadlines;
+
 /**
  * Each element points at the occupiedAndCount belonging to the core with the
  * coreId equal to its index.
  */
 std::vector<std::atomic<MaskAndCount>*> occupiedAndCount;
 
+/**
+ * Each element points at the OccupiedSlots belonging to the core with the
+ * coreId equal to its index; used instead of occupiedAndCount when
+ * maxThreadsPerCore exceeds MaskAndCount::MAX_THREADS.
+ */
+std::vector<OccupiedSlots*> occupiedSlots;
+
 /**
  * Global coreId -> Core mapping.
  */
@@ -181,6 +351,19 @@ static int ring_idle_timeout = 10;
  */
 static int pcpu_ring_entries = 64;
 
+/**
+ * The number of SQEs a core may queue in its io_uring before it submits
+ * them right away rather than at the end of its current dispatch() pass.
+ * 1 submits every request as soon as it is prepared.
+ */
+uint32_t submitBatchSize = 16;
+
+/**
+ * How long, in nanoseconds, the oldest SQE queued in a core's io_uring may
+ * wait before dispatch() submits it even though the pass has not ended.
+ */
+uint64_t submitBatchAgeNs = 2000;
+
 /**
  * All core-specific state that is not associated with other classes.
  */
@@ -194,7 +377,7 @@ bool disableLoadEstimation;
 thread_local uint64_t IdleTimeTracker::lastTotalCollectionTime;
 thread_local uint64_t IdleTimeTracker::dispatchStartCycles;
 thread_local uint64_t IdleTimeTracker::lastDispatchIterationStart;
-thread_local uint8_t IdleTimeTracker::numThreadsRan;
+thread_local uint32_t IdleTimeTracker::numThreadsRan;
 
 // Allocate storage for nested dispatch detection.
 thread_local bool NestedDispatchDetector::dispatchRunning;
@@ -220,6 +403,23 @@ void releaseCore();
 void descheduleCore();
 void idleCorePrivate();
 void checkForArbiterRequest();
+void checkSysRing();
+static inline void checkTimers(Core& core, uint64_t now);
+static void startInjectedThreads();
+static void unmapStackRegion();
+static void runOnPooledStack(ThreadContext* context);
+static void destroyFiberLocals(ThreadContext* context);
+static void recordOwnStackUsage(ThreadContext* context);
+static void recordStackUsage(int threadClass, void* stack, size_t size,
+                             void* paintLimit);
+static void forwardInjectedThreads();
+void stealWork(uint64_t now);
+void handleStealRequest();
+static void trimLocalStacks(bool longUnoccupiedOnly);
+void parkCore();
+static void releaseOccupiedSlot(int index);
+uint64_t compareExchange(volatile uint64_t* target, uint64_t test,
+                         uint64_t newValue);
 
 // The following constants must be defined here because we want them to be
 // scoped inside their respective structures, but gtest macros try to take
@@ -228,7 +428,96 @@ void checkForArbiterRequest();
 const uint64_t ThreadContext::BLOCKED = ~0L;
 const uint64_t ThreadContext::UNOCCUPIED = ~0L - 1;
 const uint8_t ThreadContext::CORE_UNASSIGNED = ~0L;
-const uint8_t MaskAndCount::EXCLUSIVE = maxThreadsPerCore * 2 + 1;
+const uint8_t MaskAndCount::EXCLUSIVE = MaskAndCount::MAX_THREADS * 2 + 1;
+const int MaskAndCount::MAX_THREADS;
+const uint32_t OccupiedSlots::EXCLUSIVE = MAX_THREADS_PER_CORE * 2 + 1;
+
+/**
+ * Return the bits of the given word of a per-core context mask that correspond
+ * to contexts which exist under the current maxThreadsPerCore.
+ */
+static inline uint64_t
+contextWordMask(int word) {
+    int numBits = maxThreadsPerCore - (word << 6);
+    return numBits >= 64 ? ~0UL : (1UL << numBits) - 1;
+}
+
+/**
+ * Return the index of the first context at or after start whose bit is set in
+ * the given per-core context mask, or -1 if there is none.
+ */
+static inline int
+findNextContext(const uint64_t* mask, int start) {
+    int word = contextWord(start);
+    if (word >= numContextWords)
+        return -1;
+    uint64_t bits = mask[word] & (~0UL << (start & 63));
+    while (bits == 0) {
+        if (++word == numContextWords)
+            return -1;
+        bits = mask[word];
+    }
+    return (word << 6) + __builtin_ctzll(bits);
+}
+
+/**
+ * Set the bit for the given context, which lives on the current core, in
+ * this core's private runnable mask for its priority level. The caller must
+ * have set the context's wakeupTimeInCycles to 0 first.
+ */
+static inline void
+markRunnableLocally(ThreadContext* context) {
+    int idInCore = context->idInCore;
+    core.privateRunnableMask[context->priority][contextWord(idInCore)] |=
+        contextBit(idInCore);
+}
+
+/**
+ * Return true if any context has its bit set in the given per-core context
+ * mask.
+ */
+static inline bool
+anyContext(const uint64_t* mask) {
+    for (int w = 0; w < numContextWords; w++)
+        if (mask[w])
+            return true;
+    return false;
+}
+
+/**
+ * Return the number of candidates in this core's private runnable masks.
+ */
+static inline uint32_t
+localNumRunnable() {
+    uint32_t numRunnable = 0;
+    for (int level = 0; level < NUM_PRIORITY_LEVELS; level++)
+        for (int w = 0; w < numContextWords; w++)
+            numRunnable +=
+                __builtin_popcountll(core.privateRunnableMask[level][w]);
+    return numRunnable;
+}
+
+/**
+ * Return the highest priority level with a candidate in this core's private
+ * runnable masks, or -1 if there is none.
+ */
+static inline int
+highestRunnableLevel() {
+    for (int level = NUM_PRIORITY_LEVELS - 1; level >= 0; level--)
+        if (anyContext(core.privateRunnableMask[level]))
+            return level;
+    return -1;
+}
+
+/**
+ * Return the number of threads on the current core; see numOccupiedOnCore().
+ */
+static inline uint32_t
+localNumOccupied() {
+    if (likely(maxThreadsPerCore <= MaskAndCount::MAX_THREADS))
+        return core.localOccupiedAndCount->load().numOccupied;
+    return core.localOccupiedSlots->numOccupied.load();
+}
 
 /**
  * Allocate a block of memory aligned at the beginning of a cache line.
@@ -258,26 +547,57 @@ alignedAlloc(size_t size, size_t alignment) {
  */
 void
 initializeCore(Core* core) {
-    core->localPinnedContexts = reinterpret_cast<std::atomic<uint64_t>*>(
-        alignedAlloc(sizeof(uint64_t)));
+    size_t maskSize = numContextWords * sizeof(std::atomic<uint64_t>);
+    void *p = alignedAlloc(maskSize);
+    memset(p, 0, maskSize);
+    core->localPinnedContexts = reinterpret_cast<std::atomic<uint64_t>*>(p);
     // All cores initially poll for work on context 0's stack.
     core->localPinnedContexts->store(1U);
 
-    void *p = alignedAlloc(sizeof(std::atomic<uint64_t>));
-    memset(p, 0, sizeof(std::atomic<uint64_t>));
+    p = alignedAlloc(maskSize);
+    memset(p, 0, maskSize);
     core->highPriorityThreads = reinterpret_cast<std::atomic<uint64_t>*>(p);
 
-    // Allocate stacks and contexts
-    ThreadContext** contexts = new ThreadContext*[maxThreadsPerCore];
-    for (uint8_t k = 0; k < maxThreadsPerCore; k++) {
-        contexts[k] = reinterpret_cast<ThreadContext*>(
-            alignedAlloc(sizeof(ThreadContext)));
-        new (contexts[k]) ThreadContext(k);
+    p = alignedAlloc(maskSize);
+    memset(p, 0, maskSize);
+    core->newDeadlineThreads = reinterpret_cast<std::atomic<uint64_t>*>(p);
+
+    p = alignedAlloc(maskSize * NUM_PRIORITY_LEVELS);
+    memset(p, 0, maskSize * NUM_PRIORITY_LEVELS);
+    core->runnableThreads = reinterpret_cast<std::atomic<uint64_t>*>(p);
+
+    // Parked cores rely on ppoll() timeouts to wake sleeping threads on time.
+    prctl(PR_SET_TIMERSLACK, 1UL);
+    core->parked = false;
+    core->idled = false;
+    core->parkFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (core->parkFd < 0) {
+        ARACHNE_LOG(ERROR, "eventfd failed: %s", strerror(errno));
+        abort();
     }
-    core->localThreadContexts = contexts;
     pthread_setname_np(pthread_self(), "arachne_thread");
 }
 
+/**
+ * Unmap the stacks in the stack pools of the current core, which is going
+ * offline, and stop counting them in PerfStats::pooledStackBytes.
+ */
+static void
+unmapStackPools() {
+    for (int stackClass = 0; stackClass < NUM_STACK_CLASSES; stackClass++) {
+        std::vector<void*>& pool = core.stackPools[stackClass];
+        for (size_t i = 0; i < pool.size(); i++) {
+            munmap(reinterpret_cast<char*>(pool[i]) - PAGE_SIZE,
+                   STACK_CLASS_SIZES[stackClass] + PAGE_SIZE);
+            if (i >= core.numTrimmedPooledStacks[stackClass])
+                PerfStats::threadStats->pooledStackBytes -=
+                    STACK_CLASS_SIZES[stackClass];
+        }
+        pool.clear();
+        core.numTrimmedPooledStacks[stackClass] = 0;
+    }
+}
+
 /**
  * Release resources allocated during initializeCore().
  */
@@ -285,6 +605,29 @@ void
 deinitializeCore(Core* core) {
     free(core->localPinnedContexts);
     free(core->highPriorityThreads);
+    free(core->newDeadlineThreads);
+    for (int stackClass = 0; stackClass < NUM_STACK_CLASSES; stackClass++) {
+        for (void* stack : core->stackPools[stackClass])
+            munmap(reinterpret_cast<char*>(stack) - PAGE_SIZE,
+                   STACK_CLASS_SIZES[stackClass] + PAGE_SIZE);
+        core->stackPools[stackClass].clear();
+        core->numTrimmedPooledStacks[stackClass] = 0;
+    }
+    for (void* chunk : core->invocationChunks)
+        free(chunk);
+    core->invocationChunks.clear();
+    for (int i = 0; i < NUM_INVOCATION_CLASSES; i++) {
+        core->freeInvocationBuffers[i] = NULL;
+        core->remoteInvocationBuffers[i] = NULL;
+    }
+    for (void* chunk : core->syscall_request_chunks)
+        free(chunk);
+    core->syscall_request_chunks.clear();
+    core->free_syscall_requests = NULL;
+    core->remote_syscall_requests = NULL;
+    free_recv_buffers();
+    free(core->runnableThreads);
+    ::close(core->parkFd);
 }
 
 #ifdef DISABLE_ARBITER
@@ -347,9 +690,22 @@ threadMain() {
             p.wq_fd = coreMap[first_core_set]->sys_io_ring.ring_fd;
             p.flags |= IORING_SETUP_ATTACH_WQ;
         }
+        release_recv_buf_ring();
         io_uring_queue_init_params(pcpu_ring_entries, &coreptr->sys_io_ring, &p);
+        core.sys_io_ring_backlog = 0;
+        core.registered_files_generation = 0;
+        core.registered_buffers_generation = 0;
+        update_registrations();
         ring_zero_inited.store(true, std::memory_order_release);
 
+        // Completions must wake this core if it has parked.
+        if (int rc = io_uring_register_eventfd(&coreptr->sys_io_ring,
+                                               core.parkFd)) {
+            ARACHNE_LOG(ERROR, "io_uring_register_eventfd failed: %s",
+                        strerror(-rc));
+            abort();
+        }
+
 
         // Associate this thread's PerfStats pointer with the proper value for
         // the core this thread is executing on.
@@ -366,22 +722,43 @@ threadMain() {
             break;
         }
         core.localOccupiedAndCount = occupiedAndCount[core.id];
+        core.localOccupiedSlots = occupiedSlots[core.id];
         core.localThreadContexts = allThreadContexts[core.id];
+        core.localDeadlines = allDeadlines[core.id];
 
         IdleTimeTracker::lastTotalCollectionTime = 0;
+        core.timerWheel.reset(Cycles::rdtsc(),
+                              Cycles::fromNanoseconds(TIMER_RESOLUTION_NS));
         // Clean up state from the last time this thread ran. This should
         // eventually be removed once we ensure that cleanup happens on
         // descheduling.
         *core.localOccupiedAndCount = {0, 0};
-        *core.highPriorityThreads = 0;
-        core.privatePriorityMask = 0;
+        core.localOccupiedSlots->numOccupied = 0;
+        for (int w = 0; w < numContextWords; w++) {
+            core.localOccupiedSlots->occupied[w] = 0;
+            core.highPriorityThreads[w] = 0;
+            core.privatePriorityMask[w] = 0;
+            core.newDeadlineThreads[w] = 0;
+            core.deadlineThreads[w] = 0;
+        }
+        for (int level = 0; level < NUM_PRIORITY_LEVELS; level++) {
+            for (int w = 0; w < numContextWords; w++) {
+                core.runnableThreads[level * numContextWords + w] = 0;
+                core.privateRunnableMask[level][w] = 0;
+            }
+            core.nextCandidateIndex[level] = 0;
+            core.levelWaitingSince[level] = 0;
+        }
+        core.stealRequest = 0;
+        core.numRunnable = 0;
+        core.lastStealAttempt = 0;
         core.coreDeschedulingScheduled = false;
 
         // Correct the ThreadContext.coreId() here to match the current core.
         // We must do these operations before making cores available for
         // scheduling because otherwise our ThreadContexts may be targeted for
         // migration before their stacks are initialized.
-        for (uint8_t k = 0; k < maxThreadsPerCore; k++) {
+        for (int k = 0; k < maxThreadsPerCore; k++) {
             core.localThreadContexts[k]->coreId = static_cast<uint8_t>(core.id);
             core.localThreadContexts[k]->originalCoreId =
                 static_cast<uint8_t>(core.id);
@@ -411,6 +788,9 @@ threadMain() {
         // to the schedulerMainLoop.
         arachne_swapcontext(&core.loadedContext->sp, &kernelThreadStacks[core.id]);
         numActiveCores--;
+        unmapStackPools();
+        // Idle cores must not ask this core for work while it is offline.
+        core.numRunnable = 0;
         if (shutdown) {
             // Avoid leaking PerfStats across shutdowns.
             PerfStats::releaseStats(std::move(PerfStats::threadStats));
@@ -426,6 +806,12 @@ threadMain() {
 #endif
         PerfStats::threadStats->numCoreDecrements++;
 
+        // No thread will run here until the core comes back, so its stacks
+        // need not stay resident, and its ring need not hold registered files
+        // open.
+        trimLocalStacks(false);
+        drop_registrations();
+
         // Release the PerfStats associated with this core, since we are about
         // to give up this core.
         PerfStats::releaseStats(std::move(PerfStats::threadStats));
@@ -463,17 +849,39 @@ schedulerMainLoop() {
             core.coreReadyForReturnToArbiter = false;
             arachne_swapcontext(&kernelThreadStacks[core.id], &core.loadedContext->sp);
         }
+        // A context starting a newly created thread arrives here with
+        // wakeupTimeInCycles still 0 after dispatch() consumed its runnable
+        // bit, so make sure dispatch() can find it again.
+        if (core.loadedContext->wakeupTimeInCycles == 0)
+            markRunnableLocally(core.loadedContext);
+
         // No thread to execute yet. This call will not return until we have
         // been assigned a new Arachne thread.
         dispatch();
-        reinterpret_cast<ThreadInvocationEnabler*>(
-            &core.loadedContext->threadInvocation)
-            ->runThread();
+        if (core.loadedContext->stackClass == OWN_STACK)
+            reinterpret_cast<ThreadInvocationEnabler*>(
+                &core.loadedContext->threadInvocation)
+                ->runThread();
+        else
+            runOnPooledStack(core.loadedContext);
         // The thread has exited.
+        if (profileStackUsage && core.loadedContext->stackClass == OWN_STACK)
+            recordOwnStackUsage(core.loadedContext);
+        if (numFiberLocalKeys.load(std::memory_order_relaxed) != 0)
+            destroyFiberLocals(core.loadedContext);
         // Cancel any wakeups the thread may have scheduled for itself before
         // exiting.
         core.loadedContext->wakeupTimeInCycles = ThreadContext::UNOCCUPIED;
 
+        uint16_t idInCore = core.loadedContext->idInCore;
+        if (core.loadedContext->threadClass == CorePolicy::DEADLINE_CLASS) {
+            core.deadlineThreads[contextWord(idInCore)] &=
+                ~contextBit(idInCore);
+            core.newDeadlineThreads[contextWord(idInCore)] &=
+                ~contextBit(idInCore);
+            if (Cycles::rdtsc() > *core.loadedContext->deadlineInCycles)
+                PerfStats::threadStats->numDeadlineMisses++;
+        }
         prefetch(core.localOccupiedAndCount);
         // The positioning of this lock is rather subtle, and makes the
         // following three operations atomic.
@@ -496,9 +904,13 @@ schedulerMainLoop() {
         // context is already cleared.
         core.loadedContext->generation++;
 
-        // Pin the current context before clearing the occupied bit.
-        uint64_t pinMask = 1L << core.loadedContext->idInCore;
-        core.localPinnedContexts->store(pinMask, std::memory_order_release);
+        // Pin the current context, and only it, before clearing the occupied
+        // bit.
+        int pinWord = contextWord(idInCore);
+        for (int w = 0; w < numContextWords; w++)
+            core.localPinnedContexts[w].store(
+                w == pinWord ? contextBit(idInCore) : 0,
+                std::memory_order_release);
 
         // The code below clears the occupied flag for the current
         // ThreadContext.
@@ -507,48 +919,12 @@ schedulerMainLoop() {
         // it from racing against thread creations that come before the start
         // of the outer loop, since the occupied flags for such creations would
         // get wiped out by this code.
-        bool success;
-        MaskAndCount slotMap;
-        do {
-            slotMap = *core.localOccupiedAndCount;
-            MaskAndCount oldSlotMap = slotMap;
-            if (slotMap.numOccupied == 0) {
-                ARACHNE_LOG(ERROR,
-                            "Thread Exit on Core %d: Detected numOccupied == 0 "
-                            "occupied %lu\n",
-                            core.id, slotMap.occupied);
-                abort();
-            }
-            slotMap.numOccupied--;
-
-            slotMap.occupied = slotMap.occupied &
-                               ~(1L << core.loadedContext->idInCore) &
-                               0x00FFFFFFFFFFFFFF;
-            success = core.localOccupiedAndCount->compare_exchange_strong(
-                oldSlotMap, slotMap, std::memory_order_acq_rel);
-        } while (!success);
-
-        // Reset highestOccupiedContext based on value of occupied flag, which
-        // we just CASed in, and the pinned context mask, which we just set.
-        // It is necessary to consider pinMask because it forces other cores
-        // attempting to migrate threads to this core to target contexts at
-        // slots above the pinned context, even if the pinned context is
-        // unocupied, which creates a gap between highestOccupiedContext and
-        // the next occupied context.
-        uint64_t occupiedOrPinned = slotMap.occupied | pinMask;
-
-        // The result of __builtin_clzll is undefined if occupied is 0.
-        // The function __builtin_clzll returns the number leading 0-bits,
-        // so subtract the return value of 63 to get a zero-based bit index
-        core.highestOccupiedContext =
-            occupiedOrPinned == 0
-                ? 0
-                : static_cast<uint8_t>(63 - __builtin_clzll(occupiedOrPinned));
+        releaseOccupiedSlot(idInCore);
 
         // Newborn threads should not have elevated priority, even if the
         // predecessors had leftover priority
-        core.privatePriorityMask &= ~(1L << (core.loadedContext->idInCore));
-        *core.highPriorityThreads &= ~(1L << (core.loadedContext->idInCore));
+        core.privatePriorityMask[pinWord] &= ~contextBit(idInCore);
+        core.highPriorityThreads[pinWord] &= ~contextBit(idInCore);
         PerfStats::threadStats->numThreadsFinished++;
 
         core.loadedContext->joinCV.broadcast();
@@ -566,17 +942,42 @@ yield() {
     // error.
     if (!core.loadedContext)
         return;
-    if (core.localOccupiedAndCount->load().numOccupied == 1 && !shutdown &&
-        !core.coreReadyForReturnToArbiter) {
-        // Even if the current core is running a single Arachne thread, it must
-        // still check for the preemption by the core arbiter. This check is
-        // typically done in dispatch(), but we skip going through the dispatch
-        // loop as an optimization.
-        checkForArbiterRequest();
-        return;
+    int selfWord = contextWord(core.loadedContext->idInCore);
+    uint64_t selfMask = contextBit(core.loadedContext->idInCore);
+    if (!shutdown && !core.coreReadyForReturnToArbiter) {
+        bool othersRunnable =
+            core.injectedThreads.load(std::memory_order_relaxed) != NULL;
+        if (!othersRunnable && localNumOccupied() > 1) {
+            // Collect any wakeups that are due before deciding whether some
+            // other thread could run.
+            checkSysRing();
+            if (core.timerWheel.size() != 0 ||
+                core.migratedTimers.load(std::memory_order_relaxed) != NULL)
+                checkTimers(core, Cycles::rdtsc());
+            for (int w = 0; w < numContextWords && !othersRunnable; w++) {
+                uint64_t runnable =
+                    core.privatePriorityMask[w] | core.highPriorityThreads[w];
+                for (int level = 0; level < NUM_PRIORITY_LEVELS; level++)
+                    runnable |= core.privateRunnableMask[level][w] |
+                                core.runnableThreads[level * numContextWords +
+                                                     w];
+                if (w == selfWord)
+                    runnable &= ~selfMask;
+                othersRunnable = runnable != 0;
+            }
+        }
+        if (!othersRunnable) {
+            // Even if no other thread on the current core is runnable, we
+            // must still check for the preemption by the core arbiter. This
+            // check is typically done in dispatch(), but we skip going through
+            // the dispatch loop as an optimization.
+            checkForArbiterRequest();
+            return;
+        }
     }
     // This thread is still runnable since it is merely yielding.
     core.loadedContext->wakeupTimeInCycles = 0L;
+    markRunnableLocally(core.loadedContext);
     dispatch();
 }
 
@@ -595,10 +996,109 @@ nanosleep(uint64_t ns) {
  */
 void
 sleepForCycles(uint64_t cycles) {
-    core.loadedContext->wakeupTimeInCycles = Cycles::rdtsc() + cycles;
+    core.loadedContext->wakeupTimeInCycles = ThreadContext::BLOCKED;
+    armTimer(Cycles::rdtsc() + cycles);
     dispatch();
 }
 
+/**
+ * Make runnable a thread whose timer has expired. Threads which have already
+ * been made runnable by some other means are left untouched.
+ */
+static void
+expireTimer(Timer* timer) {
+    ThreadContext* context = timer->context;
+    if (compareExchange(&context->wakeupTimeInCycles, ThreadContext::BLOCKED,
+                        0L) == ThreadContext::BLOCKED)
+        markRunnableLocally(context);
+}
+
+/**
+ * Move the timers that other cores have migrated to this core into its timer
+ * wheel.
+ */
+static void
+adoptMigratedTimers() {
+    Timer* timer =
+        core.migratedTimers.exchange(NULL, std::memory_order_acquire);
+    while (timer != NULL) {
+        Timer* next = timer->nextMigrated;
+        timer->nextMigrated = NULL;
+        if (!core.timerWheel.add(timer)) {
+            timer->deadline = 0;
+            expireTimer(timer);
+        }
+        timer = next;
+    }
+}
+
+/**
+ * Arrange for the currently running thread to be made runnable once the cycle
+ * counter reaches wakeupTime. The caller must mark itself BLOCKED and invoke
+ * dispatch() immediately afterwards; the timer is disarmed as soon as the
+ * thread runs again, whether or not the timer is what woke it.
+ *
+ * \param wakeupTime
+ *     The cycle counter value at which the thread should wake.
+ */
+void
+armTimer(uint64_t wakeupTime) {
+    Timer* timer = &core.loadedContext->timer;
+    timer->deadline = wakeupTime;
+    if (!core.timerWheel.add(timer)) {
+        timer->deadline = 0;
+        core.loadedContext->wakeupTimeInCycles = 0L;
+        markRunnableLocally(core.loadedContext);
+    }
+}
+
+/**
+ * Disarm the timer of a thread that has just resumed. This is kept out of
+ * line so that it reads the thread-local core afresh, since the thread may
+ * have been migrated to another core while it was waiting.
+ */
+static void __attribute__((noinline))
+disarmTimer(ThreadContext* context) {
+    // The timer may not yet have been adopted by this core after migration.
+    if (context->timer.wheel == NULL)
+        adoptMigratedTimers();
+    if (context->timer.armed())
+        context->timer.wheel->cancel(&context->timer);
+}
+
+/**
+ * Adopt timers migrated to this core and make runnable the threads whose
+ * timers have expired.
+ */
+static inline void
+checkTimers(Core& core, uint64_t now) {
+    if (unlikely(core.migratedTimers.load(std::memory_order_relaxed) != NULL))
+        adoptMigratedTimers();
+    core.timerWheel.advance(now, expireTimer);
+}
+
+/**
+ * Hand the armed timer of a thread being migrated to the core that will now
+ * host it; the timer keeps its original deadline.
+ */
+static void
+migrateTimer(Timer* timer, int coreId) {
+    uint64_t deadline = timer->deadline;
+    core.timerWheel.cancel(timer);
+    timer->deadline = deadline;
+
+    std::atomic<Timer*>& migratedTimers = coreMap[coreId]->migratedTimers;
+    Timer* head = migratedTimers.load(std::memory_order_relaxed);
+    do {
+        timer->nextMigrated = head;
+    } while (!migratedTimers.compare_exchange_weak(
+        head, timer, std::memory_order_release, std::memory_order_relaxed));
+
+    // A parked core must recompute how long it may sleep.
+    if (coreMap[coreId]->parked.load())
+        unparkCore(coreMap[coreId]);
+}
+
 /**
  * Return a thread handle for the currently executing thread, identical to the
  * one returned by the createThread call that initially created this thread.
@@ -615,19 +1115,679 @@ getThreadId() {
                : Arachne::NullThread;
 }
 
+/**
+ * Change the priority level of the current thread. Whenever a core has
+ * runnable threads at several levels, it runs those at the highest level
+ * first and takes turns among them; a thread at a lower level runs only once
+ * no higher-level thread is runnable, or once its level has been passed over
+ * for priorityAgingNs. Raising the priority of a woken thread with
+ * schedule() only moves it ahead of threads at its own or lower levels.
+ *
+ * \param priority
+ *     The new priority level, between DEFAULT_PRIORITY (the lowest) and
+ *     NUM_PRIORITY_LEVELS - 1. Out-of-range values are ignored.
+ */
+void
+setPriority(int priority) {
+    if (!core.loadedContext || priority < DEFAULT_PRIORITY ||
+        priority >= NUM_PRIORITY_LEVELS)
+        return;
+    // A wakeup that raced with this call may have left a bit at the old
+    // level, which only costs dispatch() a check.
+    core.loadedContext->priority = static_cast<uint8_t>(priority);
+}
+
+/**
+ * Return the priority level of the current thread, or DEFAULT_PRIORITY if
+ * the caller is not an Arachne thread.
+ */
+int
+getPriority() {
+    return core.loadedContext ? core.loadedContext->priority
+                              : DEFAULT_PRIORITY;
+}
+
+/**
+ * Give the current thread, which must have been created with
+ * createThreadWithDeadline(), a new deadline; for example, a periodic thread
+ * calls this at the start of each period. If the previous deadline has
+ * already passed, it counts as missed.
+ *
+ * \param deadlineInCycles
+ *     The value of the cycle counter by which the current thread should
+ *     finish its work. Calls from threads of other classes are ignored.
+ */
+void
+setDeadline(uint64_t deadlineInCycles) {
+    if (!core.loadedContext ||
+        core.loadedContext->threadClass != CorePolicy::DEADLINE_CLASS)
+        return;
+    if (Cycles::rdtsc() > *core.loadedContext->deadlineInCycles)
+        PerfStats::threadStats->numDeadlineMisses++;
+    *core.loadedContext->deadlineInCycles = deadlineInCycles;
+}
+
+/**
+ * Return the deadline of the current thread, or 0 if the caller is not an
+ * Arachne thread of CorePolicy::DEADLINE_CLASS.
+ */
+uint64_t
+getDeadline() {
+    if (!core.loadedContext ||
+        core.loadedContext->threadClass != CorePolicy::DEADLINE_CLASS)
+        return 0;
+    return *core.loadedContext->deadlineInCycles;
+}
+
+/**
+ * Choose the stack class that threads of the given thread class are created
+ * with, unless their creator picks one with createThreadWithStackClass().
+ * Threads of classes without a stack class run on their ThreadContext's own
+ * stack of stackSize bytes. This should be invoked before any threads of the
+ * class are created.
+ *
+ * \param threadClass
+ *     The thread class to set the stack class of.
+ * \param stackClass
+ *     An index into STACK_CLASS_SIZES, or OWN_STACK.
+ * \return
+ *     False if either class is out of range, in which case nothing changes.
+ *     Thread classes range up to MAX_STACK_THREAD_CLASSES.
+ */
+bool
+setStackClass(int threadClass, int stackClass) {
+    if (threadClass < 0 || threadClass >= MAX_STACK_THREAD_CLASSES ||
+        stackClass < OWN_STACK || stackClass >= NUM_STACK_CLASSES)
+        return false;
+    threadClassStackClasses[threadClass].store(stackClass - OWN_STACK,
+                                               std::memory_order_relaxed);
+    return true;
+}
+
+/**
+ * Map a stack of the given stack class for a stack pool, preceded by a guard
+ * page like the stacks in stackRegion.
+ */
+static void*
+mapPooledStack(int stackClass) {
+    size_t size = STACK_CLASS_SIZES[stackClass] + PAGE_SIZE;
+    void* region = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED) {
+        ARACHNE_LOG(ERROR, "Failed to map %lu bytes for a stack: %s", size,
+                    strerror(errno));
+        abort();
+    }
+    if (mprotect(region, PAGE_SIZE, PROT_NONE) != 0)
+        ARACHNE_LOG(WARNING, "Failed to protect guard page for a stack: %s",
+                    strerror(errno));
+    PerfStats::threadStats->numStackPoolMisses++;
+    PerfStats::threadStats->pooledStackBytes += STACK_CLASS_SIZES[stackClass];
+    char* stack = reinterpret_cast<char*>(region) + PAGE_SIZE;
+    if (profileStackUsage)
+        paintStack(stack, stack + STACK_CLASS_SIZES[stackClass]);
+    return stack;
+}
+
+/**
+ * The first function to run on a pooled stack: run the thread of the current
+ * context, then switch back to the context's own stack, where
+ * runOnPooledStack() is waiting.
+ */
+static void
+pooledStackMain() {
+    // The context stays the same even if the thread migrates to another core.
+    ThreadContext* context = core.loadedContext;
+    reinterpret_cast<ThreadInvocationEnabler*>(&context->threadInvocation)
+        ->runThread();
+    void* discardedSp;
+    arachne_swapcontext(&context->ownStackSp, &discardedSp);
+}
+
+/**
+ * Return the pooled stack of a thread that has exited to the pool of the
+ * current core. This is kept out of line so that it reads the thread-local
+ * core afresh, since the thread may have been migrated to another core.
+ */
+static void __attribute__((noinline))
+returnPooledStack(ThreadContext* context) {
+    if (profileStackUsage) {
+        size_t size = STACK_CLASS_SIZES[context->stackClass];
+        recordStackUsage(context->threadClass, context->pooledStack, size,
+                         reinterpret_cast<char*>(context->pooledStack) + size);
+    }
+    core.stackPools[context->stackClass].push_back(context->pooledStack);
+    context->pooledStack = NULL;
+}
+
+/**
+ * Run the thread in the given context, which is starting on the current core,
+ * on a stack of its stack class from this core's pool, and return once the
+ * thread has exited.
+ */
+static void
+runOnPooledStack(ThreadContext* context) {
+    std::vector<void*>& pool = core.stackPools[context->stackClass];
+    if (pool.empty())
+        pool.push_back(mapPooledStack(context->stackClass));
+    context->pooledStack = pool.back();
+    pool.pop_back();
+    // A trimmed stack becomes resident again as the thread uses it.
+    size_t& numTrimmed = core.numTrimmedPooledStacks[context->stackClass];
+    if (pool.size() < numTrimmed) {
+        numTrimmed = pool.size();
+        PerfStats::threadStats->pooledStackBytes +=
+            STACK_CLASS_SIZES[context->stackClass];
+    }
+
+    // Lay out the top of the stack as initializeStack() does, so that
+    // switching to it enters pooledStackMain().
+    char* sp = reinterpret_cast<char*>(context->pooledStack) +
+               STACK_CLASS_SIZES[context->stackClass] - 2 * sizeof(void*);
+    *reinterpret_cast<void**>(sp) = reinterpret_cast<void*>(pooledStackMain);
+    void* entrySp = sp - SPACE_FOR_SAVED_REGISTERS;
+    arachne_swapcontext(&entrySp, &context->ownStackSp);
+    returnPooledStack(context);
+}
+
+/**
+ * Allocate a key for fiber-local storage, which gives each Arachne thread its
+ * own value, unlike thread_local, which is shared by all of the Arachne
+ * threads on a core. Keys are never freed, so they should be allocated once,
+ * for example during initialization.
+ *
+ * \param destructor
+ *     If not NULL, this is invoked on each thread's non-NULL value for the key
+ *     when the thread exits.
+ * \return
+ *     The key, for getFiberLocal() and setFiberLocal(), or -1 if all
+ *     NUM_FIBER_LOCAL_SLOTS keys are taken.
+ */
+int
+createFiberLocalKey(void (*destructor)(void*)) {
+    int key = numFiberLocalKeys.load();
+    do {
+        if (key >= NUM_FIBER_LOCAL_SLOTS)
+            return -1;
+    } while (!numFiberLocalKeys.compare_exchange_weak(key, key + 1));
+    fiberLocalDestructors[key] = destructor;
+    return key;
+}
+
+/**
+ * Invoke the destructors for the fiber-local values of the thread that has
+ * just exited from the given context, and clear the values for the next
+ * thread. Values that the destructors set are cleared without being
+ * destroyed.
+ */
+static void
+destroyFiberLocals(ThreadContext* context) {
+    int numKeys = numFiberLocalKeys.load(std::memory_order_relaxed);
+    for (int key = 0; key < numKeys; key++) {
+        void* value = context->fiberLocals[key];
+        if (value == NULL)
+            continue;
+        context->fiberLocals[key] = NULL;
+        if (fiberLocalDestructors[key] != NULL)
+            fiberLocalDestructors[key](value);
+    }
+    for (int key = 0; key < numKeys; key++)
+        context->fiberLocals[key] = NULL;
+}
+
+/**
+ * Return the pages between start and end, rounded inwards to page boundaries,
+ * to the operating system, and return the number of bytes of them that were
+ * resident.
+ */
+static uint64_t
+releaseStackPages(char* start, char* end) {
+    start = reinterpret_cast<char*>(
+        (reinterpret_cast<uintptr_t>(start) + PAGE_SIZE - 1) &
+        ~static_cast<uintptr_t>(PAGE_SIZE - 1));
+    end = reinterpret_cast<char*>(reinterpret_cast<uintptr_t>(end) &
+                                  ~static_cast<uintptr_t>(PAGE_SIZE - 1));
+    if (start >= end)
+        return 0;
+    uint64_t residentPages = 0;
+    unsigned char residency[256];
+    for (char* chunk = start; chunk < end;
+         chunk += sizeof(residency) * PAGE_SIZE) {
+        size_t length =
+            std::min<size_t>(end - chunk, sizeof(residency) * PAGE_SIZE);
+        if (mincore(chunk, length, residency) != 0)
+            break;
+        for (size_t i = 0; i < length / PAGE_SIZE; i++)
+            residentPages += residency[i] & 1;
+    }
+    if (madvise(start, end - start, MADV_DONTNEED) != 0)
+        return 0;
+    return residentPages * PAGE_SIZE;
+}
+
+/**
+ * Release the stack memory of the unoccupied contexts of the current core
+ * below their saved stack pointers, and of the stacks in its stack pools.
+ * Nothing is released while profileStackUsage is set, since it would erase
+ * the paint.
+ *
+ * \param longUnoccupiedOnly
+ *     True means that only contexts that have hosted no thread since the
+ *     previous trim are released; false means all unoccupied contexts.
+ */
+static void
+trimLocalStacks(bool longUnoccupiedOnly) {
+    core.trimStacksRequested = false;
+    if (profileStackUsage)
+        return;
+    uint64_t reclaimed = 0;
+    for (int k = 0; k < maxThreadsPerCore; k++) {
+        ThreadContext* context = core.localThreadContexts[k];
+        // The loaded context's saved stack pointer is stale, since its stack
+        // is in use.
+        if (context == core.loadedContext ||
+            context->wakeupTimeInCycles != ThreadContext::UNOCCUPIED)
+            continue;
+        if (context->trimGeneration != context->generation) {
+            context->trimGeneration = context->generation;
+            context->stackTrimmed = false;
+            if (longUnoccupiedOnly)
+                continue;
+        }
+        if (context->stackTrimmed)
+            continue;
+        reclaimed += releaseStackPages(reinterpret_cast<char*>(context->stack),
+                                       reinterpret_cast<char*>(context->sp));
+        context->stackTrimmed = true;
+    }
+    for (int stackClass = 0; stackClass < NUM_STACK_CLASSES; stackClass++) {
+        std::vector<void*>& pool = core.stackPools[stackClass];
+        size_t& numTrimmed = core.numTrimmedPooledStacks[stackClass];
+        for (; numTrimmed < pool.size(); numTrimmed++) {
+            char* bottom = reinterpret_cast<char*>(pool[numTrimmed]);
+            reclaimed += releaseStackPages(
+                bottom, bottom + STACK_CLASS_SIZES[stackClass]);
+            PerfStats::threadStats->pooledStackBytes -=
+                STACK_CLASS_SIZES[stackClass];
+        }
+    }
+    PerfStats::threadStats->reclaimedStackBytes += reclaimed;
+}
+
+/**
+ * Ask every core to return to the operating system the stack memory of its
+ * contexts that have hosted no thread since the previous call to this
+ * function, and of its pooled stacks. Cores do this asynchronously, at the
+ * end of their next dispatch() round; the bytes they reclaim are counted in
+ * PerfStats::reclaimedStackBytes. Calling this periodically releases the
+ * stacks that have been idle for at least one period.
+ */
+void
+trimStacks() {
+    for (Core* target : coreMap) {
+        if (target == NULL)
+            continue;
+        target->trimStacksRequested = true;
+        if (target->parked.load())
+            unparkCore(target);
+    }
+}
+
+/**
+ * Return a buffer for the main function and arguments of a thread being
+ * created, which do not fit in ThreadContext::threadInvocation. Buffers come
+ * from the current core's free lists; callers that are not Arachne threads
+ * get theirs from malloc.
+ *
+ * \param size
+ *     The number of bytes needed; at most the largest invocation class.
+ * \return
+ *     The address of the buffer's contents, to pass to freeInvocationBuffer()
+ *     once the thread is done with them.
+ */
+void*
+allocInvocationBuffer(size_t size) {
+    int invocationClass = 0;
+    while (INVOCATION_CLASS_SIZES[invocationClass] < size)
+        invocationClass++;
+    size_t bufferSize =
+        sizeof(InvocationBuffer) + INVOCATION_CLASS_SIZES[invocationClass];
+    InvocationBuffer* buffer;
+    if (core.loadedContext == NULL) {
+        buffer = reinterpret_cast<InvocationBuffer*>(malloc(bufferSize));
+        if (buffer == NULL) {
+            ARACHNE_LOG(ERROR, "malloc of %lu bytes failed", bufferSize);
+            abort();
+        }
+        buffer->owner = NULL;
+    } else {
+        InvocationBuffer*& freeBuffers =
+            core.freeInvocationBuffers[invocationClass];
+        if (freeBuffers == NULL)
+            freeBuffers =
+                core.remoteInvocationBuffers[invocationClass].exchange(NULL);
+        if (freeBuffers == NULL) {
+            char* chunk = reinterpret_cast<char*>(
+                alignedAlloc(bufferSize * INVOCATION_BUFFERS_PER_CHUNK));
+            core.invocationChunks.push_back(chunk);
+            for (int i = 0; i < INVOCATION_BUFFERS_PER_CHUNK; i++) {
+                InvocationBuffer* newBuffer =
+                    reinterpret_cast<InvocationBuffer*>(chunk + i * bufferSize);
+                newBuffer->next = freeBuffers;
+                freeBuffers = newBuffer;
+            }
+        }
+        buffer = freeBuffers;
+        freeBuffers = buffer->next;
+        buffer->owner = &core;
+    }
+    buffer->invocationClass = invocationClass;
+    return buffer + 1;
+}
+
+/**
+ * Return a buffer from allocInvocationBuffer() to the core it came from.
+ * This may be invoked on any core, including after the thread using the
+ * buffer has migrated.
+ *
+ * \param contents
+ *     The value allocInvocationBuffer() returned.
+ */
+void
+freeInvocationBuffer(void* contents) {
+    InvocationBuffer* buffer =
+        reinterpret_cast<InvocationBuffer*>(contents) - 1;
+    Core* owner = buffer->owner;
+    if (owner == NULL) {
+        free(buffer);
+    } else if (owner == &core) {
+        buffer->next = core.freeInvocationBuffers[buffer->invocationClass];
+        core.freeInvocationBuffers[buffer->invocationClass] = buffer;
+    } else {
+        std::atomic<InvocationBuffer*>& remoteBuffers =
+            owner->remoteInvocationBuffers[buffer->invocationClass];
+        buffer->next = remoteBuffers.load(std::memory_order_relaxed);
+        while (!remoteBuffers.compare_exchange_weak(buffer->next, buffer,
+                                                    std::memory_order_release))
+            continue;
+    }
+}
+
+/**
+ * Fill the words of a stack from bottom up to end with STACK_PAINT.
+ */
+void
+paintStack(void* bottom, void* end) {
+    for (uint64_t* word = reinterpret_cast<uint64_t*>(bottom);
+         word < reinterpret_cast<uint64_t*>(end); word++)
+        *word = STACK_PAINT;
+}
+
+/**
+ * Return how many bytes at the top of a painted stack have been written,
+ * judging by the lowest word that no longer holds STACK_PAINT.
+ *
+ * \param stack
+ *     The lowest address of the stack.
+ * \param size
+ *     The size of the stack in bytes.
+ */
+size_t
+stackDepth(void* stack, size_t size) {
+    uint64_t* word = reinterpret_cast<uint64_t*>(stack);
+    uint64_t* end = reinterpret_cast<uint64_t*>(
+        reinterpret_cast<char*>(stack) + size);
+    while (word < end && *word == STACK_PAINT)
+        word++;
+    return reinterpret_cast<char*>(end) - reinterpret_cast<char*>(word);
+}
+
+/**
+ * Record the depth that a painted stack reached in the histogram of the given
+ * thread class, and paint the part of it that was written again, up to
+ * paintLimit, so that it can be measured for the next thread.
+ */
+static void
+recordStackUsage(int threadClass, void* stack, size_t size, void* paintLimit) {
+    size_t depth = stackDepth(stack, size);
+    int bucket = 0;
+    while (bucket < NUM_STACK_USAGE_BUCKETS - 1 &&
+           depth > (static_cast<size_t>(1024) << bucket))
+        bucket++;
+    {
+        std::lock_guard<SpinLock> _(stackUsageMutex);
+        if (threadClass >= static_cast<int>(stackUsageHistograms.size()))
+            stackUsageHistograms.resize(threadClass + 1, StackUsageHistogram());
+        StackUsageHistogram& histogram = stackUsageHistograms[threadClass];
+        histogram.counts[bucket]++;
+        histogram.maxBytes = std::max<uint64_t>(histogram.maxBytes, depth);
+    }
+    paintStack(reinterpret_cast<char*>(stack) + size - depth, paintLimit);
+}
+
+/**
+ * Record the depth that the own stack of the given context reached before its
+ * thread exited. This runs on that very stack, so the part of it below this
+ * function's frame is all that can be painted again; the frames above stay
+ * about as deep for every thread, and are counted in each thread's use.
+ */
+static void __attribute__((noinline))
+recordOwnStackUsage(ThreadContext* context) {
+    char* paintLimit = reinterpret_cast<char*>(__builtin_frame_address(0)) -
+                       SPACE_FOR_STACK_PROFILING;
+    recordStackUsage(context->threadClass, context->stack, stackSize,
+                     paintLimit);
+}
+
+/**
+ * Return a copy of the histogram of how deep the stacks of the exited threads
+ * of a thread class grew. The histogram stays empty unless the
+ * --profileStackUsage option was given or profileStackUsage was set before
+ * the stacks were set up.
+ */
+StackUsageHistogram
+getStackUsage(int threadClass) {
+    std::lock_guard<SpinLock> _(stackUsageMutex);
+    if (threadClass < 0 ||
+        threadClass >= static_cast<int>(stackUsageHistograms.size()))
+        return StackUsageHistogram();
+    return stackUsageHistograms[threadClass];
+}
+
 void
 checkSysRing()
 {
-    if (core.pending_requests.empty())
+    if (unlikely(core.registrations_seen.load(std::memory_order_relaxed) <
+                 registrations_generation.load(std::memory_order_relaxed)))
+        update_registrations();
+    // Starved recv streams wait here for the buffers other cores give back.
+    if (core.pending_requests.empty() && core.starved_recv_streams.empty())
         return;
     auto cycles = Cycles::rdtsc();
 
+    if (core.sys_io_ring_backlog.load(std::memory_order_relaxed) != 0 &&
+        cycles - core.sys_io_ring_backlog_since >=
+            Cycles::fromNanoseconds(submitBatchAgeNs))
+        flush_submissions();
     if (core.last_sys_check > cycles - Cycles::fromMicroseconds(2))
         return;
     core.last_sys_check = cycles;
     check_for_completions(std::addressof(core.sys_io_ring));
 }
 
+/**
+ * Invoked by dispatch() when it is about to run a thread at the given
+ * priority level. Note when each lower level with candidates started being
+ * passed over, and pick the one which has waited longest, if it has waited
+ * at least priorityAgingNs.
+ *
+ * \param level
+ *     The priority level dispatch() would otherwise run a thread from.
+ * \param now
+ *     The current time in cycles.
+ * \return
+ *     The priority level to run a thread from instead, or -1 if no lower
+ *     level has starved.
+ */
+static inline int
+findStarvedLevel(int level, uint64_t now) {
+    uint64_t agingCycles = Cycles::fromNanoseconds(priorityAgingNs);
+    int starvedLevel = -1;
+    uint64_t oldestWaitingSince = now;
+    for (int lower = 0; lower < level; lower++) {
+        uint64_t waitingSince = core.levelWaitingSince[lower];
+        if (!anyContext(core.privateRunnableMask[lower])) {
+            core.levelWaitingSince[lower] = 0;
+        } else if (waitingSince == 0) {
+            core.levelWaitingSince[lower] = now;
+        } else if (now - waitingSince >= agingCycles &&
+                   waitingSince <= oldestWaitingSince) {
+            starvedLevel = lower;
+            oldestWaitingSince = waitingSince;
+        }
+    }
+    return starvedLevel;
+}
+
+/**
+ * Return true if this core may host threads of CorePolicy::DEADLINE_CLASS.
+ */
+static inline bool
+hasDeadlineThreads() {
+    for (int w = 0; w < numContextWords; w++)
+        if (core.deadlineThreads[w] ||
+            core.newDeadlineThreads[w].load(std::memory_order_relaxed))
+            return true;
+    return false;
+}
+
+/**
+ * Return the index of the context with the earliest deadline in the given
+ * packed deadlines among those whose bits are set in candidates, preferring
+ * lower indexes among equal deadlines, or -1 if no bits are set.
+ */
+int
+earliestDeadlineSlotScalar(const uint64_t* deadlines,
+                           const uint64_t* candidates) {
+    int earliest = -1;
+    for (int w = 0; w < numContextWords; w++) {
+        for (uint64_t bits = candidates[w]; bits != 0; bits &= bits - 1) {
+            int index = (w << 6) + __builtin_ctzll(bits);
+            if (earliest < 0 || deadlines[index] < deadlines[earliest])
+                earliest = index;
+        }
+    }
+    return earliest;
+}
+
+#ifdef __x86_64__
+/**
+ * The same as earliestDeadlineSlotScalar(), but comparing four slots at a
+ * time with AVX2. This must only be called if the CPU supports AVX2.
+ */
+__attribute__((target("avx2"))) int
+earliestDeadlineSlotAvx2(const uint64_t* deadlines,
+                         const uint64_t* candidates) {
+    // AVX2 only compares signed 64-bit values, so flip the sign bits to
+    // preserve the unsigned order.
+    const __m256i signBits = _mm256_set1_epi64x(INT64_MIN);
+    const __m256i laneBits = _mm256_set_epi64x(8, 4, 2, 1);
+    const __m256i none = _mm256_set1_epi64x(INT64_MAX);
+    __m256i minimum = none;
+    bool found = false;
+    for (int w = 0; w < numContextWords; w++) {
+        uint64_t bits = candidates[w];
+        for (int group = 0; bits != 0; group++, bits >>= 4) {
+            uint64_t nibble = bits & 0xF;
+            if (nibble == 0)
+                continue;
+            found = true;
+            __m256i lanes = _mm256_and_si256(
+                _mm256_set1_epi64x(static_cast<int64_t>(nibble)), laneBits);
+            __m256i selected = _mm256_cmpeq_epi64(lanes, laneBits);
+            __m256i values = _mm256_xor_si256(
+                _mm256_load_si256(reinterpret_cast<const __m256i*>(
+                    deadlines + (w << 6) + (group << 2))),
+                signBits);
+            values = _mm256_blendv_epi8(none, values, selected);
+            minimum = _mm256_blendv_epi8(
+                minimum, values, _mm256_cmpgt_epi64(minimum, values));
+        }
+    }
+    if (!found)
+        return -1;
+    alignas(32) uint64_t lanesOut[4];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanesOut), minimum);
+    uint64_t earliest = ~0UL;
+    for (int lane = 0; lane < 4; lane++)
+        earliest = std::min(earliest, lanesOut[lane] ^ (1UL << 63));
+    for (int w = 0; w < numContextWords; w++) {
+        for (uint64_t bits = candidates[w]; bits != 0; bits &= bits - 1) {
+            int index = (w << 6) + __builtin_ctzll(bits);
+            if (deadlines[index] == earliest)
+                return index;
+        }
+    }
+    return -1;
+}
+
+/**
+ * True if earliestDeadlineSlot() may use earliestDeadlineSlotAvx2(). This is
+ * set during dynamic initialization, in no particular order relative to the
+ * constructors of other translation units, so __builtin_cpu_init() must be
+ * called explicitly. Before then it is false, which selects the scalar scan.
+ */
+bool cpuHasAvx2 = (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+#else
+bool cpuHasAvx2 = false;
+#endif
+
+/**
+ * Return the index of the context with the earliest deadline in the given
+ * packed deadlines among those whose bits are set in candidates, or -1 if no
+ * bits are set; see earliestDeadlineSlotScalar(). The AVX2 version is chosen
+ * at runtime when the CPU supports it, so it ships with the default build.
+ */
+int
+earliestDeadlineSlot(const uint64_t* deadlines, const uint64_t* candidates) {
+#ifdef __x86_64__
+    if (cpuHasAvx2)
+        return earliestDeadlineSlotAvx2(deadlines, candidates);
+#endif
+    return earliestDeadlineSlotScalar(deadlines, candidates);
+}
+
+/**
+ * Return the runnable thread of CorePolicy::DEADLINE_CLASS on this core with
+ * the earliest deadline, or NULL if there is none. Deadlines are compared in
+ * the packed core.localDeadlines, so only the ThreadContexts of the earliest
+ * candidates are touched to check that they are runnable.
+ */
+static inline ThreadContext*
+earliestDeadlineContext() {
+    uint64_t candidates[MAX_CONTEXT_WORDS];
+    for (int w = 0; w < numContextWords; w++) {
+        if (core.newDeadlineThreads[w].load(std::memory_order_relaxed))
+            core.deadlineThreads[w] |= core.newDeadlineThreads[w].exchange(0);
+        candidates[w] = core.deadlineThreads[w];
+    }
+    for (;;) {
+        int index = earliestDeadlineSlot(core.localDeadlines, candidates);
+        if (index < 0)
+            return NULL;
+        candidates[contextWord(index)] &= ~contextBit(index);
+        ThreadContext* context = core.localThreadContexts[index];
+        // The context may have been reused by a thread of another class
+        // since its bit was set.
+        if (context->threadClass != CorePolicy::DEADLINE_CLASS) {
+            core.deadlineThreads[contextWord(index)] &= ~contextBit(index);
+            continue;
+        }
+        if (context->wakeupTimeInCycles == 0)
+            return context;
+    }
+}
+
 /**
  * Deschedule the current thread until its wakeup time is reached (which may
  * have already happened) and find another thread to run. All direct and
@@ -643,114 +1803,117 @@ dispatch() {
     // other kernel threads, since core.loadedContext is not reloaded correctly
     // from TLS after switching back to this context.
     ThreadContext* originalContext = core.loadedContext;
-    if (unlikely(*reinterpret_cast<uint64_t*>(core.loadedContext->stack) !=
-                 STACK_CANARY)) {
-        ARACHNE_LOG(ERROR,
-                    "Stack overflow detected on %p. Canary = %lu."
-                    " Aborting...\n",
-                    core.loadedContext,
-                    *reinterpret_cast<uint64_t*>(core.loadedContext->stack));
-        abort();
-    }
+    core.consecutiveSwitches = 0;
 
     // Check for core release request once before checking for high priority
     // threads.
     checkForArbiterRequest();
 
     uint64_t dispatchIterationStartCycles = Cycles::rdtsc();
+    checkTimers(core, dispatchIterationStartCycles);
+
+    // Runnable deadline threads go ahead of every priority level, earliest
+    // deadline first.
+    ThreadContext* targetContext = NULL;
+    if (unlikely(hasDeadlineThreads()))
+        targetContext = earliestDeadlineContext();
 
     // Check for high priority threads.
-    if (!core.privatePriorityMask) {
-        // Snapshot the high-priority threads in a core-local data structure
-        // and process all of them before the next snapshot; this avoids cache
-        // contention every time the priority of a thread is raised, and
-        // ensures that one high priority thread cannot starve out another.
-        core.privatePriorityMask = *core.highPriorityThreads;
-        if (core.privatePriorityMask)
-            *core.highPriorityThreads &= ~core.privatePriorityMask;
+    int firstSetBit = -1;
+    if (targetContext == NULL) {
+        firstSetBit = findNextContext(core.privatePriorityMask, 0);
+        if (firstSetBit < 0) {
+            // Snapshot the high-priority threads in a core-local data
+            // structure and process all of them before the next snapshot;
+            // this avoids cache contention every time the priority of a
+            // thread is raised, and ensures that one high priority thread
+            // cannot starve out another.
+            for (int w = 0; w < numContextWords; w++) {
+                core.privatePriorityMask[w] = core.highPriorityThreads[w];
+                if (core.privatePriorityMask[w])
+                    core.highPriorityThreads[w] &=
+                        ~core.privatePriorityMask[w];
+            }
+            firstSetBit = findNextContext(core.privatePriorityMask, 0);
+        }
     }
 
     // Run any high priority threads before searching the entire set of
     // contexts for runnable threads.
-    if (core.privatePriorityMask) {
-        checkSysRing();
-
-        // This position is one-indexed with zero meaning that no bits were
-        // set.
-        int firstSetBit = ffsll(core.privatePriorityMask) - 1;
-
-        core.privatePriorityMask &= ~(1L << (firstSetBit));
-
-        ThreadContext* targetContext = core.localThreadContexts[firstSetBit];
-
-        // Verify wakeup and occupied.
-        if (targetContext->wakeupTimeInCycles == 0) {
-            if (targetContext == core.loadedContext) {
-                core.loadedContext->wakeupTimeInCycles = ThreadContext::BLOCKED;
-                IdleTimeTracker::numThreadsRan++;
-
-                // It is necessary to update core.highestOccupiedContext
-                // here because two simultaneous returns from these
-                // priority checks (the higher index blocking and the lower
-                // index exiting) can result in a gap that cannot be
-                // bridged by the core.highestOccupiedContext increment
-                // mechanism below.
-                core.highestOccupiedContext = std::max(
-                    core.highestOccupiedContext, core.loadedContext->idInCore);
-                return;
-            }
-            void** saved = &core.loadedContext->sp;
-            core.loadedContext = targetContext;
+    if (firstSetBit >= 0) {
+        core.privatePriorityMask[contextWord(firstSetBit)] &=
+            ~contextBit(firstSetBit);
+
+        targetContext = core.localThreadContexts[firstSetBit];
+        if (targetContext->wakeupTimeInCycles == 0 &&
+            targetContext->priority < highestRunnableLevel()) {
+            // Raised priority only orders threads within a priority level, so
+            // this thread must wait for its turn at its own level.
+            markRunnableLocally(targetContext);
+            targetContext = NULL;
+        }
+    }
 
-            // Flush the idle cycle counter before a context switch because
-            // switching to a fresh (previously unused) context will cause
-            // dispatch to be called from the top again before this
-            // invocation returns. This is problematic because it resets
-            // dispatchStartCycles (used for computing idle cycles) but not
-            // lastTotalCollectionTime (used for computing total cycles).
-            idleTimeTracker.updatePerfStats();
-            arachne_swapcontext(&core.loadedContext->sp, saved);
-            originalContext->wakeupTimeInCycles = ThreadContext::BLOCKED;
+    // Verify wakeup and occupied.
+    if (targetContext != NULL && targetContext->wakeupTimeInCycles == 0) {
+        checkSysRing();
+        if (targetContext == core.loadedContext) {
+            core.loadedContext->wakeupTimeInCycles = ThreadContext::BLOCKED;
+            if (originalContext->timer.armed())
+                disarmTimer(originalContext);
             IdleTimeTracker::numThreadsRan++;
-            Arachne::core.highestOccupiedContext = std::max(
-                core.highestOccupiedContext, core.loadedContext->idInCore);
+            PerfStats::threadStats
+                ->numRunsAtPriority[originalContext->priority]++;
             return;
         }
+        void** saved = &core.loadedContext->sp;
+        core.loadedContext = targetContext;
+
+        // Flush the idle cycle counter before a context switch because
+        // switching to a fresh (previously unused) context will cause
+        // dispatch to be called from the top again before this invocation
+        // returns. This is problematic because it resets dispatchStartCycles
+        // (used for computing idle cycles) but not lastTotalCollectionTime
+        // (used for computing total cycles).
+        idleTimeTracker.updatePerfStats();
+        arachne_swapcontext(&core.loadedContext->sp, saved);
+        originalContext->wakeupTimeInCycles = ThreadContext::BLOCKED;
+        if (originalContext->timer.armed())
+            disarmTimer(originalContext);
+        IdleTimeTracker::numThreadsRan++;
+        PerfStats::threadStats->numRunsAtPriority[originalContext->priority]++;
+        return;
     }
-    // Find a thread to switch to
-    uint8_t currentIndex = core.nextCandidateIndex;
+    // Time at which this call began finding nothing to run; zero while it
+    // still finds candidates.
+    uint64_t idleSinceCycles = 0;
 
-    for (;; currentIndex++) {
+    // Find a thread to switch to
+    for (;;) {
         checkSysRing();
 
-        // Ensure that we do not go out of bounds.
-        if (currentIndex == maxThreadsPerCore) {
-            currentIndex = 0;
-        }
-
-        // At this point, it is guaranteed that it is safe to read the context
-        // information.
-        ThreadContext* currentContext = core.localThreadContexts[currentIndex];
-        if (currentIndex == core.highestOccupiedContext + 1) {
-            // Check whether we need to increment core.highestOccupiedContext or
-            // reset currentIndex.
-            if (currentContext->wakeupTimeInCycles !=
-                ThreadContext::UNOCCUPIED) {
-                core.highestOccupiedContext++;
-            } else {
-                currentIndex = 0;
-                // Reload the currentContext since we have reset currentIndex.
-                currentContext = core.localThreadContexts[currentIndex];
-            }
-        }
-        if (currentIndex == 0) {
-            // Update stats and check for arbiter preemption; done once per
-            // cycle over all contexts on this core.
+        // Take the next candidate at or after nextCandidateIndex of the
+        // highest priority level with candidates, so that the runnable
+        // threads of a level take turns in the order of their slots.
+        int level = highestRunnableLevel();
+        int currentIndex =
+            level < 0 ? -1
+                      : findNextContext(core.privateRunnableMask[level],
+                                        core.nextCandidateIndex[level]);
+        if (currentIndex < 0) {
+            // Every candidate at the highest level in this round has had its
+            // turn. Update stats and check for arbiter preemption; done once
+            // per round.
             checkForArbiterRequest();
             dispatchIterationStartCycles = Cycles::rdtsc();
+            checkTimers(core, dispatchIterationStartCycles);
             // Flush counters to keep times up to date
             idleTimeTracker.updatePerfStats();
 
+            // Hand the kernel every request queued during this pass at once.
+            if (core.sys_io_ring_backlog.load(std::memory_order_relaxed) != 0)
+                flush_submissions();
+
             // Check for termination
             if (shutdown) {
                 arachne_swapcontext(&kernelThreadStacks[core.id],
@@ -765,16 +1928,101 @@ dispatch() {
             IdleTimeTracker::numThreadsRan = 0;
             IdleTimeTracker::lastDispatchIterationStart =
                 dispatchIterationStartCycles;
+
+            // Start the next round with every thread woken by other cores.
+            for (level = 0; level < NUM_PRIORITY_LEVELS; level++) {
+                std::atomic<uint64_t>* shared =
+                    &core.runnableThreads[level * numContextWords];
+                for (int w = 0; w < numContextWords; w++) {
+                    if (shared[w].load(std::memory_order_relaxed))
+                        core.privateRunnableMask[level][w] |=
+                            shared[w].exchange(0);
+                }
+            }
+            if (unlikely(core.injectedThreads.load(
+                             std::memory_order_relaxed) != NULL ||
+                         core.heldInjectedThreads != NULL))
+                startInjectedThreads();
+            if (unlikely(core.stealRequest.load(std::memory_order_relaxed)))
+                handleStealRequest();
+            if (unlikely(core.trimStacksRequested.load(
+                    std::memory_order_relaxed)))
+                trimLocalStacks(true);
+            if (enableWorkStealing)
+                core.numRunnable.store(localNumRunnable(),
+                                       std::memory_order_relaxed);
+
+            // Levels whose candidates have all had their turn start over.
+            for (level = 0; level < NUM_PRIORITY_LEVELS; level++) {
+                if (findNextContext(core.privateRunnableMask[level],
+                                    core.nextCandidateIndex[level]) < 0)
+                    core.nextCandidateIndex[level] = 0;
+            }
+            level = highestRunnableLevel();
+            if (level < 0) {
+                if (enableWorkStealing)
+                    stealWork(dispatchIterationStartCycles);
+#ifdef DISABLE_ARBITER
+                if (idleSinceCycles == 0) {
+                    idleSinceCycles = dispatchIterationStartCycles;
+                } else if (idleSpinBudgetNs != 0 &&
+                           dispatchIterationStartCycles - idleSinceCycles >=
+                               Cycles::fromNanoseconds(idleSpinBudgetNs)) {
+                    parkCore();
+                    idleSinceCycles = 0;
+                }
+#endif
+                continue;
+            }
+            currentIndex = findNextContext(core.privateRunnableMask[level],
+                                           core.nextCandidateIndex[level]);
+            idleSinceCycles = 0;
+        }
+
+        // Let a lower level which has been passed over for too long run one
+        // thread.
+        if (level > 0 && priorityAgingNs != ~0UL) {
+            int starvedLevel =
+                findStarvedLevel(level, dispatchIterationStartCycles);
+            if (starvedLevel >= 0) {
+                level = starvedLevel;
+                currentIndex =
+                    findNextContext(core.privateRunnableMask[level],
+                                    core.nextCandidateIndex[level]);
+                if (currentIndex < 0)
+                    currentIndex =
+                        findNextContext(core.privateRunnableMask[level], 0);
+                PerfStats::threadStats->numPriorityAgings++;
+            }
         }
+        core.levelWaitingSince[level] = 0;
 
-        // Decide whether we can run the current thread.
-        if (dispatchIterationStartCycles >=
-            currentContext->wakeupTimeInCycles) {
-            core.nextCandidateIndex = currentIndex + 1;
+        core.privateRunnableMask[level][contextWord(currentIndex)] &=
+            ~contextBit(currentIndex);
+        core.nextCandidateIndex[level] =
+            static_cast<uint16_t>(currentIndex + 1);
 
+        // The mask may hold stale bits, for example for threads that already
+        // ran with elevated priority, so check that the thread is runnable.
+        ThreadContext* currentContext = core.localThreadContexts[currentIndex];
+        if (unlikely(hasDeadlineThreads()) &&
+            currentContext->wakeupTimeInCycles == 0) {
+            // Deadline threads woken since this call began still go first;
+            // the thread passed over keeps its turn.
+            ThreadContext* earliest = earliestDeadlineContext();
+            if (earliest != NULL && earliest != currentContext) {
+                markRunnableLocally(currentContext);
+                currentContext = earliest;
+            }
+        }
+        if (currentContext->wakeupTimeInCycles == 0) {
             if (currentContext == core.loadedContext) {
                 core.loadedContext->wakeupTimeInCycles = ThreadContext::BLOCKED;
+                if (originalContext->timer.armed())
+                    disarmTimer(originalContext);
                 IdleTimeTracker::numThreadsRan++;
+                PerfStats::threadStats
+                    ->numRunsAtPriority[originalContext->priority]++;
                 return;
             }
             void** saved = &core.loadedContext->sp;
@@ -791,7 +2039,11 @@ dispatch() {
             // After the old context is swapped out above, this line executes
             // in the new context.
             originalContext->wakeupTimeInCycles = ThreadContext::BLOCKED;
+            if (originalContext->timer.armed())
+                disarmTimer(originalContext);
             IdleTimeTracker::numThreadsRan++;
+            PerfStats::threadStats
+                ->numRunsAtPriority[originalContext->priority]++;
             return;
         }
     }
@@ -802,7 +2054,77 @@ dispatch() {
  * current thread's ThreadId.
  */
 void
-block() {
+block() {
+    dispatch();
+}
+
+/**
+ * Finish a switchTo() in the thread that has just resumed from it, doing what
+ * dispatch() does for threads that resume in it. This is kept out of line so
+ * that it reads the thread-local core afresh, since the thread may have been
+ * migrated to another core while it was waiting.
+ */
+static void __attribute__((noinline))
+finishSwitch(ThreadContext* context) {
+    // The thread that resumed this one may have done so from dispatch().
+    NestedDispatchDetector::clearDispatchFlag();
+    context->wakeupTimeInCycles = ThreadContext::BLOCKED;
+    if (context->timer.armed())
+        disarmTimer(context);
+    IdleTimeTracker::numThreadsRan++;
+    PerfStats::threadStats->numRunsAtPriority[context->priority]++;
+}
+
+/**
+ * Make the thread referred to by id runnable and give it the current core
+ * right away. If it is blocked on the current core, this switches to it
+ * directly, without the scan for runnable threads in dispatch() and
+ * regardless of the priorities of other runnable threads; otherwise it is
+ * equivalent to schedule() followed by block() or yield(). Handoffs bypass
+ * dispatch() at most MAX_CONSECUTIVE_SWITCHES times in a row on a core.
+ *
+ * \param id
+ *     The thread to run.
+ * \param remainRunnable
+ *     True means that the current thread remains runnable, as in yield();
+ *     false means that it blocks, as in block(), until it is scheduled.
+ */
+void
+switchTo(ThreadId id, bool remainRunnable) {
+    ThreadContext* self = core.loadedContext;
+    ThreadContext* target = id.context;
+    // Claim the wakeup of a blocked target, so that no other core makes it
+    // runnable while it runs here.
+    if (self != NULL && target != self && !shutdown &&
+        !core.coreReadyForReturnToArbiter &&
+        target->coreId == static_cast<uint8_t>(core.id) &&
+        target->generation == id.generation &&
+        core.consecutiveSwitches < MAX_CONSECUTIVE_SWITCHES &&
+        compareExchange(&target->wakeupTimeInCycles, ThreadContext::BLOCKED,
+                        0L) == ThreadContext::BLOCKED) {
+        core.consecutiveSwitches++;
+        PerfStats::threadStats->numDirectSwitches++;
+        if (remainRunnable) {
+            self->wakeupTimeInCycles = 0L;
+            markRunnableLocally(self);
+        }
+        core.loadedContext = target;
+        // A target blocked in dispatch() counts the cycles since
+        // dispatchStartCycles as idle once it resumes, but this core has been
+        // busy running the current thread.
+        IdleTimeTracker::dispatchStartCycles = Cycles::rdtsc();
+        arachne_swapcontext(&target->sp, &self->sp);
+        finishSwitch(self);
+        return;
+    }
+
+    schedule(id);
+    if (self == NULL)
+        return;
+    if (remainRunnable) {
+        self->wakeupTimeInCycles = 0L;
+        markRunnableLocally(self);
+    }
     dispatch();
 }
 
@@ -873,8 +2195,13 @@ schedule(ThreadId id) {
     // Raise the priority of the newly awakened thread except the UNOCCUPIED.
     if (oldWakeupTime != ThreadContext::UNOCCUPIED &&
         id.context->coreId != static_cast<uint8_t>(~0)) {
-        *coreMap[id.context->coreId]->highPriorityThreads |=
-            (1L << id.context->idInCore);
+        Core* targetCore = coreMap[id.context->coreId];
+        if (oldWakeupTime != 0L)
+            markRunnable(targetCore, id.context);
+        targetCore->highPriorityThreads[contextWord(id.context->idInCore)] |=
+            contextBit(id.context->idInCore);
+        if (targetCore->parked.load())
+            unparkCore(targetCore);
     }
 }
 
@@ -915,22 +2242,28 @@ waitForTermination() {
 
     for (size_t i = 0; i < occupiedAndCount.size(); i++) {
         free(occupiedAndCount[i]);
+        free(occupiedSlots[i]);
 
         for (int k = 0; k < maxThreadsPerCore; k++) {
-            free(allThreadContexts[i][k]->stack);
             allThreadContexts[i][k]->joinLock.~SpinLock();
             allThreadContexts[i][k]->joinCV.~ConditionVariable();
-            free(allThreadContexts[i][k]);
+            if (contextRegion == NULL)
+                free(allThreadContexts[i][k]);
         }
         delete[] allThreadContexts[i];
+        free(allDeadlines[i]);
     }
 
     kernelThreads.clear();
     kernelThreadStacks.clear();
 
     allThreadContexts.clear();
+    allDeadlines.clear();
+    unmapStackRegion();
     occupiedAndCount.clear();
+    occupiedSlots.clear();
     coreMap.clear();
+    llcOfCore.clear();
     PerfUtils::Util::serialize();
 #ifndef DISABLE_ARBITER
     coreArbiter->reset();
@@ -965,6 +2298,16 @@ parseOptions(int* argcp, const char** argv) {
                             {"stackSize", 's', true},
                             {"enableArbiter", 'a', true},
                             {"disableLoadEstimation", 'd', false},
+                            {"enableWorkStealing", 'w', false},
+                            {"idleSpinBudgetNs", 'i', true},
+                            {"maxThreadsPerCore", 't', true},
+                            {"priorityAgingNs", 'g', true},
+                            {"placementSlack", 'l', true},
+                            {"profileStackUsage", 'u', false},
+                            {"hugePages", 'h', false},
+                            {"prefault", 'f', false},
+                            {"submitBatchSize", 'b', true},
+                            {"submitBatchAgeNs", 'n', true},
                             {"coreArbiterSocketPath", 'p', true}};
     const int UNRECOGNIZED = ~0;
 
@@ -1015,6 +2358,36 @@ parseOptions(int* argcp, const char** argv) {
             case 'd':
                 disableLoadEstimation = true;
                 break;
+            case 'w':
+                enableWorkStealing = true;
+                break;
+            case 'i':
+                idleSpinBudgetNs = strtoull(optionArgument, NULL, 10);
+                break;
+            case 't':
+                maxThreadsPerCore = atoi(optionArgument);
+                break;
+            case 'g':
+                priorityAgingNs = strtoull(optionArgument, NULL, 10);
+                break;
+            case 'l':
+                placementSlack = atoi(optionArgument);
+                break;
+            case 'u':
+                profileStackUsage = true;
+                break;
+            case 'h':
+                useHugePages = true;
+                break;
+            case 'f':
+                prefaultMemory = true;
+                break;
+            case 'b':
+                submitBatchSize = std::max(1, atoi(optionArgument));
+                break;
+            case 'n':
+                submitBatchAgeNs = strtoull(optionArgument, NULL, 10);
+                break;
             case 'a':
                 useCoreArbiter = (0 != atoi(optionArgument));
                 break;
@@ -1028,8 +2401,8 @@ parseOptions(int* argcp, const char** argv) {
     *argcp = argc;
 }
 
-ThreadContext::ThreadContext(uint8_t idInCore)
-    : stack(NULL),
+ThreadContext::ThreadContext(uint16_t idInCore, void* stack)
+    : stack(stack),
       sp(NULL),
       generation(1),
       joinLock(),
@@ -1037,14 +2410,19 @@ ThreadContext::ThreadContext(uint8_t idInCore)
       coreId(CORE_UNASSIGNED),
       originalCoreId(coreId),
       idInCore(idInCore),
+      priority(DEFAULT_PRIORITY),
+      deadlineInCycles(NULL),
+      stackClass(OWN_STACK),
+      pooledStack(NULL),
+      ownStackSp(NULL),
+      fiberLocals(),
+      trimGeneration(0),
+      stackTrimmed(false),
       threadInvocation(),
-      wakeupTimeInCycles(threadInvocation.wakeupTimeInCycles) {
+      wakeupTimeInCycles(threadInvocation.wakeupTimeInCycles),
+      timer() {
     wakeupTimeInCycles = ThreadContext::UNOCCUPIED;
-    // Allocate memory here so we can error-check the return value of malloc.
-    stack = alignedAlloc(stackSize, PAGE_SIZE);
-    if (stack == NULL) {
-        abort();
-    }
+    timer.context = this;
 }
 
 /**
@@ -1055,6 +2433,9 @@ ThreadContext::ThreadContext(uint8_t idInCore)
 void
 ThreadContext::initializeStack() {
     sp = reinterpret_cast<char*>(stack) + stackSize - 2 * sizeof(void*);
+    if (profileStackUsage)
+        paintStack(stack, reinterpret_cast<char*>(sp) -
+                              SPACE_FOR_SAVED_REGISTERS);
 
     // Immediately before schedulerMainLoop gains control, we want the
     // stack to look like this, so that the swapcontext call will
@@ -1078,11 +2459,130 @@ ThreadContext::initializeStack() {
      * store the registers in swapcontext.
      */
     sp = reinterpret_cast<char*>(sp) - SPACE_FOR_SAVED_REGISTERS;
+}
 
-    /**
-     * Set the stack canary value to detect stack overflows.
-     */
-    *reinterpret_cast<uint64_t*>(stack) = STACK_CANARY;
+/**
+ * Map a region backed by huge pages: from the hugetlbfs pool if it has size
+ * bytes reserved, and otherwise aligned to HUGE_PAGE_SIZE and advised to use
+ * transparent huge pages.
+ *
+ * \param size
+ *     The size of the region; a multiple of HUGE_PAGE_SIZE.
+ */
+static char*
+mapHugeRegion(size_t size) {
+    void* region = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (region != MAP_FAILED)
+        return reinterpret_cast<char*>(region);
+
+    // Map an extra huge page so that the region can be aligned, then trim
+    // the excess at both ends.
+    region = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED) {
+        ARACHNE_LOG(ERROR, "Failed to map %lu bytes: %s", size,
+                    strerror(errno));
+        abort();
+    }
+    char* start = reinterpret_cast<char*>(region);
+    char* aligned = reinterpret_cast<char*>(
+        (reinterpret_cast<uintptr_t>(start) + HUGE_PAGE_SIZE - 1) &
+        ~(HUGE_PAGE_SIZE - 1));
+    if (aligned != start)
+        munmap(start, aligned - start);
+    munmap(aligned + size, start + HUGE_PAGE_SIZE - aligned);
+    if (madvise(aligned, size, MADV_HUGEPAGE) != 0)
+        ARACHNE_LOG(WARNING,
+                    "No huge pages are available for %lu bytes: %s", size,
+                    strerror(errno));
+    return aligned;
+}
+
+/**
+ * Fault in a range of memory, which must not yet be in use, and lock it in
+ * memory if the process is allowed to.
+ */
+static void
+prefault(char* start, size_t length) {
+    if (mlock(start, length) == 0)
+        return;
+    static bool warned = false;
+    if (!warned) {
+        ARACHNE_LOG(WARNING,
+                    "Failed to lock memory: %s; faulting it in without "
+                    "locking.",
+                    strerror(errno));
+        warned = true;
+    }
+    for (size_t offset = 0; offset < length; offset += PAGE_SIZE)
+        reinterpret_cast<volatile char*>(start)[offset] = 0;
+}
+
+/**
+ * Map stackRegion with room for the given number of stacks of stackSize
+ * bytes, each preceded by a guard page.
+ *
+ * \param numStacks
+ *     The number of stacks to make room for.
+ * \return
+ *     The distance in bytes between the starts of consecutive stacks; the
+ *     first stack starts one page into stackRegion.
+ */
+static size_t
+mapStackRegion(size_t numStacks) {
+    size_t stride = (stackSize + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+    if (useHugePages) {
+        stackRegionSize = (stride * numStacks + HUGE_PAGE_SIZE - 1) /
+                          HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        stackRegion = mapHugeRegion(stackRegionSize);
+        if (prefaultMemory)
+            prefault(stackRegion, stackRegionSize);
+        return stride;
+    }
+    stride += PAGE_SIZE;
+    stackRegionSize = stride * numStacks;
+    void* region =
+        mmap(NULL, stackRegionSize, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED) {
+        ARACHNE_LOG(ERROR, "Failed to map %lu bytes for stacks: %s",
+                    stackRegionSize, strerror(errno));
+        abort();
+    }
+    stackRegion = reinterpret_cast<char*>(region);
+    for (size_t i = 0; i < numStacks; i++) {
+        if (mprotect(stackRegion + i * stride, PAGE_SIZE, PROT_NONE) != 0) {
+            // Each guard page splits the mapping, so very many stacks can
+            // exceed vm.max_map_count; run without the remaining guards.
+            ARACHNE_LOG(WARNING,
+                        "Failed to protect guard page for stack %lu: %s; "
+                        "overflows of later stacks will not be detected.",
+                        i, strerror(errno));
+            break;
+        }
+    }
+    if (prefaultMemory) {
+        for (size_t i = 0; i < numStacks; i++)
+            prefault(stackRegion + i * stride + PAGE_SIZE,
+                     stride - PAGE_SIZE);
+    }
+    return stride;
+}
+
+/**
+ * Release the mapping created by mapStackRegion(), and contextRegion.
+ */
+static void
+unmapStackRegion() {
+    if (stackRegion != NULL)
+        munmap(stackRegion, stackRegionSize);
+    stackRegion = NULL;
+    stackRegionSize = 0;
+    if (contextRegion != NULL)
+        munmap(contextRegion, contextRegionSize);
+    contextRegion = NULL;
+    contextRegionSize = 0;
 }
 
 /**
@@ -1116,6 +2616,54 @@ getCorePolicy() {
     return corePolicy;
 }
 
+/**
+ * Fill in llcOfCore from the cache topology that Linux exports in sysfs. A
+ * core whose last-level cache cannot be determined is placed in a group of
+ * its own.
+ *
+ * \param numCores
+ *     The number of cores in the system.
+ * \param sysfsDir
+ *     The directory holding one cpuN subdirectory per core; normally
+ *     CPU_SYSFS_DIR.
+ */
+void
+readCpuTopology(int numCores, const char* sysfsDir) {
+    llcOfCore.resize(numCores);
+    for (int coreId = 0; coreId < numCores; coreId++) {
+        llcOfCore[coreId] = coreId;
+        int highestLevel = 0;
+        for (int index = 0;; index++) {
+            char path[128];
+            snprintf(path, sizeof(path), "%s/cpu%d/cache/index%d/level",
+                     sysfsDir, coreId, index);
+            FILE* file = fopen(path, "r");
+            if (file == NULL)
+                break;
+            int level = 0;
+            int numRead = fscanf(file, "%d", &level);
+            fclose(file);
+            if (numRead != 1 || level <= highestLevel)
+                continue;
+
+            // The list starts with the lowest-numbered core, e.g. "0-7,64-71".
+            snprintf(path, sizeof(path),
+                     "%s/cpu%d/cache/index%d/shared_cpu_list", sysfsDir,
+                     coreId, index);
+            file = fopen(path, "r");
+            if (file == NULL)
+                continue;
+            int firstCore;
+            if (fscanf(file, "%d", &firstCore) == 1 && firstCore >= 0 &&
+                firstCore < numCores) {
+                highestLevel = level;
+                llcOfCore[coreId] = firstCore;
+            }
+            fclose(file);
+        }
+    }
+}
+
 /**
  * This function sets up state needed by the thread library, and must be
  * invoked before any other function in the thread library is invoked. It is
@@ -1135,6 +2683,36 @@ getCorePolicy() {
  *        The largest number of core the appliation may use
  *     --stackSize
  *        The size of each user stack.
+ *     --maxThreadsPerCore
+ *        The largest number of threads that may live on each core, up to
+ *        MAX_THREADS_PER_CORE. Each core allocates this many stacks.
+ *     --priorityAgingNs
+ *        How long runnable threads at a lower priority level may be passed
+ *        over before one of them runs anyway; ~0 disables aging.
+ *     --placementSlack
+ *        How many more threads than a random core the creating core or a
+ *        core sharing its last-level cache may host and still be preferred
+ *        for new threads; a negative value disables the preference.
+ *     --profileStackUsage
+ *        Measure how deep each thread's stack grows, for getStackUsage().
+ *        This commits the memory of every stack and slows thread exit.
+ *     --hugePages
+ *        Back stacks and ThreadContexts with 2 MB huge pages where available.
+ *        Stacks have no guard pages in this mode.
+ *     --prefault
+ *        Fault in, and lock if permitted, all stack and ThreadContext memory
+ *        during initialization, trading memory for the absence of page
+ *        faults on first use.
+ *     --submitBatchSize
+ *        How many io_uring requests a core may queue before submitting them
+ *        without waiting for the end of its dispatch() pass.
+ *     --submitBatchAgeNs
+ *        How long the oldest queued io_uring request may wait for the rest
+ *        of its batch before it is submitted anyway.
+ *     --idleSpinBudgetNs
+ *        In builds without the core arbiter, how long a core spins without
+ *        finding work before it parks its kernel thread; 0, the default,
+ *        means that cores never park.
  *
  * \param argcp
  *    The pointer to argc, the number of arguments passed to the application.
@@ -1207,25 +2785,71 @@ init_static(const cpu_set_t *cpu_set)
         corePolicy = new DefaultCorePolicy(maxNumCores, !disableLoadEstimation);
     }
 
+    if (maxThreadsPerCore < 1 || maxThreadsPerCore > MAX_THREADS_PER_CORE) {
+        ARACHNE_LOG(WARNING,
+                    "maxThreadsPerCore %d is outside of [1, %d]; clamping.",
+                    maxThreadsPerCore, MAX_THREADS_PER_CORE);
+        maxThreadsPerCore =
+            std::min(std::max(maxThreadsPerCore, 1), MAX_THREADS_PER_CORE);
+    }
+    numContextWords = (maxThreadsPerCore + 63) / 64;
+
+    readCpuTopology(numHardwareCores, CPU_SYSFS_DIR);
+
     lastTotalCollectionTime.resize(numHardwareCores);
     // Create enough data structures to account for every core in the system.
     occupiedAndCount.resize(numHardwareCores);
+    occupiedSlots.resize(numHardwareCores);
     allThreadContexts.resize(numHardwareCores);
+    allDeadlines.resize(numHardwareCores);
     coreMap.resize(numHardwareCores);
+    size_t stackStride = mapStackRegion(numHardwareCores * maxThreadsPerCore);
+    // Without huge pages, each stack sits above its guard page.
+    char* nextStack = stackRegion + (useHugePages ? 0 : PAGE_SIZE);
+    size_t contextStride = (sizeof(ThreadContext) + CACHE_LINE_SIZE - 1) /
+                           CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+    char* nextContext = NULL;
+    if (useHugePages) {
+        contextRegionSize =
+            (contextStride * numHardwareCores * maxThreadsPerCore +
+             HUGE_PAGE_SIZE - 1) /
+            HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        contextRegion = mapHugeRegion(contextRegionSize);
+        if (prefaultMemory)
+            prefault(contextRegion, contextRegionSize);
+        nextContext = contextRegion;
+    }
     for (unsigned int i = 0; i < numHardwareCores; i++) {
 		void *p = alignedAlloc(sizeof(std::atomic<MaskAndCount>));
         memset(p, 0, sizeof(std::atomic<MaskAndCount>));
         occupiedAndCount[i] = reinterpret_cast<std::atomic<Arachne::MaskAndCount>*>(p);
+        p = alignedAlloc(sizeof(OccupiedSlots));
+        memset(p, 0, sizeof(OccupiedSlots));
+        occupiedSlots[i] = reinterpret_cast<OccupiedSlots*>(p);
 
         // Allocate all the thread contexts and stacks
         ThreadContext** contexts = new ThreadContext*[maxThreadsPerCore];
-        for (uint8_t k = 0; k < maxThreadsPerCore; k++) {
-            contexts[k] = reinterpret_cast<ThreadContext*>(
-                alignedAlloc(sizeof(ThreadContext)));
-            new (contexts[k]) ThreadContext(k);
+        for (int k = 0; k < maxThreadsPerCore; k++) {
+            if (contextRegion != NULL) {
+                contexts[k] = reinterpret_cast<ThreadContext*>(nextContext);
+                nextContext += contextStride;
+            } else {
+                contexts[k] = reinterpret_cast<ThreadContext*>(
+                    alignedAlloc(sizeof(ThreadContext)));
+            }
+            new (contexts[k])
+                ThreadContext(static_cast<uint16_t>(k), nextStack);
+            nextStack += stackStride;
         }
         allThreadContexts[i] = contexts;
 
+        size_t deadlinesSize = numContextWords * 64 * sizeof(uint64_t);
+        allDeadlines[i] =
+            reinterpret_cast<uint64_t*>(alignedAlloc(deadlinesSize));
+        memset(allDeadlines[i], 0, deadlinesSize);
+        for (int k = 0; k < maxThreadsPerCore; k++)
+            contexts[k]->deadlineInCycles = &allDeadlines[i][k];
+
         coreIdleSemaphores.push_back(new ::Semaphore);
     }
 
@@ -1275,7 +2899,10 @@ mainThreadInit() {
     core.localOccupiedAndCount =
         reinterpret_cast<std::atomic<Arachne::MaskAndCount>*>(
             alignedAlloc(sizeof(std::atomic<MaskAndCount>)));
-    for (uint8_t k = 0; k < maxThreadsPerCore; k++) {
+    void* p = alignedAlloc(sizeof(OccupiedSlots));
+    memset(p, 0, sizeof(OccupiedSlots));
+    core.localOccupiedSlots = reinterpret_cast<OccupiedSlots*>(p);
+    for (int k = 0; k < maxThreadsPerCore; k++) {
         // It is important to re-initialize stacks here because some of the
         // contexts may be in the middle of dispatch calls from
         // schedulerMainLoop and switching to them will a spurious return from
@@ -1286,6 +2913,10 @@ mainThreadInit() {
     core.loadedContext = *core.localThreadContexts;
     core.loadedContext->wakeupTimeInCycles = ThreadContext::BLOCKED;
     *core.localOccupiedAndCount = {1, 1};
+    core.localOccupiedSlots->numOccupied = 1;
+    core.localOccupiedSlots->occupied[0] = 1;
+    // The main thread has no ring to register files and buffers with.
+    core.registrations_seen = UINT64_MAX;
     PerfStats::threadStats = std::unique_ptr<PerfStats>(new PerfStats());
 }
 
@@ -1295,6 +2926,8 @@ mainThreadInit() {
 void
 mainThreadDestroy() {
     deinitializeCore(&core);
+    free(core.localOccupiedAndCount);
+    free(core.localOccupiedSlots);
     PerfStats::threadStats = NULL;
 }
 
@@ -1312,6 +2945,10 @@ void
 shutDown() {
     // Tell all the kernel threads to terminate at the first opportunity.
     shutdown = true;
+    for (Core* target : coreMap) {
+        if (target != NULL && target->parked.load())
+            unparkCore(target);
+    }
 
 #ifndef DISABLE_ARBITER
     // Unblock all cores so they can shut down and be joined.
@@ -1522,6 +3159,50 @@ checkForArbiterRequest() {
 #endif
 }
 
+/**
+ * Counterpart of preventCreationsToCore() for cores whose occupancy is
+ * tracked in OccupiedSlots. It must also be invoked on the target core.
+ */
+static void
+preventCreationsToSlots(int coreId) {
+    OccupiedSlots* slots = occupiedSlots[coreId];
+
+    // Block future creations on core
+    uint32_t numOccupied = slots->numOccupied.load();
+    do {
+        // It is an error if the core we are migrating to is already
+        // exclusive.
+        if (numOccupied > static_cast<uint32_t>(maxThreadsPerCore)) {
+            ARACHNE_LOG(ERROR,
+                        "preventCreationsToCore: numOccupied = %u on core %d\n",
+                        numOccupied, coreId);
+            abort();
+        }
+    } while (!slots->numOccupied.compare_exchange_weak(
+        numOccupied, OccupiedSlots::EXCLUSIVE));
+
+    // Wait out creations that reserved a slot before we blocked creations,
+    // until each has claimed its bit and filled in its context. No thread can
+    // exit meanwhile, since we are running on this core.
+    bool pendingCreation;
+    do {
+        pendingCreation = false;
+        uint32_t numClaimed = 0;
+        for (int w = 0; w < numContextWords; w++) {
+            uint64_t occupied = slots->occupied[w].load();
+            numClaimed += __builtin_popcountll(occupied);
+            for (; occupied != 0; occupied &= occupied - 1) {
+                int index = (w << 6) + __builtin_ctzll(occupied);
+                if (core.localThreadContexts[index]->wakeupTimeInCycles ==
+                    ThreadContext::UNOCCUPIED)
+                    pendingCreation = true;
+            }
+        }
+        if (numClaimed != numOccupied)
+            pendingCreation = true;
+    } while (pendingCreation);
+}
+
 /**
  * After this function returns, threads may no longer be added to the target
  * core. This function can be invoked from any thread on any core. It is
@@ -1530,6 +3211,10 @@ checkForArbiterRequest() {
  */
 void
 preventCreationsToCore(int coreId) {
+    if (unlikely(maxThreadsPerCore > MaskAndCount::MAX_THREADS)) {
+        preventCreationsToSlots(coreId);
+        return;
+    }
     MaskAndCount originalMask = *occupiedAndCount[coreId];
 
     // It is an error if the core we are migrating to is already exclusive.
@@ -1573,6 +3258,400 @@ preventCreationsToCore(int coreId) {
     } while (pendingCreation);
 }
 
+/**
+ * Reserve a free slot on a core for a new or migrating thread. This is the
+ * slow path of the CAS loop in createThreadOnCore(), and the only path when
+ * occupancy is tracked in OccupiedSlots.
+ *
+ * \param coreId
+ *     The core to claim a slot on.
+ * \param avoidPinned
+ *     True means that the slot must not be pinned on the target core, as
+ *     required when migrating a thread.
+ * \param failureCount
+ *     Incremented each time contention for the core's state forces a retry.
+ * \return
+ *     The index of the claimed slot, or -1 if the core is full or is not
+ *     accepting new threads.
+ */
+int
+claimOccupiedSlot(int coreId, bool avoidPinned, int* failureCount) {
+    std::atomic<uint64_t>* pinned = coreMap[coreId]->localPinnedContexts;
+    if (maxThreadsPerCore <= MaskAndCount::MAX_THREADS) {
+        for (;;) {
+            // Each iteration through this loop makes one attempt to reserve a
+            // slot on the specified core. Multiple iterations are required
+            // only if there is contention for the core's state variables.
+            MaskAndCount slotMap = *occupiedAndCount[coreId];
+            MaskAndCount oldSlotMap = slotMap;
+
+            // Skip this core since it might be an exclusive or fully loaded.
+            if (slotMap.numOccupied >= maxThreadsPerCore)
+                return -1;
+
+            // Search for a non-occupied slot and attempt to reserve the slot
+            uint64_t available = ~slotMap.occupied & contextWordMask(0);
+            if (avoidPinned)
+                available &= ~pinned->load();
+
+            // Not able to find a context, likely because unoccupied contexts
+            // were pinned.
+            if (available == 0)
+                return -1;
+
+            int index = __builtin_ctzll(available);
+            slotMap.occupied = slotMap.occupied | (1L << index);
+            slotMap.numOccupied++;
+            if (occupiedAndCount[coreId]->compare_exchange_strong(oldSlotMap,
+                                                                  slotMap))
+                return index;
+            (*failureCount)++;
+        }
+    }
+
+    OccupiedSlots* slots = occupiedSlots[coreId];
+
+    // At most one context per core is pinned, so leaving one more slot free
+    // guarantees that an unpinned one remains.
+    uint32_t limit = maxThreadsPerCore - (avoidPinned ? 1 : 0);
+    uint32_t numOccupied = slots->numOccupied.load();
+    for (;;) {
+        if (numOccupied >= limit)
+            return -1;
+        if (slots->numOccupied.compare_exchange_weak(numOccupied,
+                                                     numOccupied + 1))
+            break;
+        (*failureCount)++;
+    }
+
+    // The reservation guarantees that a suitable slot is free, although other
+    // creations may race with us to claim it.
+    for (;;) {
+        for (int w = 0; w < numContextWords; w++) {
+            uint64_t occupied = slots->occupied[w].load();
+            for (;;) {
+                uint64_t available = ~occupied & contextWordMask(w);
+                if (avoidPinned)
+                    available &= ~pinned[w].load();
+                if (available == 0)
+                    break;
+                int bit = __builtin_ctzll(available);
+                if (slots->occupied[w].compare_exchange_weak(
+                        occupied, occupied | (1UL << bit)))
+                    return (w << 6) + bit;
+                (*failureCount)++;
+            }
+        }
+    }
+}
+
+/**
+ * Append a list of injected threads to the queue of the given core, and wake
+ * the core if it has parked.
+ *
+ * \param coreId
+ *     The core to run the threads on.
+ * \param first
+ *     The first thread of the list, linked through InjectedThread::next.
+ * \param last
+ *     The last thread of the list.
+ */
+void
+injectThreads(int coreId, InjectedThread* first, InjectedThread* last) {
+    Core* target = coreMap[coreId];
+    InjectedThread* head =
+        target->injectedThreads.load(std::memory_order_relaxed);
+    do {
+        last->next = head;
+    } while (!target->injectedThreads.compare_exchange_weak(
+        head, first, std::memory_order_release, std::memory_order_relaxed));
+    if (target->parked.load())
+        unparkCore(target);
+}
+
+/**
+ * Move the threads injected into this core since the last call to the end of
+ * heldInjectedThreads, and give held threads contexts, oldest first, for as
+ * long as this core has free slots.
+ */
+static void
+startInjectedThreads() {
+    // The queue is newest first, so reverse it to preserve submission order.
+    InjectedThread* injected =
+        core.injectedThreads.exchange(NULL, std::memory_order_acquire);
+    InjectedThread* newest = injected;
+    InjectedThread* oldestFirst = NULL;
+    while (injected != NULL) {
+        InjectedThread* next = injected->next;
+        injected->next = oldestFirst;
+        oldestFirst = injected;
+        injected = next;
+    }
+    if (oldestFirst != NULL) {
+        if (core.heldInjectedThreads == NULL)
+            core.heldInjectedThreads = oldestFirst;
+        else
+            core.heldInjectedThreadsTail->next = oldestFirst;
+        core.heldInjectedThreadsTail = newest;
+    }
+
+    while (core.heldInjectedThreads != NULL) {
+        int failureCount = 0;
+        int index = claimOccupiedSlot(core.id, false, &failureCount);
+        if (index < 0)
+            return;
+        InjectedThread* thread = core.heldInjectedThreads;
+        core.heldInjectedThreads = thread->next;
+
+        ThreadContext* context = core.localThreadContexts[index];
+        thread->moveInvocation(&context->threadInvocation.data);
+        delete thread;
+        context->priority = DEFAULT_PRIORITY;
+        context->threadClass = 0;
+        context->stackClass = static_cast<int8_t>(stackClassOf(0));
+        context->wakeupTimeInCycles = 0;
+        markRunnableLocally(context);
+        PerfStats::threadStats->numThreadsCreated++;
+        PerfStats::threadStats->numThreadsInjected++;
+    }
+}
+
+/**
+ * Invoked on a core that is giving up its kernel thread: hand the threads
+ * injected into it that have not started yet to another core.
+ */
+static void
+forwardInjectedThreads() {
+    // Collect everything into heldInjectedThreads; this core accepts no new
+    // threads at this point.
+    startInjectedThreads();
+    if (core.heldInjectedThreads == NULL)
+        return;
+    CorePolicy::CoreList outputCores = corePolicy->getCores(0);
+    if (outputCores.size() == 0) {
+        ARACHNE_LOG(ERROR,
+                    "No available cores to forward injected threads to.");
+        abort();
+    }
+    // Queues of injected threads are newest first, but held threads are
+    // oldest first, so reverse them to keep their submission order.
+    InjectedThread* oldest = core.heldInjectedThreads;
+    InjectedThread* newestFirst = NULL;
+    for (InjectedThread* held = oldest; held != NULL;) {
+        InjectedThread* next = held->next;
+        held->next = newestFirst;
+        newestFirst = held;
+        held = next;
+    }
+    injectThreads(chooseCore(outputCores), newestFirst, oldest);
+    core.heldInjectedThreads = NULL;
+}
+
+/**
+ * Reserve up to count free slots on a core for a batch of new threads, with
+ * a single CAS on the core's MaskAndCount when there is no contention.
+ *
+ * \param coreId
+ *     The core to claim slots on.
+ * \param count
+ *     The number of slots wanted.
+ * \param indices
+ *     An array of at least count elements, which receives the indices of the
+ *     claimed slots.
+ * \param failureCount
+ *     Incremented each time contention for the core's state forces a retry.
+ * \return
+ *     The number of slots claimed, which is less than count if the core does
+ *     not have enough free slots, and 0 if it is full or is not accepting new
+ *     threads.
+ */
+int
+claimOccupiedSlots(int coreId, int count, uint16_t* indices,
+                   int* failureCount) {
+    if (maxThreadsPerCore <= MaskAndCount::MAX_THREADS) {
+        for (;;) {
+            MaskAndCount slotMap = *occupiedAndCount[coreId];
+            MaskAndCount oldSlotMap = slotMap;
+
+            // Skip this core since it might be an exclusive or fully loaded.
+            if (slotMap.numOccupied >= maxThreadsPerCore)
+                return 0;
+
+            int numFree =
+                maxThreadsPerCore - static_cast<int>(slotMap.numOccupied);
+            int wanted = std::min(count, numFree);
+            uint64_t available = ~slotMap.occupied & contextWordMask(0);
+            int numClaimed = 0;
+            while (numClaimed < wanted && available != 0) {
+                indices[numClaimed++] =
+                    static_cast<uint16_t>(__builtin_ctzll(available));
+                slotMap.occupied |= available & -available;
+                available &= available - 1;
+            }
+            if (numClaimed == 0)
+                return 0;
+            slotMap.numOccupied += numClaimed;
+            if (occupiedAndCount[coreId]->compare_exchange_strong(oldSlotMap,
+                                                                  slotMap))
+                return numClaimed;
+            (*failureCount)++;
+        }
+    }
+
+    OccupiedSlots* slots = occupiedSlots[coreId];
+
+    // Reserve the whole batch first, as in claimOccupiedSlot().
+    uint32_t numOccupied = slots->numOccupied.load();
+    int numReserved;
+    for (;;) {
+        if (numOccupied >= static_cast<uint32_t>(maxThreadsPerCore))
+            return 0;
+        numReserved = std::min(
+            count, maxThreadsPerCore - static_cast<int>(numOccupied));
+        if (slots->numOccupied.compare_exchange_weak(
+                numOccupied, numOccupied + numReserved))
+            break;
+        (*failureCount)++;
+    }
+
+    // Take as many of the reserved slots as possible from each word at once.
+    int numClaimed = 0;
+    while (numClaimed < numReserved) {
+        for (int w = 0; w < numContextWords && numClaimed < numReserved;
+             w++) {
+            uint64_t occupied = slots->occupied[w].load();
+            for (;;) {
+                uint64_t available = ~occupied & contextWordMask(w);
+                uint64_t claimed = 0;
+                for (int i = numClaimed; i < numReserved && available != 0;
+                     i++) {
+                    claimed |= available & -available;
+                    available &= available - 1;
+                }
+                if (claimed == 0)
+                    break;
+                if (slots->occupied[w].compare_exchange_weak(
+                        occupied, occupied | claimed)) {
+                    for (; claimed != 0; claimed &= claimed - 1)
+                        indices[numClaimed++] = static_cast<uint16_t>(
+                            (w << 6) + __builtin_ctzll(claimed));
+                    break;
+                }
+                (*failureCount)++;
+            }
+        }
+    }
+    return numClaimed;
+}
+
+/**
+ * Release the slot of a context on this core whose thread has exited or
+ * moved to another core, clearing its occupied bit and decrementing the
+ * number of occupied slots.
+ *
+ * \param index
+ *     The index of the context on this core.
+ */
+static void
+releaseOccupiedSlot(int index) {
+    if (unlikely(maxThreadsPerCore > MaskAndCount::MAX_THREADS)) {
+        OccupiedSlots* slots = core.localOccupiedSlots;
+        slots->occupied[contextWord(index)].fetch_and(~contextBit(index));
+        if (slots->numOccupied.fetch_sub(1) == 0) {
+            ARACHNE_LOG(ERROR,
+                        "Releasing slot %d on Core %d: Detected numOccupied "
+                        "== 0\n",
+                        index, core.id);
+            abort();
+        }
+        return;
+    }
+
+    bool success;
+    MaskAndCount slotMap;
+    do {
+        slotMap = *core.localOccupiedAndCount;
+        MaskAndCount oldSlotMap = slotMap;
+        if (slotMap.numOccupied == 0) {
+            ARACHNE_LOG(ERROR,
+                        "Releasing slot %d on Core %d: Detected numOccupied "
+                        "== 0 occupied %lu\n",
+                        index, core.id, slotMap.occupied);
+            abort();
+        }
+        slotMap.numOccupied--;
+
+        slotMap.occupied =
+            slotMap.occupied & ~(1L << index) & 0x00FFFFFFFFFFFFFF;
+        success = core.localOccupiedAndCount->compare_exchange_strong(
+            oldSlotMap, slotMap, std::memory_order_acq_rel);
+    } while (!success);
+}
+
+/**
+ * Move the thread at index i of this core's contexts into a free slot on
+ * another core, by swapping the ThreadContext pointers of the two slots. This
+ * function can only be run from the core that the thread is moving off, while
+ * holding coreExclusionMutex, and the thread must not be running. The caller
+ * is responsible for clearing the occupied bit of index i on this core.
+ *
+ * \param i
+ *     The index of the thread's context on this core.
+ * \param coreId
+ *     The core to move the thread to.
+ * \return
+ *     True if the thread was moved; false if coreId had no free slot or is not
+ *     accepting new threads.
+ */
+static bool
+migrateThread(uint16_t i, int coreId) {
+    int failureCount = 0;
+    int index = claimOccupiedSlot(coreId, true, &failureCount);
+    if (index < 0)
+        return false;
+
+    // At this point we've reserved a spot on the target, and now we swap the
+    // contexts. We correct the idInCore before swapping, to ensure that the
+    // correct slot is cleared in occupiedAndCount on the target core.
+    allThreadContexts[coreId][index]->idInCore = i;
+    core.localThreadContexts[i]->idInCore = static_cast<uint16_t>(index);
+
+    allThreadContexts[coreId][index]->coreId = static_cast<uint8_t>(core.id);
+    core.localThreadContexts[i]->coreId = static_cast<uint8_t>(coreId);
+
+    // Sleeping threads must keep their wakeups on the new core.
+    Timer* timer = &core.localThreadContexts[i]->timer;
+    if (timer->armed())
+        migrateTimer(timer, coreId);
+
+    ThreadContext* contextToMigrate = allThreadContexts[coreId][index];
+
+    // Deadlines stay in the packed slots of their cores, so the contexts
+    // trade slots and the migrating thread's deadline moves to its new one.
+    std::swap(contextToMigrate->deadlineInCycles,
+              core.localThreadContexts[i]->deadlineInCycles);
+    *core.localThreadContexts[i]->deadlineInCycles =
+        *contextToMigrate->deadlineInCycles;
+
+    allThreadContexts[coreId][index] = core.localThreadContexts[i];
+    core.localThreadContexts[i] = contextToMigrate;
+
+    // Deadline threads must keep their place in EDF order on the new core.
+    core.deadlineThreads[contextWord(i)] &= ~contextBit(i);
+    core.newDeadlineThreads[contextWord(i)] &= ~contextBit(i);
+    if (allThreadContexts[coreId][index]->threadClass ==
+        CorePolicy::DEADLINE_CLASS)
+        coreMap[coreId]->newDeadlineThreads[contextWord(index)] |=
+            contextBit(index);
+
+    // A wakeup racing with the migration may have marked the thread runnable
+    // on this core, so have the target core check it unconditionally.
+    markRunnable(coreMap[coreId], allThreadContexts[coreId][index]);
+    if (coreMap[coreId]->parked.load())
+        unparkCore(coreMap[coreId]);
+    return true;
+}
+
 /**
  * Remove all threads from the target core (with the exception of the caller),
  * and migrate them into outputCores. This function can only be run from the
@@ -1590,17 +3669,29 @@ migrateThreadsFromCore() {
 
     // Start migration of remaining threads.
     MaskAndCount blockedOccupiedAndCount = *core.localOccupiedAndCount;
+    uint64_t occupied[MAX_CONTEXT_WORDS];
+    bool multiWord = maxThreadsPerCore > MaskAndCount::MAX_THREADS;
+    if (multiWord) {
+        for (int w = 0; w < numContextWords; w++)
+            occupied[w] = core.localOccupiedSlots->occupied[w];
+    } else {
+        occupied[0] = blockedOccupiedAndCount.occupied;
+    }
+
+    // Ensure that every armed timer of a thread on this core is in our wheel,
+    // so that it can be handed on along with its thread.
+    adoptMigratedTimers();
 
     // Migrate off all threads other than the current one.  Round robin among
     // cores because these are likely long-running threads.
     int failureCount = 0;
-    for (uint8_t i = 0; i < maxThreadsPerCore; i++) {
+    for (int i = 0; i < maxThreadsPerCore; i++) {
         if (core.localThreadContexts[i] == core.loadedContext) {
             // Skip over ourselves
             continue;
         }
         // Choose a victim core that we will pawn our work on.
-        if ((blockedOccupiedAndCount.occupied >> i) & 1) {
+        if (occupied[contextWord(i)] & contextBit(i)) {
             int threadClass = core.localThreadContexts[i]->threadClass;
             CorePolicy::CoreList outputCores =
                 corePolicy->getCores(threadClass);
@@ -1613,66 +3704,9 @@ migrateThreadsFromCore() {
             }
             int coreId = chooseCore(outputCores);
 
-            bool success = false;
-            uint8_t index;
-            do {
-                // Each iteration through this loop makes one attempt to
-                // enqueue the task to the specified core. Multiple iterations
-                // are required only if there is contention for the core's
-                // state variables.
-                MaskAndCount slotMap = *occupiedAndCount[coreId];
-                MaskAndCount oldSlotMap = slotMap;
-
-                // Skip this core since it might be an exclusive or fully
-                // loaded.
-                if (slotMap.numOccupied >= maxThreadsPerCore) {
-                    success = false;
-                    break;
-                }
-
-                // Search for a non-occupied slot and attempt to reserve the
-                // slot
-                index = 0;
-                while (((slotMap.occupied | *coreMap[coreId]->localPinnedContexts) &
-                        (1L << index)) &&
-                       index < maxThreadsPerCore)
-                    index++;
-
-                // Not able to find a context, likely because unoccupied
-                // contexts were pinned.
-                if (index == maxThreadsPerCore) {
-                    success = false;
-                    break;
-                }
-
-                slotMap.occupied =
-                    (slotMap.occupied | (1L << index)) & 0x00FFFFFFFFFFFFFF;
-                slotMap.numOccupied++;
-                success = occupiedAndCount[coreId]->compare_exchange_strong(
-                    oldSlotMap, slotMap);
-            } while (!success);
-
-            if (success) {
-                // Now that we have found a slot, we can clear our bit.
-                blockedOccupiedAndCount.occupied &=
-                    ~(1L << i) & 0x00FFFFFFFFFFFFFF;
-
-                // At this point we've reserved a spot on the target, and now
-                // we swap the contexts. We correct the idInCore before
-                // swapping, to ensure that the correct slot is cleared in
-                // occupiedAndCount on the target core.
-                allThreadContexts[coreId][index]->idInCore = i;
-                core.localThreadContexts[i]->idInCore = index;
-
-                allThreadContexts[coreId][index]->coreId =
-                    static_cast<uint8_t>(core.id);
-                core.localThreadContexts[i]->coreId =
-                    static_cast<uint8_t>(coreId);
-
-                ThreadContext* contextToMigrate =
-                    allThreadContexts[coreId][index];
-                allThreadContexts[coreId][index] = core.localThreadContexts[i];
-                core.localThreadContexts[i] = contextToMigrate;
+            if (migrateThread(static_cast<uint16_t>(i), coreId)) {
+                // Now that the thread has moved, we can clear our bit.
+                occupied[contextWord(i)] &= ~contextBit(i);
             } else {
                 ARACHNE_LOG(
                     WARNING,
@@ -1689,9 +3723,8 @@ migrateThreadsFromCore() {
 
     // Sanity checking that we are the only thread left on this core.
     int count = 0;
-    for (int i = 0; i < maxThreadsPerCore; i++)
-        if (blockedOccupiedAndCount.occupied & (1L << i))
-            count++;
+    for (int w = 0; w < numContextWords; w++)
+        count += __builtin_popcountll(occupied[w]);
     if (count != 1) {
         ARACHNE_LOG(ERROR,
                     "Failed to migrate threads off core; number of threads "
@@ -1704,7 +3737,206 @@ migrateThreadsFromCore() {
     // At this point, creations should have already been blocked, and
     // completions cannot occur because we are running, so we can just directly
     // assign.
-    *core.localOccupiedAndCount = blockedOccupiedAndCount;
+    if (multiWord) {
+        for (int w = 0; w < numContextWords; w++)
+            core.localOccupiedSlots->occupied[w] = occupied[w];
+    } else {
+        blockedOccupiedAndCount.occupied = occupied[0];
+        *core.localOccupiedAndCount = blockedOccupiedAndCount;
+    }
+
+    forwardInjectedThreads();
+}
+
+/**
+ * Invoked by dispatch() on a core which has nothing to run: ask the other
+ * core with the most runnable threads to hand over some of them, waking it if
+ * it has parked. The threads, if any, arrive later through this core's
+ * runnableThreads mask.
+ *
+ * \param now
+ *     The current value of the cycle counter.
+ */
+void
+stealWork(uint64_t now) {
+    if (now - core.lastStealAttempt <
+        Cycles::fromNanoseconds(STEAL_INTERVAL_NS))
+        return;
+    core.lastStealAttempt = now;
+
+    // Exclusive cores and cores being released must not take on threads.
+    if (localNumOccupied() >= static_cast<uint32_t>(maxThreadsPerCore))
+        return;
+
+    // Threads blocked on I/O or timers cannot be stolen, so choose the core
+    // with the most runnable threads rather than the most occupied one.
+    int victim = -1;
+    uint32_t victimRunnable = 1;
+    for (size_t i = 0; i < coreMap.size(); i++) {
+        if (static_cast<int>(i) == core.id || coreMap[i] == NULL)
+            continue;
+        uint32_t numRunnable =
+            coreMap[i]->numRunnable.load(std::memory_order_relaxed);
+        if (numRunnable > victimRunnable) {
+            victim = static_cast<int>(i);
+            victimRunnable = numRunnable;
+        }
+    }
+    if (victim < 0)
+        return;
+
+    // Another idle core may already have asked the same victim.
+    int noRequest = 0;
+    if (coreMap[victim]->stealRequest.compare_exchange_strong(noRequest,
+                                                              core.id + 1)) {
+        PerfStats::threadStats->numStealAttempts++;
+        // The request would hold off every other thief until the victim
+        // next woke.
+        if (coreMap[victim]->parked.load())
+            unparkCore(coreMap[victim]);
+    }
+}
+
+/**
+ * Invoked by dispatch() at the start of a round on a core that another core
+ * has asked for work. Hand the requesting core half of this core's runnable
+ * threads, taking unpinned threads of the default class from those that would
+ * run last in this round.
+ */
+void
+handleStealRequest() {
+    int thiefId = core.stealRequest.exchange(0) - 1;
+
+    // Timers of threads that arrived after this round's checkTimers() are not
+    // yet in our wheel, and must be before their threads can be handed on.
+    adoptMigratedTimers();
+
+    // Only threads which are runnable right now are worth handing over.
+    uint64_t runnable[MAX_CONTEXT_WORDS];
+    for (int w = 0; w < numContextWords; w++) {
+        uint64_t candidates = 0;
+        for (int level = 0; level < NUM_PRIORITY_LEVELS; level++)
+            candidates |= core.privateRunnableMask[level][w];
+        runnable[w] = 0;
+        for (; candidates != 0; candidates &= candidates - 1) {
+            int bit = __builtin_ctzll(candidates);
+            if (core.localThreadContexts[(w << 6) + bit]->wakeupTimeInCycles ==
+                0)
+                runnable[w] |= 1UL << bit;
+        }
+    }
+    int selfWord = contextWord(core.loadedContext->idInCore);
+    uint64_t selfMask = contextBit(core.loadedContext->idInCore);
+    if (core.loadedContext->wakeupTimeInCycles == 0)
+        runnable[selfWord] |= selfMask;
+
+    int numToSteal = 0;
+    for (int w = 0; w < numContextWords; w++)
+        numToSteal += __builtin_popcountll(runnable[w]);
+    numToSteal /= 2;
+    runnable[selfWord] &= ~selfMask;
+
+    int numStolen = 0;
+    bool thiefFull = false;
+    if (numToSteal > 0 && coreExclusionMutex.try_lock()) {
+        for (int w = numContextWords - 1;
+             w >= 0 && numStolen < numToSteal && !thiefFull; w--) {
+            uint64_t candidates = runnable[w] & ~core.localPinnedContexts[w];
+            while (numStolen < numToSteal && candidates) {
+                int bit = 63 - __builtin_clzll(candidates);
+                candidates &= ~(1UL << bit);
+                uint16_t index = static_cast<uint16_t>((w << 6) + bit);
+                if (core.localThreadContexts[index]->threadClass != 0)
+                    continue;
+                if (!migrateThread(index, thiefId)) {
+                    thiefFull = true;
+                    break;
+                }
+
+                // The thread has moved, so release its slot as if it had
+                // exited.
+                for (int level = 0; level < NUM_PRIORITY_LEVELS; level++)
+                    core.privateRunnableMask[level][w] &= ~(1UL << bit);
+                releaseOccupiedSlot(index);
+                numStolen++;
+            }
+        }
+        coreExclusionMutex.unlock();
+    }
+    if (numStolen > 0)
+        PerfStats::threadStats->numStealSuccesses++;
+    else
+        PerfStats::threadStats->numStealFailures++;
+}
+
+/**
+ * Invoked by dispatch() once a core has spun for idleSpinBudgetNs without
+ * finding work: block the kernel thread until another core hands this core a
+ * thread, an io_uring completion arrives, or the next timer is due. This
+ * function may return spuriously.
+ */
+void
+parkCore() {
+    uint64_t parkStartCycles = Cycles::rdtsc();
+
+    // Parking is not worth it if a timer is about to expire.
+    uint64_t wakeupTime = core.timerWheel.nextExpiry();
+    uint64_t spinBudget = Cycles::fromNanoseconds(idleSpinBudgetNs);
+    if (wakeupTime != ~0UL && wakeupTime < parkStartCycles + spinBudget)
+        return;
+
+    // Other cores signal parkFd only once they observe parked, so check for
+    // work that arrived earlier only after setting it.
+    core.parked.store(true);
+    bool haveWork = core.migratedTimers.load() != NULL ||
+                    core.injectedThreads.load() != NULL ||
+                    core.heldInjectedThreads != NULL ||
+                    core.stealRequest.load() != 0 ||
+                    core.trimStacksRequested.load() || shutdown ||
+                    core.registrations_seen.load() <
+                        registrations_generation.load();
+    for (int w = 0; w < numContextWords && !haveWork; w++)
+        haveWork = core.privatePriorityMask[w] || core.highPriorityThreads[w];
+    for (int i = 0; i < NUM_PRIORITY_LEVELS * numContextWords && !haveWork;
+         i++)
+        haveWork = core.runnableThreads[i] != 0;
+    haveWork = haveWork || highestRunnableLevel() >= 0;
+    if (!haveWork) {
+        struct timespec timeout;
+        struct timespec* timeoutPtr = NULL;
+        if (wakeupTime != ~0UL) {
+            uint64_t ns = Cycles::toNanoseconds(wakeupTime - parkStartCycles);
+            timeout.tv_sec = ns / 1000000000;
+            timeout.tv_nsec = ns % 1000000000;
+            timeoutPtr = &timeout;
+        }
+        struct pollfd pfd = {core.parkFd, POLLIN, 0};
+        ppoll(&pfd, 1, timeoutPtr, NULL);
+    }
+    core.parked.store(false, std::memory_order_relaxed);
+
+    // Drain wakeups, including the ones io_uring posts for completions that
+    // arrived while this core was running.
+    uint64_t count;
+    while (::read(core.parkFd, &count, sizeof(count)) > 0) {
+    }
+    PerfStats::threadStats->parkedCycles += Cycles::rdtsc() - parkStartCycles;
+}
+
+/**
+ * Wake the kernel thread of a core which has parked itself in parkCore().
+ *
+ * \param target
+ *     The core to wake.
+ */
+void
+unparkCore(Core* target) {
+    uint64_t one = 1;
+    if (::write(target->parkFd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        ARACHNE_LOG(ERROR, "Failed to wake core %d: %s", target->id,
+                    strerror(errno));
+        abort();
+    }
 }
 
 /**
@@ -1745,7 +3977,9 @@ idleCore(int coreId) {
 void
 idleCorePrivate() {
     // Our experiments show that Linux will put the core to sleep.
+    core.idled.store(true);
     coreIdleSemaphores[core.id]->wait();
+    core.idled.store(false);
 }
 
 /*
@@ -1769,11 +4003,20 @@ prepareForExclusiveUse(int coreId) {
     ThreadId migrationThread =
         createThreadOnCore(coreId, migrateThreadsFromCore);
     // The current thread is a non-Arachne thread.
+    bool multiWord = maxThreadsPerCore > MaskAndCount::MAX_THREADS;
     if (core.id == -1) {
         // Polling for completion is a short-term hack until we figure out a
         // good story for joining Arachne threads from non-Arachne threads.
-        while (Arachne::occupiedAndCount[coreId]->load().occupied)
-            usleep(10);
+        // An exiting thread clears its occupied bit before it decrements the
+        // count in OccupiedSlots, which was left at EXCLUSIVE by migration.
+        if (multiWord) {
+            while (occupiedSlots[coreId]->numOccupied ==
+                   OccupiedSlots::EXCLUSIVE)
+                usleep(10);
+        } else {
+            while (Arachne::occupiedAndCount[coreId]->load().occupied)
+                usleep(10);
+        }
     } else {
         Arachne::join(migrationThread);
     }
@@ -1781,7 +4024,11 @@ prepareForExclusiveUse(int coreId) {
     // Prepare this core for scheduling exclusively.
     // By setting numOccupied to one less than the maximium number of threads
     // per core, we ensure that only one thread gets scheduled onto this core.
-    *occupiedAndCount[coreId] = {0, maxThreadsPerCore - 1};
+    if (multiWord)
+        occupiedSlots[coreId]->numOccupied = maxThreadsPerCore - 1;
+    else
+        *occupiedAndCount[coreId] = {
+            0, static_cast<uint64_t>(maxThreadsPerCore - 1)};
 }
 
 /**
@@ -1792,6 +4039,25 @@ int
 findAndClaimUnusedCore(CorePolicy::CoreList* cores) {
     for (uint32_t i = 0; i < cores->size(); i++) {
         int coreId = cores->get(i);
+        if (maxThreadsPerCore > MaskAndCount::MAX_THREADS) {
+            // Exclusive cores admit a single thread, so a count below
+            // maxThreadsPerCore means that no creation holds a reservation.
+            OccupiedSlots* slots = occupiedSlots[coreId];
+            uint32_t numOccupied = slots->numOccupied;
+            if (numOccupied >= static_cast<uint32_t>(maxThreadsPerCore))
+                continue;
+            bool occupied = false;
+            for (int w = 0; w < numContextWords; w++)
+                occupied |= slots->occupied[w] != 0;
+            if (!occupied && slots->numOccupied.compare_exchange_strong(
+                                 numOccupied, maxThreadsPerCore)) {
+                cores->remove(i);
+                *lastTotalCollectionTime[coreId] = 0;
+                slots->numOccupied = 0;
+                return coreId;
+            }
+            continue;
+        }
         MaskAndCount slotMap = *occupiedAndCount[coreId];
         if (slotMap.occupied == 0) {
             // Attempt to reclaim this core with a CAS. Only move back
@@ -64,6 +64,24 @@ extern volatile uint32_t maxNumCores;
 
 extern int stackSize;
 
+extern bool enableWorkStealing;
+
+extern uint64_t idleSpinBudgetNs;
+
+extern uint64_t priorityAgingNs;
+
+extern int placementSlack;
+
+extern bool profileStackUsage;
+
+extern bool useHugePages;
+
+extern bool prefaultMemory;
+
+extern uint32_t submitBatchSize;
+
+extern uint64_t submitBatchAgeNs;
+
 // Used in inline functions.
 extern FILE* errorStream;
 void dispatch();
@@ -73,6 +91,8 @@ extern std::function<void()> deinitCore;
 
 extern std::vector<ThreadContext**> allThreadContexts;
 
+extern std::vector<uint64_t*> allDeadlines;
+
 extern CorePolicy* corePolicy;
 
 /*
@@ -81,6 +101,20 @@ extern CorePolicy* corePolicy;
  */
 extern bool disableLoadEstimation;
 
+/**
+ * How deep the stacks of exited threads of one thread class grew, as measured
+ * when profileStackUsage is set.
+ */
+struct StackUsageHistogram {
+    // counts[i] is the number of threads whose deepest stack use was at most
+    // 1 KB << i bytes and more than half that. Deeper uses are counted in the
+    // last bucket.
+    uint64_t counts[NUM_STACK_USAGE_BUCKETS];
+
+    // The deepest stack use of any of these threads, in bytes.
+    uint64_t maxBytes;
+};
+
 /**
  * \addtogroup api Arachne Public API
  * Most of the functions in this API, with the exception of Arachne::init(),
@@ -109,8 +143,17 @@ CorePolicy* getCorePolicy();
 
 void block();
 void schedule(ThreadId id);
+void switchTo(ThreadId id, bool remainRunnable = false);
 void join(ThreadId id);
 ThreadId getThreadId();
+void setPriority(int priority);
+int getPriority();
+void setDeadline(uint64_t deadlineInCycles);
+uint64_t getDeadline();
+bool setStackClass(int threadClass, int stackClass);
+int createFiberLocalKey(void (*destructor)(void*) = NULL);
+void trimStacks();
+StackUsageHistogram getStackUsage(int threadClass);
 
 void setErrorStream(FILE* ptr);
 void mainThreadInit();
@@ -219,13 +262,117 @@ struct ThreadInvocation : public ThreadInvocationEnabler {
     void runThread() { mainFunction(); }
 };
 
+void* allocInvocationBuffer(size_t size);
+void freeInvocationBuffer(void* contents);
+
+/**
+ * A ThreadInvocation for a main function and arguments too large to fit in
+ * ThreadContext::threadInvocation, which keeps them in a buffer from the
+ * creating core's invocation buffers instead.
+ *
+ * \tparam F
+ *     The type of the return value of std::bind, which is a value type of
+ *     unspecified class.
+ */
+template <typename F>
+struct BoxedThreadInvocation : public ThreadInvocationEnabler {
+    /// The top-level function of the Arachne thread, in its buffer.
+    F* mainFunction;
+
+    explicit BoxedThreadInvocation(F&& mainFunction)
+        : mainFunction(new (allocInvocationBuffer(sizeof(F)))
+                           F(std::move(mainFunction))) {
+        static_assert(
+            sizeof(F) <= INVOCATION_CLASS_SIZES[NUM_INVOCATION_CLASSES - 1],
+            "Arachne requires the function and arguments for a thread to "
+            "fit within the largest invocation class.");
+        static_assert(alignof(F) <= alignof(InvocationBuffer),
+                      "Arachne cannot align the function and arguments for "
+                      "this thread.");
+    }
+
+    void runThread() {
+        (*mainFunction)();
+        mainFunction->~F();
+        freeInvocationBuffer(mainFunction);
+    }
+};
+
+/**
+ * Construct the invocation for a main function and arguments that fit in
+ * ThreadContext::threadInvocation.
+ */
+template <typename F>
+void
+storeInvocation(void* data, F&& mainFunction, std::true_type) {
+    new (data) ThreadInvocation<F>(std::move(mainFunction));
+}
+
+/**
+ * Construct the invocation for a main function and arguments that do not fit
+ * in ThreadContext::threadInvocation.
+ */
+template <typename F>
+void
+storeInvocation(void* data, F&& mainFunction, std::false_type) {
+    new (data) BoxedThreadInvocation<F>(std::move(mainFunction));
+}
+
+/**
+ * Construct the invocation of a thread's main function and arguments in the
+ * threadInvocation storage of its ThreadContext, moving them out of line if
+ * they are too large for it.
+ */
+template <typename F>
+void
+storeInvocation(void* data, F&& mainFunction) {
+    storeInvocation(data, std::move(mainFunction),
+                    std::integral_constant<bool, sizeof(ThreadInvocation<F>) <=
+                                                     CACHE_LINE_SIZE - 8>());
+}
+
+/**
+ * A thread submitted with injectThread() which does not have a ThreadContext
+ * yet. It holds the thread's main function and arguments until the core it
+ * was injected into has a free context for it.
+ */
+struct InjectedThread {
+    /// The next thread on the list this thread is on.
+    InjectedThread* next = NULL;
+
+    /// Move the main function and arguments into the threadInvocation storage
+    /// of the ThreadContext that will run this thread.
+    virtual void moveInvocation(void* data) = 0;
+    virtual ~InjectedThread() {}
+};
+
+/**
+ * The InjectedThread for a main function and arguments of a given type.
+ *
+ * \tparam F
+ *     The type of the return value of std::bind, which is a value type of
+ *     unspecified class.
+ */
+template <typename F>
+struct InjectedInvocation : public InjectedThread {
+    /// The top-level function of the Arachne thread.
+    F mainFunction;
+
+    explicit InjectedInvocation(F&& mainFunction)
+        : mainFunction(std::move(mainFunction)) {}
+
+    void moveInvocation(void* data) {
+        storeInvocation(data, std::move(mainFunction));
+    }
+};
+
 /**
  * This class holds all the state for managing an Arachne thread.
  */
 class ThreadContext : public intrusive_list_base_hook<> {
   public:
-    /// Keep a reference to the original memory allocation for the stack used by
-    /// this threadContext so that we can release the memory in shutDown.
+    /// The lowest address of the stack used by this threadContext, which is
+    /// carved from the region of all stacks; the page below it is a guard.
     void* stack;
 
     /// This holds the value that rsp, the stack pointer register, will be set
@@ -268,7 +415,48 @@ class ThreadContext : public intrusive_list_base_hook<> {
     /// Unique identifier for this thread among those on the same core.
     /// Used to index into various core-specific arrays.
     /// This will only change if a ThreadContext is migrated.
-    uint8_t idInCore;
+    uint16_t idInCore;
+
+    /// The priority level of the thread in this context, between
+    /// DEFAULT_PRIORITY and NUM_PRIORITY_LEVELS - 1; it selects which of its
+    /// core's runnable masks the thread is placed in. Moves with the context
+    /// when it is migrated.
+    uint8_t priority;
+
+    /// For threads of CorePolicy::DEADLINE_CLASS, points at the value of the
+    /// cycle counter by which the thread should finish; dispatch() runs the
+    /// runnable deadline thread with the smallest value first. The value
+    /// lives in the slot of allDeadlines for this context's core and
+    /// idInCore, so that dispatch() can compare deadlines without touching
+    /// each ThreadContext; migrateThread() carries it to the new slot.
+    /// Meaningless for threads of other classes.
+    uint64_t* deadlineInCycles;
+
+    /// The stack class of the thread in this context, or OWN_STACK if it runs
+    /// on the stack of this context.
+    int8_t stackClass;
+
+    /// The pooled stack that the thread in this context runs on, if it has a
+    /// stack class.
+    void* pooledStack;
+
+    /// While the thread runs on a pooled stack, this holds the stack pointer
+    /// to return to on this context's own stack once the thread exits.
+    void* ownStackSp;
+
+    /// The fiber-local values of the thread in this context, indexed by keys
+    /// from createFiberLocalKey(); all NULL while no thread occupies the
+    /// context. Moves with the context when it is migrated.
+    void* fiberLocals[NUM_FIBER_LOCAL_SLOTS];
+
+    /// The generation of this context when trimStacks() last found it
+    /// unoccupied; if it is still the same at the next trim, no thread has
+    /// run here in between.
+    uint32_t trimGeneration;
+
+    /// True means that the stack memory of this context has been released
+    /// since its generation was last recorded in trimGeneration.
+    bool stackTrimmed;
 
     /// \var threadInvocation
     /// Storage for the ThreadInvocation object that contains the function and
@@ -284,6 +472,8 @@ class ThreadContext : public intrusive_list_base_hook<> {
         /// 0 is a signal that this thread should run at the next opportunity.
         /// ~0 is used as an infinitely large time: a sleeping thread will not
         /// awaken as long as wakeupTimeInCycles has this value.
+        /// Sleeping threads and threads waiting with a timeout leave this at
+        /// ~0 and arm their ThreadContext::timer instead.
         /// This variable lives here to share a cache line with the thread
         /// invocation, thereby removing a cache miss for thread creation.
         volatile uint64_t wakeupTimeInCycles;
@@ -306,13 +496,37 @@ class ThreadContext : public intrusive_list_base_hook<> {
     /// threadInvocation->wakeupTimeInCycles.
     volatile uint64_t& wakeupTimeInCycles;
 
+    /// Wakes this thread when it sleeps or waits with a timeout. A thread
+    /// waiting on its timer has wakeupTimeInCycles == BLOCKED, so dispatch()
+    /// need not compare deadlines against the cycle counter.
+    Timer timer;
+
     void initializeStack();
     ThreadContext() = delete;
     ThreadContext(ThreadContext&) = delete;
 
-    explicit ThreadContext(uint8_t idInCore);
+    ThreadContext(uint16_t idInCore, void* stack);
 };
 
+/**
+ * Return the current thread's value for a key from createFiberLocalKey(), or
+ * NULL if it has not set one. This must be called from an Arachne thread.
+ */
+inline void*
+getFiberLocal(int key) {
+    return core.loadedContext->fiberLocals[key];
+}
+
+/**
+ * Set the current thread's value for a key from createFiberLocalKey(). When
+ * the thread exits, the key's destructor is invoked on the value if neither
+ * is NULL. This must be called from an Arachne thread.
+ */
+inline void
+setFiberLocal(int key, void* value) {
+    core.loadedContext->fiberLocals[key] = value;
+}
+
 /**
  * This is the number of bytes needed on the stack to store the callee-saved
  * registers that are defined by the current processor and operating system's
@@ -320,12 +534,6 @@ class ThreadContext : public intrusive_list_base_hook<> {
  */
 const size_t SPACE_FOR_SAVED_REGISTERS = 48;
 
-/**
- * This value is placed at the lowest allocated address of the stack to detect
- * stack overflows.
- */
-const uint64_t STACK_CANARY = 0xDEADBAAD;
-
 /**
  * Amount of time in nanoseconds to wait for extant threads to finish before
  * commencing migration.
@@ -334,6 +542,8 @@ const uint64_t COMPLETION_WAIT_TIME = 100000;
 
 void schedulerMainLoop();
 void threadMain();
+void armTimer(uint64_t wakeupTime);
+void unparkCore(Core* target);
 
 /// This structure tracks the live threads on a single core.
 struct MaskAndCount {
@@ -351,16 +561,102 @@ struct MaskAndCount {
      * core.
      */
     static const uint8_t EXCLUSIVE;
+    /// The largest maxThreadsPerCore for which occupancy is tracked in a
+    /// MaskAndCount.
+    static const int MAX_THREADS = 56;
+};
+
+/**
+ * This structure tracks the live threads on a single core when
+ * maxThreadsPerCore is too large for a MaskAndCount. Since the occupied bits
+ * no longer share a word with the count, a creation first reserves a slot by
+ * incrementing numOccupied, which guarantees that some bit in occupied is
+ * clear, and then claims a clear bit. An exiting thread clears its bit before
+ * decrementing numOccupied, so the number of bits set never exceeds
+ * numOccupied.
+ */
+struct OccupiedSlots {
+    /// Same as MaskAndCount::numOccupied, except that it also counts slots
+    /// that have been reserved but not yet claimed.
+    std::atomic<uint32_t> numOccupied;
+    /// Bit j of word i corresponds to the ThreadContext with idInCore
+    /// 64 * i + j; only the first numContextWords words are used.
+    std::atomic<uint64_t> occupied[MAX_CONTEXT_WORDS];
+    /// Counterpart of MaskAndCount::EXCLUSIVE.
+    static const uint32_t EXCLUSIVE;
 };
 
 extern std::vector<std::atomic<MaskAndCount>*> occupiedAndCount;
 
+extern std::vector<OccupiedSlots*> occupiedSlots;
+
 extern std::vector<std::atomic<uint64_t>*> allHighPriorityThreads;
 
+extern std::vector<Core*> coreMap;
+
+extern std::vector<int> llcOfCore;
+
+extern std::atomic<int> threadClassStackClasses[MAX_STACK_THREAD_CLASSES];
+
+/**
+ * Return the stack class that threads of the given class are created with by
+ * default; see setStackClass().
+ */
+inline int
+stackClassOf(int threadClass) {
+    if (threadClass < 0 || threadClass >= MAX_STACK_THREAD_CLASSES)
+        return OWN_STACK;
+    return threadClassStackClasses[threadClass].load(
+               std::memory_order_relaxed) +
+           OWN_STACK;
+}
+
+void readCpuTopology(int numCores, const char* sysfsDir);
+void paintStack(void* bottom, void* end);
+size_t stackDepth(void* stack, size_t size);
+int earliestDeadlineSlot(const uint64_t* deadlines, const uint64_t* candidates);
+int earliestDeadlineSlotScalar(const uint64_t* deadlines,
+                               const uint64_t* candidates);
+#ifdef __x86_64__
+int earliestDeadlineSlotAvx2(const uint64_t* deadlines,
+                             const uint64_t* candidates);
+#endif
+extern bool cpuHasAvx2;
+
 #ifdef ARACHNE_TEST
 extern std::deque<uint64_t> mockRandomValues;
 #endif
 
+/**
+ * Return the number of threads on the given core, or a value of at least
+ * maxThreadsPerCore if the core is not accepting new threads.
+ */
+inline uint32_t
+numOccupiedOnCore(int coreId) {
+    if (likely(maxThreadsPerCore <= MaskAndCount::MAX_THREADS))
+        return occupiedAndCount[coreId]->load().numOccupied;
+    return occupiedSlots[coreId]->numOccupied.load();
+}
+
+int claimOccupiedSlot(int coreId, bool avoidPinned, int* failureCount);
+int claimOccupiedSlots(int coreId, int count, uint16_t* indices,
+                       int* failureCount);
+void injectThreads(int coreId, InjectedThread* first, InjectedThread* last);
+
+/**
+ * Set the bit for the given context in the shared runnable mask of its
+ * priority level on targetCore. The caller must have set the context's
+ * wakeupTimeInCycles to 0 first.
+ */
+inline void
+markRunnable(Core* targetCore, ThreadContext* context) {
+    int idInCore = context->idInCore;
+    targetCore
+        ->runnableThreads[context->priority * numContextWords +
+                          contextWord(idInCore)]
+        .fetch_or(contextBit(idInCore));
+}
+
 /**
  * A random number generator from the Internet that returns 64-bit integers.
  * It is used for selecting candidate cores to create threads on.
@@ -408,18 +704,131 @@ chooseCore(const CorePolicy::CoreList& coreList) {
     int choice1 = coreList.get(index1);
     int choice2 = coreList.get(index2);
 
-    if (occupiedAndCount[choice1]->load().numOccupied <
-        occupiedAndCount[choice2]->load().numOccupied)
+    if (numOccupiedOnCore(choice1) < numOccupiedOnCore(choice2))
         return choice1;
     return choice2;
 }
 
+/**
+ * Where to place a new thread relative to the core of the Arachne thread
+ * creating it. Threads created by other kernel threads are always placed
+ * with chooseCore().
+ */
+enum PlacementHint {
+    /// Use the creating core, or else another core sharing its last-level
+    /// cache, unless it hosts more than placementSlack threads more than a
+    /// core picked by chooseCore().
+    PLACE_NEARBY = 0,
+    /// Use the creating core unless it is full or not among the candidates.
+    PLACE_SAME_CORE,
+    /// Use a core that shares the creating core's last-level cache, unless
+    /// none of them is among the candidates or has room.
+    PLACE_SAME_LLC,
+    /// Ignore locality and use chooseCore().
+    PLACE_ANYWHERE
+};
+
+/**
+ * Select the less loaded of two random cores in coreList that share the
+ * given last-level cache.
+ *
+ * \return
+ *     The selected core, or -1 if no core in coreList shares the cache.
+ */
+static int __attribute__((unused))
+chooseCoreInLlc(const CorePolicy::CoreList& coreList, int llc) {
+    int numCandidates = 0;
+    for (int i = 0; i < coreList.size(); i++)
+        if (llcOfCore[coreList[i]] == llc)
+            numCandidates++;
+    if (numCandidates == 0)
+        return -1;
+
+    int choices[2];
+    for (int& choice : choices) {
+        int skip = static_cast<int>(random() % numCandidates);
+        for (int i = 0; i < coreList.size(); i++) {
+            if (llcOfCore[coreList[i]] == llc && skip-- == 0) {
+                choice = coreList[i];
+                break;
+            }
+        }
+    }
+    if (numOccupiedOnCore(choices[0]) < numOccupiedOnCore(choices[1]))
+        return choices[0];
+    return choices[1];
+}
+
+/**
+ * Select a core from coreList for a new thread, taking into account the core
+ * of the creating thread as directed by hint.
+ */
+static int __attribute__((unused))
+chooseCoreNear(const CorePolicy::CoreList& coreList, PlacementHint hint) {
+    if (hint == PLACE_ANYWHERE || core.loadedContext == NULL)
+        return chooseCore(coreList);
+    int self = core.id;
+    bool selfAvailable = coreList.find(self) >= 0 &&
+                         numOccupiedOnCore(self) <
+                             static_cast<uint32_t>(maxThreadsPerCore);
+    if (hint == PLACE_SAME_CORE && selfAvailable)
+        return self;
+    int sibling = chooseCoreInLlc(coreList, llcOfCore[self]);
+    bool siblingAvailable =
+        sibling >= 0 &&
+        numOccupiedOnCore(sibling) < static_cast<uint32_t>(maxThreadsPerCore);
+    if (hint != PLACE_NEARBY) {
+        if (siblingAvailable)
+            return sibling;
+        return chooseCore(coreList);
+    }
+
+    int other = chooseCore(coreList);
+    if (placementSlack < 0)
+        return other;
+    uint32_t limit = numOccupiedOnCore(other) + placementSlack;
+    if (selfAvailable && numOccupiedOnCore(self) <= limit)
+        return self;
+    if (siblingAvailable && numOccupiedOnCore(sibling) <= limit)
+        return sibling;
+    return other;
+}
+
+/**
+ * Scheduling properties of a new thread, which are set before the thread
+ * first becomes runnable.
+ */
+struct ThreadAttributes {
+    explicit ThreadAttributes(int priority = DEFAULT_PRIORITY,
+                              int threadClass = 0,
+                              uint64_t deadlineInCycles = 0,
+                              int stackClass = OWN_STACK)
+        : priority(priority),
+          threadClass(threadClass),
+          deadlineInCycles(deadlineInCycles),
+          stackClass(stackClass) {}
+
+    /// See ThreadContext::priority.
+    int priority;
+
+    /// See ThreadContext::threadClass.
+    int threadClass;
+
+    /// See ThreadContext::deadlineInCycles.
+    uint64_t deadlineInCycles;
+
+    /// See ThreadContext::stackClass.
+    int stackClass;
+};
+
 /**
  * Spawn a thread with main function f invoked with the given args on the
- * kernel thread with id = coreId
+ * kernel thread with id = coreId, with the given scheduling attributes.
  * This function should usually only be invoked directly in tests, since it
  * does not perform load balancing.
  *
+ * \param attributes
+ *     The priority level, thread class and deadline of the new thread.
  * \param coreId
  *     The id for the kernel thread to put the new Arachne thread on.
  * \param __f
@@ -433,7 +842,9 @@ chooseCore(const CorePolicy::CoreList& coreList) {
  */
 template <typename _Callable, typename... _Args>
 ThreadId
-createThreadOnCore(uint32_t coreId, _Callable&& __f, _Args&&... __args) {
+createThreadOnCoreWithAttributes(const ThreadAttributes& attributes,
+                                 uint32_t coreId, _Callable&& __f,
+                                 _Args&&... __args) {
     auto task =
         std::bind(std::forward<_Callable>(__f), std::forward<_Args>(__args)...);
 
@@ -441,49 +852,59 @@ createThreadOnCore(uint32_t coreId, _Callable&& __f, _Args&&... __args) {
     bool success;
     uint32_t index;
     int failureCount = 0;
-    do {
-        // Each iteration through this loop makes one attempt to enqueue the
-        // task to the specified core. Multiple iterations are required only if
-        // there is contention for the core's state variables.
-        MaskAndCount slotMap = *occupiedAndCount[coreId];
-        MaskAndCount oldSlotMap = slotMap;
-
-        if (slotMap.numOccupied >= maxThreadsPerCore) {
-            ARACHNE_LOG(VERBOSE,
-                        "createThread failure, coreId = %u, "
-                        "numOccupied = %ld\n",
-                        coreId, slotMap.numOccupied);
+    if (unlikely(maxThreadsPerCore > MaskAndCount::MAX_THREADS)) {
+        int claimed = claimOccupiedSlot(coreId, false, &failureCount);
+        if (claimed < 0) {
+            ARACHNE_LOG(VERBOSE, "createThread failure, coreId = %u\n",
+                        coreId);
             return NullThread;
         }
-
-        // Search for a non-occupied slot and attempt to reserve the slot
-        index = ffsll(~slotMap.occupied);
-        if (!index) {
-            ARACHNE_LOG(WARNING,
-                        "createThread failed after passing numOccupied"
-                        " check, coreId = %u,"
-                        " numOccupied = %ld\n",
-                        coreId, slotMap.numOccupied);
-            return NullThread;
-        }
-
-        // ffsll returns a 1-based index.
-        index--;
-
-        slotMap.occupied =
-            (slotMap.occupied | (1L << index)) & 0x00FFFFFFFFFFFFFF;
-        slotMap.numOccupied++;
+        index = claimed;
         threadContext = allThreadContexts[coreId][index];
-        success = occupiedAndCount[coreId]->compare_exchange_strong(oldSlotMap,
-                                                                    slotMap);
-        if (!success) {
-            failureCount++;
-        }
-    } while (!success);
+    } else {
+        do {
+            // Each iteration through this loop makes one attempt to enqueue
+            // the task to the specified core. Multiple iterations are required
+            // only if there is contention for the core's state variables.
+            MaskAndCount slotMap = *occupiedAndCount[coreId];
+            MaskAndCount oldSlotMap = slotMap;
+
+            if (slotMap.numOccupied >= maxThreadsPerCore) {
+                ARACHNE_LOG(VERBOSE,
+                            "createThread failure, coreId = %u, "
+                            "numOccupied = %ld\n",
+                            coreId, slotMap.numOccupied);
+                return NullThread;
+            }
+
+            // Search for a non-occupied slot and attempt to reserve the slot
+            index = ffsll(~slotMap.occupied);
+            if (!index) {
+                ARACHNE_LOG(WARNING,
+                            "createThread failed after passing numOccupied"
+                            " check, coreId = %u,"
+                            " numOccupied = %ld\n",
+                            coreId, slotMap.numOccupied);
+                return NullThread;
+            }
+
+            // ffsll returns a 1-based index.
+            index--;
+
+            slotMap.occupied =
+                (slotMap.occupied | (1L << index)) & 0x00FFFFFFFFFFFFFF;
+            slotMap.numOccupied++;
+            threadContext = allThreadContexts[coreId][index];
+            success = occupiedAndCount[coreId]->compare_exchange_strong(
+                oldSlotMap, slotMap);
+            if (!success) {
+                failureCount++;
+            }
+        } while (!success);
+    }
 
     // Copy the thread invocation into the byte array.
-    new (&threadContext->threadInvocation.data)
-        Arachne::ThreadInvocation<decltype(task)>(std::move(task));
+    storeInvocation(&threadContext->threadInvocation.data, std::move(task));
 
     // Read the generation number *before* waking up the thread, to avoid a
     // race where the thread finishes executing so fast that we read the next
@@ -493,7 +914,18 @@ createThreadOnCore(uint32_t coreId, _Callable&& __f, _Args&&... __args) {
     // in the microbenchmark. One speculation is that we can get better ILP by
     // not using the same variable for both.
     uint32_t generation = allThreadContexts[coreId][index]->generation;
+    threadContext->priority = static_cast<uint8_t>(attributes.priority);
+    threadContext->threadClass = attributes.threadClass;
+    if (attributes.threadClass == CorePolicy::DEADLINE_CLASS)
+        *threadContext->deadlineInCycles = attributes.deadlineInCycles;
+    threadContext->stackClass = static_cast<int8_t>(attributes.stackClass);
     threadContext->wakeupTimeInCycles = 0;
+    Core* targetCore = coreMap[coreId];
+    if (attributes.threadClass == CorePolicy::DEADLINE_CLASS)
+        targetCore->newDeadlineThreads[contextWord(index)] |= contextBit(index);
+    markRunnable(targetCore, threadContext);
+    if (targetCore->parked.load())
+        unparkCore(targetCore);
 
     PerfStats::threadStats->numThreadsCreated++;
     if (failureCount)
@@ -502,6 +934,59 @@ createThreadOnCore(uint32_t coreId, _Callable&& __f, _Args&&... __args) {
     return ThreadId(threadContext, generation);
 }
 
+/**
+ * Spawn a thread with main function f invoked with the given args on the
+ * kernel thread with id = coreId, at the given priority level.
+ * This function should usually only be invoked directly in tests, since it
+ * does not perform load balancing.
+ *
+ * \param priority
+ *     The priority level of the new thread; see setPriority().
+ * \param coreId
+ *     The id for the kernel thread to put the new Arachne thread on.
+ * \param __f
+ *     The main function for the new thread.
+ * \param __args
+ *     The arguments for __f.
+ * \return
+ *     The return value is an identifier for the newly created thread. If
+ *     there are insufficient resources for creating a new thread, then
+ *     NullThread will be returned.
+ */
+template <typename _Callable, typename... _Args>
+ThreadId
+createThreadOnCoreWithPriority(int priority, uint32_t coreId, _Callable&& __f,
+                               _Args&&... __args) {
+    return createThreadOnCoreWithAttributes(ThreadAttributes(priority), coreId,
+                                            std::forward<_Callable>(__f),
+                                            std::forward<_Args>(__args)...);
+}
+
+/**
+ * Spawn a thread with main function f invoked with the given args on the
+ * kernel thread with id = coreId, at DEFAULT_PRIORITY.
+ * This function should usually only be invoked directly in tests, since it
+ * does not perform load balancing.
+ *
+ * \param coreId
+ *     The id for the kernel thread to put the new Arachne thread on.
+ * \param __f
+ *     The main function for the new thread.
+ * \param __args
+ *     The arguments for __f.
+ * \return
+ *     The return value is an identifier for the newly created thread. If
+ *     there are insufficient resources for creating a new thread, then
+ *     NullThread will be returned.
+ */
+template <typename _Callable, typename... _Args>
+ThreadId
+createThreadOnCore(uint32_t coreId, _Callable&& __f, _Args&&... __args) {
+    return createThreadOnCoreWithPriority(DEFAULT_PRIORITY, coreId,
+                                          std::forward<_Callable>(__f),
+                                          std::forward<_Args>(__args)...);
+}
+
 int chooseCore(const CorePolicy::CoreList& coreList);
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -517,9 +1002,11 @@ int chooseCore(const CorePolicy::CoreList& coreList);
  * \param __f
  *     The main function for the new thread.
  * \param __args
- *     The arguments for __f. The total size of the arguments cannot exceed 48
- *     bytes, and arguments are taken by value, so any reference must be
- *     wrapped with std::ref.
+ *     The arguments for __f. Together with __f, they may take up to the
+ *     largest of INVOCATION_CLASS_SIZES bytes; beyond the 48 bytes that fit
+ *     in the thread's context, they are kept in an invocation buffer.
+ *     Arguments are taken by value, so any reference must be wrapped with
+ *     std::ref.
  * \return
  *     The return value is an identifier for the newly created thread. If
  *     there are insufficient resources for creating a new thread, then
@@ -530,17 +1017,94 @@ int chooseCore(const CorePolicy::CoreList& coreList);
 template <typename _Callable, typename... _Args>
 ThreadId
 createThreadWithClass(int threadClass, _Callable&& __f, _Args&&... __args) {
-    // Find a core to enqueue to by picking two at random and choosing
-    // the one with the fewest Arachne threads.
+    // Find a core to enqueue to, preferring cores near the creating thread
+    // over picking two at random and choosing the one with the fewest
+    // Arachne threads.
     CorePolicy::CoreList coreList = corePolicy->getCores(threadClass);
     if (coreList.size() == 0)
         return Arachne::NullThread;
-    uint32_t kId = static_cast<uint32_t>(chooseCore(coreList));
-    auto threadId = createThreadOnCore(kId, __f, __args...);
-    if (threadId != NullThread) {
-        threadId.context->threadClass = threadClass;
-    }
-    return threadId;
+    uint32_t kId =
+        static_cast<uint32_t>(chooseCoreNear(coreList, PLACE_NEARBY));
+    return createThreadOnCoreWithAttributes(
+        ThreadAttributes(DEFAULT_PRIORITY, threadClass, 0,
+                         stackClassOf(threadClass)),
+        kId, __f, __args...);
+}
+
+/**
+ * Spawn a new thread with the given threadClass, function and arguments,
+ * which runs on a stack of the given stack class.
+ *
+ * \param threadClass
+ *     The class of the thread being created; its meaning is determined by the
+ *     currently running CorePolicy.
+ * \param stackClass
+ *     An index into STACK_CLASS_SIZES selecting the size of the new thread's
+ *     stack, or OWN_STACK to run on a stack of stackSize bytes.
+ * \param __f
+ *     The main function for the new thread.
+ * \param __args
+ *     The arguments for __f. Together with __f, they may take up to the
+ *     largest of INVOCATION_CLASS_SIZES bytes; beyond the 48 bytes that fit
+ *     in the thread's context, they are kept in an invocation buffer.
+ *     Arguments are taken by value, so any reference must be wrapped with
+ *     std::ref.
+ * \return
+ *     The return value is an identifier for the newly created thread. If
+ *     there are insufficient resources for creating a new thread, or the
+ *     stack class is out of range, then NullThread will be returned.
+ *
+ * \ingroup api
+ */
+template <typename _Callable, typename... _Args>
+ThreadId
+createThreadWithStackClass(int threadClass, int stackClass, _Callable&& __f,
+                           _Args&&... __args) {
+    if (stackClass < OWN_STACK || stackClass >= NUM_STACK_CLASSES)
+        return Arachne::NullThread;
+    CorePolicy::CoreList coreList = corePolicy->getCores(threadClass);
+    if (coreList.size() == 0)
+        return Arachne::NullThread;
+    uint32_t kId =
+        static_cast<uint32_t>(chooseCoreNear(coreList, PLACE_NEARBY));
+    return createThreadOnCoreWithAttributes(
+        ThreadAttributes(DEFAULT_PRIORITY, threadClass, 0, stackClass), kId,
+        __f, __args...);
+}
+
+/**
+ * Spawn a new thread with a function and arguments, placing it relative to
+ * the core of the creating thread as directed by a hint.
+ *
+ * \param hint
+ *     Where to place the new thread; see PlacementHint. createThread() uses
+ *     PLACE_NEARBY.
+ * \param __f
+ *     The main function for the new thread.
+ * \param __args
+ *     The arguments for __f. Together with __f, they may take up to the
+ *     largest of INVOCATION_CLASS_SIZES bytes; beyond the 48 bytes that fit
+ *     in the thread's context, they are kept in an invocation buffer.
+ *     Arguments are taken by value, so any reference must be wrapped with
+ *     std::ref.
+ * \return
+ *     The return value is an identifier for the newly created thread. If
+ *     there are insufficient resources for creating a new thread, then
+ *     NullThread will be returned.
+ *
+ * \ingroup api
+ */
+template <typename _Callable, typename... _Args>
+ThreadId
+createThreadWithPlacement(PlacementHint hint, _Callable&& __f,
+                          _Args&&... __args) {
+    CorePolicy::CoreList coreList = corePolicy->getCores(0);
+    if (coreList.size() == 0)
+        return Arachne::NullThread;
+    uint32_t kId = static_cast<uint32_t>(chooseCoreNear(coreList, hint));
+    return createThreadOnCoreWithAttributes(
+        ThreadAttributes(DEFAULT_PRIORITY, 0, 0, stackClassOf(0)), kId, __f,
+        __args...);
 }
 
 /**
@@ -549,9 +1113,11 @@ createThreadWithClass(int threadClass, _Callable&& __f, _Args&&... __args) {
  * \param __f
  *     The main function for the new thread.
  * \param __args
- *     The arguments for __f. The total size of the arguments cannot exceed 48
- *     bytes, and arguments are taken by value, so any reference must be
- *     wrapped with std::ref.
+ *     The arguments for __f. Together with __f, they may take up to the
+ *     largest of INVOCATION_CLASS_SIZES bytes; beyond the 48 bytes that fit
+ *     in the thread's context, they are kept in an invocation buffer.
+ *     Arguments are taken by value, so any reference must be wrapped with
+ *     std::ref.
  * \return
  *     The return value is an identifier for the newly created thread. If
  *     there are insufficient resources for creating a new thread, then
@@ -565,6 +1131,248 @@ createThread(_Callable&& __f, _Args&&... __args) {
     return createThreadWithClass(0, __f, __args...);
 }
 
+/**
+ * Spawn a batch of threads which all run the same function with the same
+ * arguments. This is cheaper than calling createThread() n times: the cores
+ * are looked up once, and the threads placed on each core claim their slots
+ * with a single CAS, which also keeps contention down when many threads
+ * create at once.
+ *
+ * \param n
+ *     The number of threads to create.
+ * \param threadIds
+ *     An array of n elements, which receives the identifiers for the new
+ *     threads. Elements for threads that could not be created are set to
+ *     NullThread.
+ * \param __f
+ *     The main function for the new threads.
+ * \param __args
+ *     The arguments for __f, which are copied for each thread. Together
+ *     with __f, they may take up to the largest of INVOCATION_CLASS_SIZES
+ *     bytes; beyond the 48 bytes that fit in a thread's context, each
+ *     thread's copy is kept in an invocation buffer. Arguments are taken by
+ *     value, so any reference must be wrapped with std::ref.
+ * \return
+ *     The number of threads created, which is less than n if there were
+ *     insufficient resources. The created threads occupy the first elements
+ *     of threadIds.
+ *
+ * \ingroup api
+ */
+template <typename _Callable, typename... _Args>
+int
+createThreads(int n, ThreadId* threadIds, _Callable&& __f, _Args&&... __args) {
+    auto task =
+        std::bind(std::forward<_Callable>(__f), std::forward<_Args>(__args)...);
+
+    int numCreated = 0;
+    int8_t stackClass = static_cast<int8_t>(stackClassOf(0));
+    CorePolicy::CoreList coreList = corePolicy->getCores(0);
+    if (coreList.size() > 0) {
+        // Give each core an even share of the batch; chooseCore() steers
+        // each share away from the cores that already took one.
+        int share = (n + coreList.size() - 1) / coreList.size();
+        if (share > MaskAndCount::MAX_THREADS)
+            share = MaskAndCount::MAX_THREADS;
+        uint16_t indices[MaskAndCount::MAX_THREADS];
+
+        // Create up to a share of the remaining threads on the given core,
+        // and return how many were created.
+        auto createShare = [&](uint32_t coreId) -> int {
+            int failureCount = 0;
+            int numClaimed = claimOccupiedSlots(
+                coreId, std::min(share, n - numCreated), indices,
+                &failureCount);
+            if (numClaimed == 0)
+                return 0;
+
+            uint64_t runnable[MAX_CONTEXT_WORDS] = {};
+            for (int i = 0; i < numClaimed; i++) {
+                ThreadContext* threadContext =
+                    allThreadContexts[coreId][indices[i]];
+                decltype(task) taskCopy(task);
+                storeInvocation(&threadContext->threadInvocation.data,
+                                std::move(taskCopy));
+                threadIds[numCreated++] =
+                    ThreadId(threadContext, threadContext->generation);
+                threadContext->priority = DEFAULT_PRIORITY;
+                threadContext->threadClass = 0;
+                threadContext->stackClass = stackClass;
+                threadContext->wakeupTimeInCycles = 0;
+                runnable[contextWord(indices[i])] |= contextBit(indices[i]);
+            }
+
+            // Wake the whole share with one update per mask word.
+            Core* targetCore = coreMap[coreId];
+            for (int w = 0; w < numContextWords; w++) {
+                if (runnable[w])
+                    targetCore
+                        ->runnableThreads[DEFAULT_PRIORITY * numContextWords +
+                                          w] |= runnable[w];
+            }
+            if (targetCore->parked.load())
+                unparkCore(targetCore);
+
+            PerfStats::threadStats->numThreadsCreated += numClaimed;
+            if (failureCount)
+                PerfStats::threadStats->numContendedCreations++;
+            return numClaimed;
+        };
+
+        int numFullCores = 0;
+        while (numCreated < n && numFullCores < coreList.size()) {
+            if (createShare(static_cast<uint32_t>(chooseCore(coreList))) == 0)
+                numFullCores++;
+            else
+                numFullCores = 0;
+        }
+
+        // chooseCore() is random, so it may have missed cores that still
+        // have free slots; visit every core once before giving up.
+        for (int i = 0; i < coreList.size() && numCreated < n; i++) {
+            while (numCreated < n &&
+                   createShare(static_cast<uint32_t>(coreList[i])) > 0) {
+            }
+        }
+    }
+    for (int i = numCreated; i < n; i++)
+        threadIds[i] = NullThread;
+    return numCreated;
+}
+
+/**
+ * Submit a thread with main function f invoked with the given args to the
+ * kernel thread with id = coreId; see injectThread().
+ *
+ * \param coreId
+ *     The id for the kernel thread to put the new Arachne thread on.
+ * \param __f
+ *     The main function for the new thread.
+ * \param __args
+ *     The arguments for __f.
+ */
+template <typename _Callable, typename... _Args>
+void
+injectThreadOnCore(uint32_t coreId, _Callable&& __f, _Args&&... __args) {
+    auto task =
+        std::bind(std::forward<_Callable>(__f), std::forward<_Args>(__args)...);
+    InjectedThread* thread =
+        new InjectedInvocation<decltype(task)>(std::move(task));
+    injectThreads(coreId, thread, thread);
+}
+
+/**
+ * Submit a new thread with a function and arguments from a thread that is
+ * not an Arachne thread, such as an I/O callback thread. Unlike
+ * createThread(), this never contends with other creations for a core's
+ * slots: the thread is queued on a core, which starts it as soon as it has a
+ * free context, so it is held rather than dropped when the core is full. The
+ * caller does not get a ThreadId, since the thread has none until it starts.
+ *
+ * \param __f
+ *     The main function for the new thread.
+ * \param __args
+ *     The arguments for __f. Together with __f, they may take up to the
+ *     largest of INVOCATION_CLASS_SIZES bytes; beyond the 48 bytes that fit
+ *     in the thread's context, they are kept in an invocation buffer.
+ *     Arguments are taken by value, so any reference must be wrapped with
+ *     std::ref.
+ * \return
+ *     True if the thread was queued; false if there are no cores to run it.
+ *
+ * \ingroup api
+ */
+template <typename _Callable, typename... _Args>
+bool
+injectThread(_Callable&& __f, _Args&&... __args) {
+    CorePolicy::CoreList coreList = corePolicy->getCores(0);
+    if (coreList.size() == 0)
+        return false;
+    uint32_t kId = static_cast<uint32_t>(chooseCore(coreList));
+    injectThreadOnCore(kId, std::forward<_Callable>(__f),
+                       std::forward<_Args>(__args)...);
+    return true;
+}
+
+/**
+ * Spawn a new thread with the given priority level, function and arguments.
+ * Runnable threads at a higher level always run before those at lower levels
+ * on the same core, except when a lower level has waited longer than
+ * priorityAgingNs; see setPriority().
+ *
+ * \param priority
+ *     The priority level of the new thread, between DEFAULT_PRIORITY and
+ *     NUM_PRIORITY_LEVELS - 1.
+ * \param __f
+ *     The main function for the new thread.
+ * \param __args
+ *     The arguments for __f. Together with __f, they may take up to the
+ *     largest of INVOCATION_CLASS_SIZES bytes; beyond the 48 bytes that fit
+ *     in the thread's context, they are kept in an invocation buffer.
+ *     Arguments are taken by value, so any reference must be wrapped with
+ *     std::ref.
+ * \return
+ *     The return value is an identifier for the newly created thread. If
+ *     there are insufficient resources for creating a new thread, or the
+ *     priority is out of range, then NullThread will be returned.
+ *
+ * \ingroup api
+ */
+template <typename _Callable, typename... _Args>
+ThreadId
+createThreadWithPriority(int priority, _Callable&& __f, _Args&&... __args) {
+    if (priority < DEFAULT_PRIORITY || priority >= NUM_PRIORITY_LEVELS)
+        return Arachne::NullThread;
+    CorePolicy::CoreList coreList = corePolicy->getCores(0);
+    if (coreList.size() == 0)
+        return Arachne::NullThread;
+    uint32_t kId =
+        static_cast<uint32_t>(chooseCoreNear(coreList, PLACE_NEARBY));
+    return createThreadOnCoreWithAttributes(
+        ThreadAttributes(priority, 0, 0, stackClassOf(0)), kId, __f,
+        __args...);
+}
+
+/**
+ * Spawn a new thread of CorePolicy::DEADLINE_CLASS with the given deadline,
+ * function and arguments. Runnable deadline threads run before all other
+ * threads on their core, earliest deadline first; see setDeadline().
+ *
+ * \param deadlineInCycles
+ *     The value of the cycle counter by which the new thread should finish.
+ * \param __f
+ *     The main function for the new thread.
+ * \param __args
+ *     The arguments for __f. Together with __f, they may take up to the
+ *     largest of INVOCATION_CLASS_SIZES bytes; beyond the 48 bytes that fit
+ *     in the thread's context, they are kept in an invocation buffer.
+ *     Arguments are taken by value, so any reference must be wrapped with
+ *     std::ref.
+ * \return
+ *     The return value is an identifier for the newly created thread. If
+ *     there are insufficient resources for creating a new thread, or the
+ *     CorePolicy provides no cores for deadline threads, then NullThread will
+ *     be returned.
+ *
+ * \ingroup api
+ */
+template <typename _Callable, typename... _Args>
+ThreadId
+createThreadWithDeadline(uint64_t deadlineInCycles, _Callable&& __f,
+                         _Args&&... __args) {
+    CorePolicy::CoreList coreList =
+        corePolicy->getCores(CorePolicy::DEADLINE_CLASS);
+    if (coreList.size() == 0)
+        return Arachne::NullThread;
+    uint32_t kId =
+        static_cast<uint32_t>(chooseCoreNear(coreList, PLACE_NEARBY));
+    return createThreadOnCoreWithAttributes(
+        ThreadAttributes(DEFAULT_PRIORITY, CorePolicy::DEADLINE_CLASS,
+                         deadlineInCycles,
+                         stackClassOf(CorePolicy::DEADLINE_CLASS)),
+        kId, __f, __args...);
+}
+
 /**
  * Block the current thread until the condition variable is notified.
  *
@@ -603,11 +1411,9 @@ ConditionVariable::wait(LockType& lock) {
 template <typename LockType>
 bool
 ConditionVariable::timed_wait(LockType& lock, uint64_t ns) {
-    if (ns == ~0)
-        core.loadedContext->wakeupTimeInCycles = ns;
-    else
-        core.loadedContext->wakeupTimeInCycles =
-            Cycles::rdtsc() + Cycles::fromNanoseconds(ns);
+    core.loadedContext->wakeupTimeInCycles = ThreadContext::BLOCKED;
+    if (ns != ~0ULL)
+        armTimer(Cycles::rdtsc() + Cycles::fromNanoseconds(ns));
     blockedThreads.push_back(*core.loadedContext);
     lock.unlock();
     dispatch();
@@ -644,7 +1450,7 @@ struct IdleTimeTracker {
     /**
      * The number of threads ran in the last loop through all contexts.
      */
-    static thread_local uint8_t numThreadsRan;
+    static thread_local uint32_t numThreadsRan;
 
     IdleTimeTracker();
     void updatePerfStats();
@@ -676,6 +1482,7 @@ class NestedDispatchDetector {
 // Force instantiation for debugging with operator[]
 template class std::vector<Arachne::ThreadContext**>;
 template class std::vector<std::atomic<Arachne::MaskAndCount>*>;
+template class std::vector<Arachne::OccupiedSlots*>;
 template class std::vector<std::atomic<uint64_t>*>;
 template class std::vector<Arachne::PerfStats*>;
 
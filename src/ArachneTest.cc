@@ -13,6 +13,11 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <random>
 #include <thread>
 #include "PerfUtils/Cycles.h"
 #include "gtest/gtest.h"
@@ -391,6 +396,147 @@ TEST_F(ArachneTest, createThread_maxThreadsExceeded) {
     threadCreationIndicator = 0;
 }
 
+TEST_F(ArachneTest, createThread_multiWordSlots) {
+    // See comment in parseOptions_noOptions
+    shutDown();
+    waitForTermination();
+    int originalMaxThreadsPerCore = maxThreadsPerCore;
+    int originalStackSize = stackSize;
+    maxThreadsPerCore = 200;
+    stackSize = 64 * 1024;
+    Arachne::init();
+    EXPECT_EQ(4, numContextWords);
+
+    int coreId = corePolicy->getCores(0)[0];
+    for (int i = 0; i < maxThreadsPerCore; i++)
+        EXPECT_NE(Arachne::NullThread, createThreadOnCore(coreId, clearFlag));
+    EXPECT_EQ(Arachne::NullThread, createThreadOnCore(coreId, clearFlag));
+    EXPECT_EQ(200U, numOccupiedOnCore(coreId));
+    EXPECT_EQ(~0UL, occupiedSlots[coreId]->occupied[2].load());
+    EXPECT_EQ(0xFFUL, occupiedSlots[coreId]->occupied[3].load());
+
+    // Clean up the threads
+    while (numOccupiedOnCore(coreId) > 0)
+        threadCreationIndicator = 1;
+    threadCreationIndicator = 0;
+    for (int w = 0; w < numContextWords; w++)
+        EXPECT_EQ(0U, occupiedSlots[coreId]->occupied[w].load());
+
+    shutDown();
+    waitForTermination();
+    maxThreadsPerCore = originalMaxThreadsPerCore;
+    stackSize = originalStackSize;
+    Arachne::init();
+}
+
+TEST_F(ArachneTest, hugePagesAndPrefault) {
+    // See comment in parseOptions_noOptions
+    shutDown();
+    waitForTermination();
+    useHugePages = true;
+    prefaultMemory = true;
+    Arachne::init();
+
+    // Contexts are carved from one huge-page region, and stacks are laid out
+    // without guard pages between them.
+    int coreId = corePolicy->getCores(0)[0];
+    ThreadContext** contexts = allThreadContexts[coreId];
+    EXPECT_EQ(reinterpret_cast<char*>(contexts[0]->stack) + stackSize,
+              contexts[1]->stack);
+    EXPECT_NE(Arachne::NullThread, createThreadOnCore(coreId, clearFlag));
+    while (numOccupiedOnCore(coreId) > 0)
+        threadCreationIndicator = 1;
+    threadCreationIndicator = 0;
+
+    shutDown();
+    waitForTermination();
+    useHugePages = false;
+    prefaultMemory = false;
+    Arachne::init();
+}
+
+TEST_F(ArachneTest, claimOccupiedSlots) {
+    int coreId = corePolicy->getCores(0)[0];
+    *occupiedAndCount[coreId] = {0b1101, 3};
+    uint16_t indices[3];
+    int failureCount = 0;
+    EXPECT_EQ(3, claimOccupiedSlots(coreId, 3, indices, &failureCount));
+    EXPECT_EQ(1, indices[0]);
+    EXPECT_EQ(4, indices[1]);
+    EXPECT_EQ(5, indices[2]);
+    EXPECT_EQ(6U, Arachne::occupiedAndCount[coreId]->load().numOccupied);
+    EXPECT_EQ(0b111111U, Arachne::occupiedAndCount[coreId]->load().occupied);
+    EXPECT_EQ(0, failureCount);
+
+    // A nearly full core hands out what it has left.
+    *occupiedAndCount[coreId] = {(1UL << (maxThreadsPerCore - 1)) - 1,
+                                 static_cast<uint8_t>(maxThreadsPerCore - 1)};
+    EXPECT_EQ(1, claimOccupiedSlots(coreId, 3, indices, &failureCount));
+    EXPECT_EQ(maxThreadsPerCore - 1, indices[0]);
+    EXPECT_EQ(0, claimOccupiedSlots(coreId, 3, indices, &failureCount));
+
+    // Clear out the seeded occupiedAndCount
+    *occupiedAndCount[coreId] = {0, 0};
+}
+
+TEST_F(ArachneTest, createThreads) {
+    CorePolicy::CoreList coreList = corePolicy->getCores(0);
+    int capacity = coreList.size() * maxThreadsPerCore;
+    std::vector<ThreadId> threadIds(capacity + 1);
+    EXPECT_EQ(8, createThreads(8, threadIds.data(), clearFlag));
+    uint32_t numOccupied = 0;
+    for (int i = 0; i < coreList.size(); i++)
+        numOccupied += numOccupiedOnCore(coreList[i]);
+    EXPECT_EQ(8U, numOccupied);
+    for (int i = 0; i < 8; i++)
+        EXPECT_NE(Arachne::NullThread, threadIds[i]);
+
+    // Fill every core; the threads which do not fit are not created.
+    EXPECT_EQ(capacity - 8,
+              createThreads(capacity - 7, threadIds.data(), clearFlag));
+    EXPECT_EQ(Arachne::NullThread, threadIds[capacity - 8]);
+
+    // Clean up the threads
+    for (int i = 0; i < coreList.size(); i++)
+        while (numOccupiedOnCore(coreList[i]) > 0)
+            threadCreationIndicator = 1;
+    threadCreationIndicator = 0;
+}
+
+void
+countCompletion() {
+    completionCounter++;
+}
+
+TEST_F(ArachneTest, injectThread) {
+    completionCounter = 0;
+    for (int i = 0; i < 4; i++)
+        EXPECT_TRUE(injectThread(countCompletion));
+    limitedTimeWait([]() -> bool { return completionCounter == 4; });
+    EXPECT_EQ(4, completionCounter);
+    completionCounter = 0;
+}
+
+TEST_F(ArachneTest, injectThread_heldWhileCoreIsFull) {
+    completionCounter = 0;
+    int coreId = corePolicy->getCores(0)[0];
+    for (int i = 0; i < Arachne::maxThreadsPerCore; i++)
+        createThreadOnCore(coreId, clearFlag);
+    injectThreadOnCore(coreId, countCompletion);
+    usleep(10000);
+    EXPECT_EQ(0, completionCounter);
+    EXPECT_EQ(static_cast<uint32_t>(Arachne::maxThreadsPerCore),
+              numOccupiedOnCore(coreId));
+
+    // The injected thread starts once a slot frees up.
+    while (completionCounter == 0)
+        threadCreationIndicator = 1;
+    while (numOccupiedOnCore(coreId) > 0)
+        threadCreationIndicator = 1;
+    threadCreationIndicator = 0;
+    completionCounter = 0;
+}
+
 // Provide storage for mock random values when testing.
 std::deque<uint64_t> mockRandomValues;
 
@@ -421,6 +567,758 @@ TEST_F(ArachneTest, createThread_pickLeastLoaded) {
     *occupiedAndCount[core1] = {0, 0};
 }
 
+TEST_F(ArachneTest, stackGuardPages) {
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    int coreId = corePolicy->getCores(0)[0];
+    for (int k = 0; k < 2; k++) {
+        char* stack =
+            reinterpret_cast<char*>(allThreadContexts[coreId][k]->stack);
+        EXPECT_EQ(0U, reinterpret_cast<uint64_t>(stack) & (PAGE_SIZE - 1));
+        // The kernel reports a fault rather than killing the process when a
+        // system call reads an inaccessible page.
+        EXPECT_EQ(1, write(fds[1], stack, 1));
+        EXPECT_EQ(-1, write(fds[1], stack - PAGE_SIZE, 1));
+        EXPECT_EQ(EFAULT, errno);
+    }
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// One cache of one core in a fixture sysfs tree for readCpuTopology.
+struct FixtureCache {
+    int coreId;
+    int index;
+    int level;
+    const char* sharedCpuList;
+};
+
+// Helper function for readCpuTopology
+static void
+writeFixtureFile(std::vector<std::string>* paths, const std::string& path,
+                 const char* contents) {
+    FILE* file = fopen(path.c_str(), "w");
+    ASSERT_NE(static_cast<FILE*>(NULL), file);
+    fprintf(file, "%s\n", contents);
+    fclose(file);
+    paths->push_back(path);
+}
+
+// Helper function for readCpuTopology
+static void
+setLoad(int coreId, int numOccupied) {
+    *occupiedAndCount[coreId] = {(1UL << numOccupied) - 1,
+                                 static_cast<uint8_t>(numOccupied)};
+}
+
+TEST_F(ArachneTest, readCpuTopology) {
+    // Cores 0-1 and 2-3 share an L3, which core 1 lists before its L1. Core 4
+    // has no cache information, and core 5 has no L3, so its L2 is the
+    // last-level cache it shares with core 4.
+    const FixtureCache caches[] = {
+        {0, 0, 1, "0"}, {0, 1, 2, "0"}, {0, 2, 3, "0-1"},
+        {1, 0, 3, "0-1"}, {1, 1, 1, "1"},
+        {2, 0, 1, "2"}, {2, 1, 3, "2-3"},
+        {3, 0, 1, "3"}, {3, 1, 2, "3"}, {3, 2, 3, "2,3"},
+        {5, 0, 1, "5"}, {5, 1, 2, "4-5"},
+    };
+    char dir[] = "/tmp/ArachneTest_sysfsXXXXXX";
+    ASSERT_NE(static_cast<char*>(NULL), mkdtemp(dir));
+    std::vector<std::string> paths;
+    for (const FixtureCache& cache : caches) {
+        std::string cpuDir =
+            std::string(dir) + "/cpu" + std::to_string(cache.coreId);
+        std::string path = cpuDir + "/cache/index" +
+                           std::to_string(cache.index);
+        for (const std::string& subdir : {cpuDir, cpuDir + "/cache", path})
+            if (mkdir(subdir.c_str(), 0700) == 0)
+                paths.push_back(subdir);
+        writeFixtureFile(&paths, path + "/level",
+                         std::to_string(cache.level).c_str());
+        writeFixtureFile(&paths, path + "/shared_cpu_list",
+                         cache.sharedCpuList);
+    }
+
+    // Cores past the fixture have no cpuN directory at all.
+    std::vector<int> originalLlcOfCore = llcOfCore;
+    int numCores = std::max(6, static_cast<int>(originalLlcOfCore.size()));
+    readCpuTopology(numCores, dir);
+    for (auto it = paths.rbegin(); it != paths.rend(); it++)
+        remove(it->c_str());
+    rmdir(dir);
+    ASSERT_EQ(numCores, static_cast<int>(llcOfCore.size()));
+    const int expectedLlcOfCore[] = {0, 0, 2, 2, 4, 4};
+    for (int coreId = 0; coreId < numCores; coreId++)
+        EXPECT_EQ(coreId < 6 ? expectedLlcOfCore[coreId] : coreId,
+                  llcOfCore[coreId]);
+
+    // Place threads as if created by an Arachne thread on core 0. Each core
+    // list below holds two cores, so chooseCore() always picks the less
+    // loaded one.
+    if (occupiedAndCount.size() < 4) {
+        llcOfCore = originalLlcOfCore;
+        return;
+    }
+    MaskAndCount originalLoads[4];
+    for (int coreId = 0; coreId < 4; coreId++)
+        originalLoads[coreId] = *occupiedAndCount[coreId];
+    int originalId = core.id;
+    ThreadContext* originalContext = core.loadedContext;
+    int originalSlack = placementSlack;
+    core.id = 0;
+    core.loadedContext = allThreadContexts[0][0];
+    setLoad(0, 2);
+    setLoad(1, 2);
+    setLoad(2, 1);
+
+    // The creating core is used while within placementSlack of core 2.
+    CorePolicy::CoreList withSelf(2, true);
+    withSelf.add(0);
+    withSelf.add(2);
+    placementSlack = 2;
+    EXPECT_EQ(0, chooseCoreNear(withSelf, PLACE_NEARBY));
+    placementSlack = 0;
+    EXPECT_EQ(2, chooseCoreNear(withSelf, PLACE_NEARBY));
+    placementSlack = -1;
+    EXPECT_EQ(2, chooseCoreNear(withSelf, PLACE_NEARBY));
+    EXPECT_EQ(0, chooseCoreNear(withSelf, PLACE_SAME_CORE));
+
+    // Without the creating core, its LLC sibling takes its place.
+    CorePolicy::CoreList withSibling(2, true);
+    withSibling.add(1);
+    withSibling.add(2);
+    placementSlack = 2;
+    EXPECT_EQ(1, chooseCoreNear(withSibling, PLACE_NEARBY));
+    placementSlack = 0;
+    EXPECT_EQ(2, chooseCoreNear(withSibling, PLACE_NEARBY));
+    placementSlack = -1;
+    EXPECT_EQ(2, chooseCoreNear(withSibling, PLACE_NEARBY));
+    EXPECT_EQ(1, chooseCoreNear(withSibling, PLACE_SAME_LLC));
+    EXPECT_EQ(1, chooseCoreNear(withSibling, PLACE_SAME_CORE));
+
+    placementSlack = originalSlack;
+    core.loadedContext = originalContext;
+    core.id = originalId;
+    for (int coreId = 0; coreId < 4; coreId++)
+        *occupiedAndCount[coreId] = originalLoads[coreId];
+    llcOfCore = originalLlcOfCore;
+}
+
+static std::atomic<int> childCoreId;
+
+void
+recordCoreId() {
+    childCoreId = core.id;
+}
+
+void
+placeChild(PlacementHint hint) {
+    createThreadWithPlacement(hint, recordCoreId);
+}
+
+TEST_F(ArachneTest, createThreadWithPlacement) {
+    // Give every core a last-level cache of its own, so that the creating
+    // core is the only one near it.
+    std::vector<int> originalLlcOfCore = llcOfCore;
+    for (size_t coreId = 0; coreId < llcOfCore.size(); coreId++)
+        llcOfCore[coreId] = static_cast<int>(coreId);
+
+    int coreId = corePolicy->getCores(0)[0];
+    for (PlacementHint hint : {PLACE_NEARBY, PLACE_SAME_CORE, PLACE_SAME_LLC}) {
+        childCoreId = -1;
+        createThreadOnCore(coreId, placeChild, hint);
+        limitedTimeWait([]() -> bool { return childCoreId != -1; });
+        EXPECT_EQ(coreId, childCoreId);
+    }
+    llcOfCore = originalLlcOfCore;
+}
+
+static std::atomic<int> stackCheck;
+
+// Helper function for createThreadWithStackClass
+void
+checkOnPooledStack(int stackClass) {
+    char local;
+    char* stack = reinterpret_cast<char*>(core.loadedContext->pooledStack);
+    stackCheck = (core.loadedContext->stackClass == stackClass &&
+                  &local > stack &&
+                  &local < stack + STACK_CLASS_SIZES[stackClass])
+                     ? 1
+                     : 2;
+}
+
+TEST_F(ArachneTest, createThreadWithStackClass) {
+    for (int stackClass = 0; stackClass < NUM_STACK_CLASSES; stackClass++) {
+        stackCheck = 0;
+        createThreadWithStackClass(0, stackClass, checkOnPooledStack,
+                                   stackClass);
+        limitedTimeWait([]() -> bool { return stackCheck != 0; });
+        EXPECT_EQ(1, stackCheck);
+    }
+}
+
+TEST_F(ArachneTest, setStackClass) {
+    EXPECT_FALSE(setStackClass(-1, 0));
+    EXPECT_FALSE(setStackClass(0, NUM_STACK_CLASSES));
+    EXPECT_FALSE(setStackClass(0, OWN_STACK - 1));
+    EXPECT_EQ(OWN_STACK, stackClassOf(5));
+    EXPECT_TRUE(setStackClass(5, 1));
+    EXPECT_EQ(1, stackClassOf(5));
+    EXPECT_EQ(OWN_STACK, stackClassOf(4));
+    EXPECT_FALSE(setStackClass(MAX_STACK_THREAD_CLASSES, 1));
+    EXPECT_EQ(OWN_STACK, stackClassOf(MAX_STACK_THREAD_CLASSES));
+    EXPECT_TRUE(setStackClass(5, OWN_STACK));
+    EXPECT_EQ(OWN_STACK, stackClassOf(5));
+}
+
+TEST_F(ArachneTest, setStackClass_batchAndInjectedThreads) {
+    int stackClass = NUM_STACK_CLASSES - 1;
+    EXPECT_TRUE(setStackClass(0, stackClass));
+    ThreadId threadIds[1];
+    stackCheck = 0;
+    EXPECT_EQ(1, createThreads(1, threadIds, checkOnPooledStack, stackClass));
+    limitedTimeWait([]() -> bool { return stackCheck != 0; });
+    EXPECT_EQ(1, stackCheck);
+
+    stackCheck = 0;
+    EXPECT_TRUE(injectThread(checkOnPooledStack, stackClass));
+    limitedTimeWait([]() -> bool { return stackCheck != 0; });
+    EXPECT_EQ(1, stackCheck);
+    setStackClass(0, OWN_STACK);
+}
+
+struct LargeArgument {
+    uint64_t words[40];
+};
+
+static std::atomic<int> largeArgumentCheck;
+
+// Helper function for createThread_largeArguments
+void
+checkLargeArgument(LargeArgument argument, int value) {
+    bool intact = value == 7;
+    for (int i = 0; i < 40; i++)
+        intact = intact && argument.words[i] == static_cast<uint64_t>(i);
+    largeArgumentCheck = intact ? 1 : 2;
+}
+
+TEST_F(ArachneTest, createThread_largeArguments) {
+    LargeArgument argument;
+    for (int i = 0; i < 40; i++)
+        argument.words[i] = i;
+    largeArgumentCheck = 0;
+    createThread(checkLargeArgument, argument, 7);
+    limitedTimeWait([]() -> bool { return largeArgumentCheck != 0; });
+    EXPECT_EQ(1, largeArgumentCheck);
+}
+
+// Helper function for invocationBuffers
+void
+reuseInvocationBuffers() {
+    void* small = allocInvocationBuffer(100);
+    void* large = allocInvocationBuffer(300);
+    EXPECT_NE(small, large);
+    freeInvocationBuffer(small);
+    EXPECT_EQ(small, allocInvocationBuffer(128));
+    freeInvocationBuffer(small);
+    freeInvocationBuffer(large);
+    completionCounter++;
+}
+
+TEST_F(ArachneTest, invocationBuffers) {
+    completionCounter = 0;
+    createThread(reuseInvocationBuffers);
+    limitedTimeWait([]() -> bool { return completionCounter == 1; });
+    EXPECT_EQ(1, completionCounter);
+
+    // Callers that are not Arachne threads get buffers from malloc.
+    void* contents = allocInvocationBuffer(512);
+    EXPECT_TRUE((reinterpret_cast<InvocationBuffer*>(contents) - 1)->owner ==
+                NULL);
+    freeInvocationBuffer(contents);
+}
+
+static syscall_wait_request* remoteRequest;
+
+// Helper functions for syscallRequests
+void
+reuseSyscallRequests() {
+    syscall_wait_request* request = alloc_syscall_request(core.loadedContext,
+                                                          0);
+    EXPECT_TRUE(request->owner == &core);
+    free_syscall_request(request);
+    remoteRequest = alloc_syscall_request(core.loadedContext, 0);
+    EXPECT_EQ(request, remoteRequest);
+    completionCounter++;
+}
+
+void
+freeRemoteSyscallRequest() {
+    free_syscall_request(remoteRequest);
+    completionCounter++;
+}
+
+TEST_F(ArachneTest, syscallRequests) {
+    completionCounter = 0;
+    createThreadOnCore(corePolicy->getCores(0)[0], reuseSyscallRequests);
+    limitedTimeWait([]() -> bool { return completionCounter == 1; });
+    EXPECT_EQ(1, completionCounter);
+
+    // A request freed on another core goes back to the core it came from.
+    Core* owner = remoteRequest->owner;
+    createThreadOnCore(corePolicy->getCores(0)[1], freeRemoteSyscallRequest);
+    limitedTimeWait([]() -> bool { return completionCounter == 2; });
+    EXPECT_EQ(2, completionCounter);
+    EXPECT_EQ(remoteRequest, owner->remote_syscall_requests.load());
+}
+
+// Helper function for submissionBatching
+void
+syncThreeTimes(int fd) {
+    int fds[3] = {fd, fd, fd};
+    int rcs[3];
+    Arachne::fsyncv(3, fds, rcs, -1ULL);
+    for (int i = 0; i < 3; i++)
+        EXPECT_EQ(0, rcs[i]);
+    completionCounter++;
+}
+
+TEST_F(ArachneTest, submissionBatching) {
+    char path[] = "/tmp/ArachneTestXXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_LE(0, fd);
+    unlink(path);
+    PerfStats before;
+    PerfStats::collectStats(&before, corePolicy->getCores(0));
+
+    // The three requests are queued together and submitted at once.
+    completionCounter = 0;
+    createThread(syncThreeTimes, fd);
+    limitedTimeWait([]() -> bool { return completionCounter == 1; });
+    EXPECT_EQ(1, completionCounter);
+    PerfStats after;
+    PerfStats::collectStats(&after, corePolicy->getCores(0));
+    EXPECT_EQ(before.numSubmissionBatches + 1, after.numSubmissionBatches);
+    EXPECT_EQ(before.numSubmittedRequests + 3, after.numSubmittedRequests);
+    ::close(fd);
+}
+
+static char fixedBuffer[4096];
+
+// Helper functions for registeredFilesAndBuffers
+void
+readRegisteredFile(int fd) {
+    int slot = register_files(&fd, 1);
+    EXPECT_LE(0, slot);
+    struct iovec iov = {fixedBuffer, sizeof(fixedBuffer)};
+    int index = register_buffers(&iov, 1);
+    EXPECT_LE(0, index);
+    EXPECT_EQ(5, Arachne::pread_fixed_file(slot, fixedBuffer, 5, index, 0,
+                                           -1ULL));
+    EXPECT_EQ(0, memcmp(fixedBuffer, "hello", 5));
+    EXPECT_EQ(0, unregister_files(slot, 1));
+    completionCounter++;
+}
+
+void
+borrowRegisteredBuffers() {
+    EXPECT_EQ(0, create_registered_buffer_pool(4096, 4));
+    EXPECT_EQ(-EBUSY, create_registered_buffer_pool(4096, 4));
+    registered_buffer* buffers[4];
+    for (int i = 0; i < 4; i++) {
+        buffers[i] = borrow_registered_buffer();
+        ASSERT_TRUE(buffers[i] != NULL);
+        EXPECT_EQ(4096U, buffers[i]->len);
+    }
+    EXPECT_TRUE(borrow_registered_buffer() == NULL);
+    for (int i = 0; i < 4; i++)
+        return_registered_buffer(buffers[i]);
+    EXPECT_EQ(buffers[3], borrow_registered_buffer());
+    return_registered_buffer(buffers[3]);
+    completionCounter++;
+}
+
+TEST_F(ArachneTest, registeredFilesAndBuffers) {
+    char path[] = "/tmp/ArachneTestXXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_LE(0, fd);
+    unlink(path);
+    ASSERT_EQ(5, pwrite(fd, "hello", 5, 0));
+
+    completionCounter = 0;
+    createThread(readRegisteredFile, fd);
+    limitedTimeWait([]() -> bool { return completionCounter == 1; });
+    EXPECT_EQ(1, completionCounter);
+    createThread(borrowRegisteredBuffers);
+    limitedTimeWait([]() -> bool { return completionCounter == 2; });
+    EXPECT_EQ(2, completionCounter);
+    ::close(fd);
+}
+
+// Helper function for registeredFiles_everyCore
+void
+sendOnRegisteredFile(int slot) {
+    EXPECT_EQ(5, Arachne::send_fixed_file(slot, "hello", 5, 0, -1ULL));
+    completionCounter++;
+}
+
+TEST_F(ArachneTest, registeredFiles_everyCore) {
+    int fds[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    int slot = register_files(&fds[0], 1);
+    ASSERT_LE(0, slot);
+    // The table holds a duplicate, so the caller may close its own fd.
+    ::close(fds[0]);
+
+    CorePolicy::CoreList coreList = corePolicy->getCores(0);
+    completionCounter = 0;
+    for (int i = 0; i < coreList.size(); i++)
+        createThreadOnCore(coreList[i], sendOnRegisteredFile, slot);
+    limitedTimeWait(
+        [&coreList]() -> bool { return completionCounter == coreList.size(); });
+    EXPECT_EQ(coreList.size(), completionCounter);
+    char data[5];
+    for (int i = 0; i < coreList.size(); i++)
+        EXPECT_EQ(5, read(fds[1], data, 5));
+
+    // Once the slot is unregistered, no ring keeps the socket open.
+    EXPECT_EQ(0, unregister_files(slot, 1));
+    struct pollfd pfd = {fds[1], POLLIN, 0};
+    EXPECT_EQ(1, poll(&pfd, 1, 1000));
+    EXPECT_EQ(0, read(fds[1], data, 5));
+    ::close(fds[1]);
+}
+
+TEST_F(ArachneTest, unregisterBuffers) {
+    static char memory[2][64];
+    struct iovec iovs[2] = {{memory[0], 64}, {memory[1], 64}};
+    int index = register_buffers(iovs, 2);
+    ASSERT_LE(0, index);
+    EXPECT_EQ(0, unregister_buffers(index, 1));
+    EXPECT_EQ(index, register_buffers(iovs, 1));
+    EXPECT_EQ(0, unregister_buffers(index, 2));
+    EXPECT_EQ(-EINVAL, unregister_buffers(-1, 1));
+
+    std::vector<struct iovec> tooMany(MAX_REGISTERED_BUFFERS + 1, iovs[0]);
+    EXPECT_EQ(-ENOBUFS, register_buffers(tooMany.data(), tooMany.size()));
+}
+
+// Helper function for recvMultishot
+void
+receiveStream(int sockfd) {
+    recv_stream* stream;
+    ASSERT_EQ(0, recv_multishot_start(sockfd, 0, &stream));
+    recv_buffer buffer;
+    EXPECT_EQ(-ETIME, recv_multishot(stream, &buffer, 1));
+    completionCounter++;
+    EXPECT_EQ(5, recv_multishot(stream, &buffer, -1ULL));
+    EXPECT_EQ(0, memcmp(buffer.data, "hello", 5));
+    return_recv_buffer(buffer);
+    EXPECT_EQ(0, recv_multishot(stream, &buffer, -1ULL));
+    recv_multishot_stop(stream);
+    completionCounter++;
+}
+
+TEST_F(ArachneTest, recvMultishot) {
+    EXPECT_EQ(-EINVAL, setup_recv_buffers(1024, 12));
+    EXPECT_EQ(0, setup_recv_buffers(1024, 16));
+    EXPECT_EQ(-EBUSY, setup_recv_buffers(1024, 16));
+    int fds[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+
+    completionCounter = 0;
+    createThread(receiveStream, fds[0]);
+    limitedTimeWait([]() -> bool { return completionCounter == 1; });
+    EXPECT_EQ(5, write(fds[1], "hello", 5));
+    ::close(fds[1]);
+    limitedTimeWait([]() -> bool { return completionCounter == 2; });
+    EXPECT_EQ(2, completionCounter);
+    ::close(fds[0]);
+}
+
+// Helper function for recvMultishot_outOfBuffers
+void
+holdEveryBuffer(int sockfd) {
+    recv_stream* stream;
+    ASSERT_EQ(0, recv_multishot_start(sockfd, 0, &stream));
+    recv_buffer buffers[16];
+    for (int i = 0; i < 16; i++)
+        EXPECT_EQ(1024, recv_multishot(stream, &buffers[i], -1ULL));
+
+    // The ring is empty, so the rest of the data waits for a buffer.
+    recv_buffer buffer;
+    EXPECT_EQ(-ETIME, recv_multishot(stream, &buffer, 1));
+    return_recv_buffer(buffers[0]);
+    EXPECT_EQ(1024, recv_multishot(stream, &buffer, -1ULL));
+    return_recv_buffer(buffer);
+    for (int i = 1; i < 16; i++)
+        return_recv_buffer(buffers[i]);
+    recv_multishot_stop(stream);
+    completionCounter++;
+}
+
+TEST_F(ArachneTest, recvMultishot_outOfBuffers) {
+    int rc = setup_recv_buffers(1024, 16);
+    EXPECT_TRUE(rc == 0 || rc == -EBUSY);
+    int fds[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    static char data[17 * 1024];
+    EXPECT_EQ(static_cast<ssize_t>(sizeof(data)),
+              write(fds[1], data, sizeof(data)));
+
+    completionCounter = 0;
+    createThread(holdEveryBuffer, fds[0]);
+    limitedTimeWait([]() -> bool { return completionCounter == 1; });
+    EXPECT_EQ(1, completionCounter);
+    ::close(fds[1]);
+    ::close(fds[0]);
+}
+
+// Helper functions for acceptor
+void
+greetConnection(int fd) {
+    EXPECT_EQ(2, Arachne::send(fd, "hi", 2, 0, -1ULL));
+    ::close(fd);
+    completionCounter++;
+}
+
+void
+stopAcceptor(acceptor* acceptor) {
+    stop_acceptor(acceptor);
+    completionCounter++;
+}
+
+TEST_F(ArachneTest, acceptor) {
+    // Find a free port.
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int probe = socket(AF_INET, SOCK_STREAM, 0);
+    socklen_t addrlen = sizeof(addr);
+    ASSERT_EQ(0, bind(probe, reinterpret_cast<sockaddr*>(&addr), addrlen));
+    ASSERT_EQ(0, getsockname(probe, reinterpret_cast<sockaddr*>(&addr),
+                             &addrlen));
+    ::close(probe);
+
+    CorePolicy::CoreList coreList = corePolicy->getCores(0);
+    std::vector<int> cores;
+    for (uint32_t i = 0; i < coreList.size(); i++)
+        cores.push_back(coreList[i]);
+    acceptor* acceptor;
+    ASSERT_EQ(0, start_acceptor(reinterpret_cast<sockaddr*>(&addr), addrlen,
+                                16, cores, greetConnection, &acceptor));
+
+    completionCounter = 0;
+    for (int i = 0; i < 4; i++) {
+        int client = socket(AF_INET, SOCK_STREAM, 0);
+        ASSERT_EQ(0, ::connect(client, reinterpret_cast<sockaddr*>(&addr),
+                               addrlen));
+        char reply[2];
+        EXPECT_EQ(2, read(client, reply, 2));
+        EXPECT_EQ(0, memcmp(reply, "hi", 2));
+        ::close(client);
+    }
+    limitedTimeWait([]() -> bool { return completionCounter == 4; });
+    EXPECT_EQ(4, completionCounter);
+
+    createThread(stopAcceptor, acceptor);
+    limitedTimeWait([]() -> bool { return completionCounter == 5; });
+    EXPECT_EQ(5, completionCounter);
+}
+
+static char zeroCopyPayload[64 * 1024];
+
+// Helper function for sendZeroCopy
+void
+sendZeroCopy(int fd) {
+    EXPECT_EQ(static_cast<ssize_t>(sizeof(zeroCopyPayload)),
+              Arachne::send_zc(fd, zeroCopyPayload, sizeof(zeroCopyPayload),
+                               0, -1ULL));
+    // The kernel is done with the payload, so changing it must not change
+    // what was sent.
+    memset(zeroCopyPayload, 0, sizeof(zeroCopyPayload));
+    completionCounter++;
+}
+
+TEST_F(ArachneTest, sendZeroCopy) {
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrlen = sizeof(addr);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_EQ(0, bind(listener, reinterpret_cast<sockaddr*>(&addr), addrlen));
+    ASSERT_EQ(0, listen(listener, 1));
+    ASSERT_EQ(0, getsockname(listener, reinterpret_cast<sockaddr*>(&addr),
+                             &addrlen));
+    int client = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_EQ(0, ::connect(client, reinterpret_cast<sockaddr*>(&addr),
+                           addrlen));
+    int server = ::accept(listener, NULL, NULL);
+    ASSERT_LE(0, server);
+
+    memset(zeroCopyPayload, 'z', sizeof(zeroCopyPayload));
+    completionCounter = 0;
+    createThread(sendZeroCopy, server);
+    static char received[sizeof(zeroCopyPayload)];
+    size_t total = 0;
+    while (total < sizeof(received)) {
+        ssize_t n = read(client, received + total, sizeof(received) - total);
+        ASSERT_LT(0, n);
+        total += n;
+    }
+    for (size_t i = 0; i < sizeof(received); i++)
+        ASSERT_EQ('z', received[i]);
+    limitedTimeWait([]() -> bool { return completionCounter == 1; });
+    EXPECT_EQ(1, completionCounter);
+    ::close(client);
+    ::close(server);
+    ::close(listener);
+}
+
+TEST_F(ArachneTest, stackDepth) {
+    uint64_t stack[64];
+    paintStack(stack, stack + 64);
+    EXPECT_EQ(0U, stackDepth(stack, sizeof(stack)));
+    stack[60] = 0;
+    EXPECT_EQ(4 * sizeof(uint64_t), stackDepth(stack, sizeof(stack)));
+    stack[0] = 0;
+    EXPECT_EQ(sizeof(stack), stackDepth(stack, sizeof(stack)));
+}
+
+TEST_F(ArachneTest, earliestDeadlineSlot) {
+    alignas(CACHE_LINE_SIZE) uint64_t deadlines[MAX_CONTEXT_WORDS * 64];
+    uint64_t candidates[MAX_CONTEXT_WORDS] = {};
+    for (int i = 0; i < numContextWords * 64; i++)
+        deadlines[i] = 1000 - i;
+    EXPECT_EQ(-1, earliestDeadlineSlot(deadlines, candidates));
+
+    candidates[0] = contextBit(3) | contextBit(9);
+    EXPECT_EQ(9, earliestDeadlineSlot(deadlines, candidates));
+
+    // Deadlines with the high bit set must still compare as unsigned.
+    deadlines[3] = ~0UL;
+    deadlines[9] = 1UL << 63;
+    deadlines[12] = 5;
+    candidates[0] |= contextBit(12);
+    EXPECT_EQ(12, earliestDeadlineSlot(deadlines, candidates));
+
+    // Ties go to the lower index.
+    deadlines[3] = 5;
+    EXPECT_EQ(3, earliestDeadlineSlot(deadlines, candidates));
+
+    candidates[0] = 0;
+    candidates[numContextWords - 1] |= contextBit(63);
+    EXPECT_EQ((numContextWords - 1) * 64 + 63,
+              earliestDeadlineSlot(deadlines, candidates));
+}
+
+TEST_F(ArachneTest, earliestDeadlineSlot_avx2MatchesScalar) {
+#ifdef __x86_64__
+    if (!cpuHasAvx2)
+        return;
+    alignas(CACHE_LINE_SIZE) uint64_t deadlines[MAX_CONTEXT_WORDS * 64];
+    uint64_t candidates[MAX_CONTEXT_WORDS];
+    std::mt19937_64 random(17);
+    for (int round = 0; round < 1000; round++) {
+        // Draw from a small range in half of the rounds, so that ties are
+        // common.
+        for (int i = 0; i < numContextWords * 64; i++)
+            deadlines[i] = round % 2 ? random() : random() % 8;
+        for (int w = 0; w < numContextWords; w++)
+            candidates[w] = random() & random();
+        ASSERT_EQ(earliestDeadlineSlotScalar(deadlines, candidates),
+                  earliestDeadlineSlotAvx2(deadlines, candidates));
+    }
+#endif
+}
+
+extern std::vector<StackUsageHistogram> stackUsageHistograms;
+
+// Helper functions for getStackUsage
+void
+useDeepStack() {
+    volatile char buffer[20000];
+    for (size_t i = 0; i < sizeof(buffer); i += 1000)
+        buffer[i] = 1;
+    static_cast<void>(buffer[0]);
+}
+
+void
+runOnPaintedStack() {
+    // The stacks already in the pool were set up before profiling began.
+    for (void* stack : core.stackPools[1]) {
+        paintStack(stack,
+                   reinterpret_cast<char*>(stack) + STACK_CLASS_SIZES[1]);
+    }
+    createThreadOnCoreWithAttributes(
+        ThreadAttributes(DEFAULT_PRIORITY, 0, 0, 1), core.id, useDeepStack);
+}
+
+TEST_F(ArachneTest, getStackUsage) {
+    profileStackUsage = true;
+    createThreadOnCore(corePolicy->getCores(0)[0], runOnPaintedStack);
+    // A depth of about 20 KB falls in the bucket for up to 32 KB.
+    limitedTimeWait([]() -> bool { return getStackUsage(0).counts[5] == 1; });
+    EXPECT_EQ(1U, getStackUsage(0).counts[5]);
+    EXPECT_LE(20000U, getStackUsage(0).maxBytes);
+    EXPECT_EQ(0U, getStackUsage(7).maxBytes);
+    profileStackUsage = false;
+    stackUsageHistograms.clear();
+}
+
+TEST_F(ArachneTest, trimStacks) {
+    int coreId = corePolicy->getCores(0)[0];
+    createThreadOnCore(coreId, useDeepStack);
+    limitedTimeWait([coreId]() -> bool {
+        return numOccupiedOnCore(coreId) == 0;
+    });
+    PerfStats before;
+    PerfStats::collectStats(&before, corePolicy->getCores(0));
+
+    // The first trim only notes which contexts are unoccupied; the second
+    // releases the stacks of those that stayed so.
+    for (int i = 0; i < 2; i++) {
+        trimStacks();
+        limitedTimeWait([coreId]() -> bool {
+            return !coreMap[coreId]->trimStacksRequested;
+        });
+    }
+    PerfStats after;
+    PerfStats::collectStats(&after, corePolicy->getCores(0));
+    EXPECT_LE(before.reclaimedStackBytes + 16 * 1024,
+              after.reclaimedStackBytes);
+}
+
+TEST_F(ArachneTest, trimStacks_pooledStackBytes) {
+    int coreId = corePolicy->getCores(0)[0];
+    ThreadAttributes attributes(DEFAULT_PRIORITY, 0, 0, 1);
+    createThreadOnCoreWithAttributes(attributes, coreId, recordCoreId);
+    limitedTimeWait([coreId]() -> bool {
+        return numOccupiedOnCore(coreId) == 0;
+    });
+    PerfStats before;
+    PerfStats::collectStats(&before, corePolicy->getCores(0));
+
+    // A pooled stack stops counting once it is trimmed, and counts again once
+    // a thread uses it.
+    trimStacks();
+    limitedTimeWait([coreId]() -> bool {
+        return !coreMap[coreId]->trimStacksRequested;
+    });
+    PerfStats trimmed;
+    PerfStats::collectStats(&trimmed, corePolicy->getCores(0));
+    EXPECT_EQ(before.pooledStackBytes - STACK_CLASS_SIZES[1],
+              trimmed.pooledStackBytes);
+
+    createThreadOnCoreWithAttributes(attributes, coreId, recordCoreId);
+    limitedTimeWait([coreId]() -> bool {
+        return numOccupiedOnCore(coreId) == 0;
+    });
+    PerfStats after;
+    PerfStats::collectStats(&after, corePolicy->getCores(0));
+    EXPECT_EQ(before.pooledStackBytes, after.pooledStackBytes);
+}
+
 TEST_F(ArachneTest, alignedAlloc) {
     void* ptr = alignedAlloc(7);
     EXPECT_EQ(0U, reinterpret_cast<uint64_t>(ptr) & (CACHE_LINE_SIZE - 1));
@@ -560,9 +1458,170 @@ TEST_F(ArachneTest, block_basics) {
     EXPECT_EQ(0U, Arachne::occupiedAndCount[coreId]->load().occupied);
 }
 
+static int fiberLocalKey;
+static std::atomic<int> destroyedFiberLocal;
+
+// Helper functions for fiberLocal
+void
+destroyFiberLocal(void* value) {
+    destroyedFiberLocal = static_cast<int>(reinterpret_cast<intptr_t>(value));
+}
+
+void
+useFiberLocal(int value) {
+    EXPECT_TRUE(getFiberLocal(fiberLocalKey) == NULL);
+    setFiberLocal(fiberLocalKey, reinterpret_cast<void*>(value));
+    yield();
+    EXPECT_EQ(value, reinterpret_cast<intptr_t>(getFiberLocal(fiberLocalKey)));
+    completionCounter++;
+}
+
+TEST_F(ArachneTest, fiberLocal) {
+    fiberLocalKey = createFiberLocalKey(destroyFiberLocal);
+    ASSERT_LE(0, fiberLocalKey);
+    int coreId = corePolicy->getCores(0)[0];
+    completionCounter = 0;
+    destroyedFiberLocal = 0;
+    createThreadOnCore(coreId, useFiberLocal, 1);
+    createThreadOnCore(coreId, useFiberLocal, 2);
+    limitedTimeWait([]() -> bool { return completionCounter == 2; });
+    limitedTimeWait([coreId]() -> bool {
+        return numOccupiedOnCore(coreId) == 0;
+    });
+    EXPECT_NE(0, destroyedFiberLocal);
+
+    // The context of an exited thread starts its next thread with no value.
+    completionCounter = 0;
+    createThreadOnCore(coreId, useFiberLocal, 3);
+    limitedTimeWait([]() -> bool { return completionCounter == 1; });
+    EXPECT_EQ(1, completionCounter);
+}
+
+static std::atomic<int> switchTurn;
+static ThreadId switchPeers[2];
+static std::atomic<bool> switchPeersReady;
+
+// Helper function for switchTo_pingPong
+void
+switchPlayer(int self) {
+    while (!switchPeersReady)
+        yield();
+    for (int i = 0; i < 1000; i++) {
+        while (switchTurn != self)
+            block();
+        switchTurn = 1 - self;
+        switchTo(switchPeers[1 - self]);
+    }
+    // The other player blocked in its last switchTo().
+    if (self == 0)
+        schedule(switchPeers[1]);
+    completionCounter++;
+}
+
+TEST_F(ArachneTest, switchTo_pingPong) {
+    int coreId = corePolicy->getCores(0)[0];
+    PerfStats before;
+    PerfStats::collectStats(&before, corePolicy->getCores(0));
+    completionCounter = 0;
+    switchTurn = 0;
+    switchPeersReady = false;
+    switchPeers[0] = createThreadOnCore(coreId, switchPlayer, 0);
+    switchPeers[1] = createThreadOnCore(coreId, switchPlayer, 1);
+    switchPeersReady = true;
+    limitedTimeWait([]() -> bool { return completionCounter == 2; });
+    EXPECT_EQ(2, completionCounter);
+
+    PerfStats after;
+    PerfStats::collectStats(&after, corePolicy->getCores(0));
+    EXPECT_LT(before.numDirectSwitches, after.numDirectSwitches);
+    limitedTimeWait(
+        [coreId]() -> bool { return numOccupiedOnCore(coreId) == 0; });
+}
+
+void
+repeatedYielder() {
+    for (int i = 0; i < 1000; i++)
+        yield();
+    flag = 1;
+}
+
+TEST_F(ArachneTest, yield_blockedThreadNotRun) {
+    Arachne::minNumCores = 2;
+    Arachne::init();
+    flag = 0;
+    blockerHasStarted = false;
+    int coreId = corePolicy->getCores(0)[0];
+    ThreadId id = createThreadOnCore(coreId, blocker);
+    limitedTimeWait([]() -> bool { return blockerHasStarted; });
+
+    // A blocked thread has no runnable bit, so yielding should not hand it
+    // control.
+    createThreadOnCore(coreId, repeatedYielder);
+    limitedTimeWait([]() -> bool { return flag; });
+    EXPECT_EQ(ThreadContext::BLOCKED, id.context->wakeupTimeInCycles);
+    schedule(id);
+    limitedTimeWait([coreId]() -> bool {
+        return Arachne::occupiedAndCount[coreId]->load().numOccupied == 0;
+    });
+    flag = 0;
+}
+
+static std::atomic<int> numWakeups;
+static volatile bool stopWaking;
+
+// Helper function for dispatch_runsOnlyThreadsWithRunnableBits
+void
+countWakeups() {
+    while (!stopWaking) {
+        numWakeups++;
+        dispatch();
+    }
+}
+
+TEST_F(ArachneTest, dispatch_runsOnlyThreadsWithRunnableBits) {
+    numWakeups = 0;
+    stopWaking = false;
+    flag = 0;
+    int coreId = corePolicy->getCores(0)[0];
+    ThreadId id = createThreadOnCore(coreId, countWakeups);
+    auto blocked = [coreId, id]() -> bool {
+        return numWakeups > 0 && coreMap[coreId]->loadedContext != id.context;
+    };
+    limitedTimeWait(blocked);
+
+    // A wakeup time of 0 alone does not make the thread a candidate, however
+    // many rounds dispatch() makes.
+    id.context->wakeupTimeInCycles = 0;
+    createThreadOnCore(coreId, repeatedYielder);
+    limitedTimeWait([]() -> bool { return flag; });
+    EXPECT_EQ(1, numWakeups);
+
+    // Its runnable bit, which schedule() and createThread() set, does.
+    markRunnable(coreMap[coreId], id.context);
+    limitedTimeWait([]() -> bool { return numWakeups == 2; });
+    EXPECT_EQ(2, numWakeups);
+    limitedTimeWait(blocked);
+
+    // A bit that is still set after the thread has blocked again is stale,
+    // and must not run it.
+    markRunnable(coreMap[coreId], id.context);
+    flag = 0;
+    createThreadOnCore(coreId, repeatedYielder);
+    limitedTimeWait([]() -> bool { return flag; });
+    EXPECT_EQ(2, numWakeups);
+    EXPECT_EQ(ThreadContext::BLOCKED, id.context->wakeupTimeInCycles);
+
+    stopWaking = true;
+    schedule(id);
+    limitedTimeWait([coreId]() -> bool {
+        return Arachne::occupiedAndCount[coreId]->load().numOccupied == 0;
+    });
+    flag = 0;
+}
+
 TEST_F(ArachneTest, signal) {
     int coreId = corePolicy->getCores(0)[0];
-    ThreadContext tempContext(0);
+    ThreadContext tempContext(0, NULL);
     tempContext.generation = 0;
     tempContext.wakeupTimeInCycles = ThreadContext::BLOCKED;
     tempContext.coreId = static_cast<uint8_t>(coreId);
@@ -802,6 +1861,318 @@ TEST_F(ArachneTest, parseOptions_noArgumentOptions) {
     EXPECT_EQ(true, disableLoadEstimation);
 }
 
+TEST_F(ArachneTest, parseOptions_enableWorkStealing) {
+    // See comment in parseOptions_noOptions
+    shutDown();
+    waitForTermination();
+    Arachne::enableWorkStealing = false;
+    int argc = 2;
+    const char* originalArgv[] = {"ArachneTest", "--enableWorkStealing"};
+    const char** argv = originalArgv;
+    Arachne::init(&argc, argv);
+    EXPECT_EQ(1, argc);
+    EXPECT_TRUE(enableWorkStealing);
+    enableWorkStealing = false;
+}
+
+TEST_F(ArachneTest, parseOptions_idleSpinBudgetNs) {
+    // See comment in parseOptions_noOptions
+    shutDown();
+    waitForTermination();
+    uint64_t originalBudget = idleSpinBudgetNs;
+    int argc = 3;
+    const char* originalArgv[] = {"ArachneTest", "--idleSpinBudgetNs", "5000"};
+    const char** argv = originalArgv;
+    Arachne::init(&argc, argv);
+    EXPECT_EQ(1, argc);
+    EXPECT_EQ(5000U, idleSpinBudgetNs);
+    idleSpinBudgetNs = originalBudget;
+}
+
+#ifdef DISABLE_ARBITER
+static std::atomic<bool> wakeupThreadStarted;
+static std::atomic<uint64_t> wokenAt;
+
+// Helper functions for parkCore_wakeups
+void
+recordWakeup() {
+    wokenAt = Cycles::rdtsc();
+}
+
+void
+blockThenRecordWakeup() {
+    wakeupThreadStarted = true;
+    Arachne::block();
+    wokenAt = Cycles::rdtsc();
+}
+
+void
+sleepThenRecordWakeup(uint64_t ns) {
+    wakeupThreadStarted = true;
+    Arachne::nanosleep(ns);
+    wokenAt = Cycles::rdtsc();
+}
+
+TEST_F(ArachneTest, parkCore_wakeups) {
+    uint64_t originalBudget = idleSpinBudgetNs;
+    idleSpinBudgetNs = 1000;
+    int coreId = corePolicy->getCores(0)[0];
+    auto coreParked = [coreId]() -> bool {
+        return coreMap[coreId]->parked.load();
+    };
+    const uint64_t promptly = Cycles::fromMilliseconds(10);
+    PerfStats before;
+    PerfStats::collectStats(&before, corePolicy->getCores(0));
+
+    // A thread created from another core.
+    limitedTimeWait(coreParked);
+    wokenAt = 0;
+    uint64_t start = Cycles::rdtsc();
+    createThreadOnCore(coreId, recordWakeup);
+    limitedTimeWait([]() -> bool { return wokenAt != 0; });
+    EXPECT_LT(wokenAt - start, promptly);
+
+    // A blocked thread that is signaled.
+    wakeupThreadStarted = false;
+    ThreadId blocked = createThreadOnCore(coreId, blockThenRecordWakeup);
+    limitedTimeWait([]() -> bool { return wakeupThreadStarted; });
+    limitedTimeWait(coreParked);
+    wokenAt = 0;
+    start = Cycles::rdtsc();
+    schedule(blocked);
+    limitedTimeWait([]() -> bool { return wokenAt != 0; });
+    EXPECT_LT(wokenAt - start, promptly);
+
+    // A sleeping thread whose timer expires while the core is parked.
+    wakeupThreadStarted = false;
+    wokenAt = 0;
+    start = Cycles::rdtsc();
+    createThreadOnCore(coreId, sleepThenRecordWakeup, 50 * 1000 * 1000UL);
+    limitedTimeWait([]() -> bool { return wakeupThreadStarted; });
+    limitedTimeWait(coreParked);
+    limitedTimeWait([]() -> bool { return wokenAt != 0; });
+    EXPECT_LE(Cycles::fromMilliseconds(50), wokenAt - start);
+    EXPECT_LT(wokenAt - start, Cycles::fromMilliseconds(50) + promptly);
+
+    PerfStats after;
+    PerfStats::collectStats(&after, corePolicy->getCores(0));
+    EXPECT_LT(before.parkedCycles, after.parkedCycles);
+    idleSpinBudgetNs = originalBudget;
+}
+#endif
+
+TEST_F(ArachneTest, parseOptions_submitBatch) {
+    // See comment in parseOptions_noOptions
+    shutDown();
+    waitForTermination();
+    uint32_t originalBatchSize = submitBatchSize;
+    uint64_t originalBatchAge = submitBatchAgeNs;
+    int argc = 5;
+    const char* originalArgv[] = {"ArachneTest", "--submitBatchSize", "4",
+                                  "--submitBatchAgeNs", "500"};
+    const char** argv = originalArgv;
+    Arachne::init(&argc, argv);
+    EXPECT_EQ(1, argc);
+    EXPECT_EQ(4U, submitBatchSize);
+    EXPECT_EQ(500U, submitBatchAgeNs);
+    submitBatchSize = originalBatchSize;
+    submitBatchAgeNs = originalBatchAge;
+}
+
+TEST_F(ArachneTest, parseOptions_maxThreadsPerCore) {
+    // See comment in parseOptions_noOptions
+    shutDown();
+    waitForTermination();
+    int originalMaxThreadsPerCore = maxThreadsPerCore;
+    int argc = 3;
+    const char* originalArgv[] = {"ArachneTest", "--maxThreadsPerCore", "64"};
+    const char** argv = originalArgv;
+    Arachne::init(&argc, argv);
+    EXPECT_EQ(1, argc);
+    EXPECT_EQ(64, maxThreadsPerCore);
+    EXPECT_EQ(1, numContextWords);
+
+    // Restore the limit before TearDown frees the contexts, since it
+    // determines how many there are.
+    shutDown();
+    waitForTermination();
+    maxThreadsPerCore = originalMaxThreadsPerCore;
+    Arachne::init();
+}
+
+void
+stealableSpinner(int homeCoreId) {
+    while (keepYielding) {
+        if (core.id != homeCoreId) {
+            completionCounter++;
+            break;
+        }
+        yield();
+    }
+}
+
+TEST_F(ArachneTest, workStealing_idleCoreTakesThreads) {
+    enableWorkStealing = true;
+    keepYielding = true;
+    completionCounter = 0;
+    int coreId = corePolicy->getCores(0)[0];
+    for (int i = 0; i < 4; i++)
+        createThreadOnCore(coreId, stealableSpinner, coreId);
+    // A loaded core hands over half of its runnable threads at a time.
+    limitedTimeWait([]() -> bool { return completionCounter >= 2; });
+    keepYielding = false;
+    enableWorkStealing = false;
+}
+
+static volatile bool highPriorityStarted;
+static volatile bool highPriorityDone;
+
+void
+lowPriorityYielder() {
+    while (!highPriorityDone) {
+        if (highPriorityStarted)
+            completionCounter++;
+        yield();
+    }
+}
+
+void
+highPriorityYielder(uint64_t durationNs) {
+    highPriorityStarted = true;
+    uint64_t stopTime = Cycles::rdtsc() + Cycles::fromNanoseconds(durationNs);
+    while (Cycles::rdtsc() < stopTime)
+        yield();
+    highPriorityDone = true;
+}
+
+TEST_F(ArachneTest, priority_higherLevelRunsFirst) {
+    uint64_t originalAgingNs = priorityAgingNs;
+    priorityAgingNs = ~0UL;
+    highPriorityStarted = false;
+    highPriorityDone = false;
+    completionCounter = 0;
+    int coreId = corePolicy->getCores(0)[0];
+    createThreadOnCore(coreId, lowPriorityYielder);
+    createThreadOnCoreWithPriority(NUM_PRIORITY_LEVELS - 1, coreId,
+                                   highPriorityYielder, 1000000);
+    limitedTimeWait([]() -> bool { return highPriorityDone; });
+    limitedTimeWait([coreId]() -> bool {
+        return Arachne::occupiedAndCount[coreId]->load().numOccupied == 0;
+    });
+    // The low priority thread cannot run while the other is runnable.
+    EXPECT_EQ(0, completionCounter);
+    priorityAgingNs = originalAgingNs;
+}
+
+TEST_F(ArachneTest, priority_agingPreventsStarvation) {
+    uint64_t originalAgingNs = priorityAgingNs;
+    priorityAgingNs = 100000;
+    highPriorityStarted = false;
+    highPriorityDone = false;
+    completionCounter = 0;
+    int coreId = corePolicy->getCores(0)[0];
+    createThreadOnCore(coreId, lowPriorityYielder);
+    createThreadOnCoreWithPriority(NUM_PRIORITY_LEVELS - 1, coreId,
+                                   highPriorityYielder, 5000000);
+    limitedTimeWait([]() -> bool { return highPriorityDone; });
+    limitedTimeWait([coreId]() -> bool {
+        return Arachne::occupiedAndCount[coreId]->load().numOccupied == 0;
+    });
+    EXPECT_LT(0, completionCounter);
+    priorityAgingNs = originalAgingNs;
+}
+
+void
+priorityChanger(int priority) {
+    setPriority(priority);
+    threadCreationIndicator = getPriority();
+}
+
+TEST_F(ArachneTest, setPriority) {
+    threadCreationIndicator = -1;
+    createThread(priorityChanger, 2);
+    limitedTimeWait([]() -> bool { return threadCreationIndicator != -1; });
+    EXPECT_EQ(2, threadCreationIndicator);
+
+    // Out-of-range priorities are ignored.
+    threadCreationIndicator = -1;
+    createThreadWithPriority(1, priorityChanger, NUM_PRIORITY_LEVELS);
+    limitedTimeWait([]() -> bool { return threadCreationIndicator != -1; });
+    EXPECT_EQ(1, threadCreationIndicator);
+    EXPECT_EQ(NullThread, createThreadWithPriority(NUM_PRIORITY_LEVELS,
+                                                   priorityChanger, 0));
+    threadCreationIndicator = 0;
+}
+
+static volatile bool coreHeld;
+static int deadlineOrder[3];
+
+void
+coreHolder() {
+    while (coreHeld) {
+    }
+}
+
+void
+deadlineRecorder(int id) {
+    deadlineOrder[completionCounter++] = id;
+}
+
+TEST_F(ArachneTest, deadline_earliestRunsFirst) {
+    completionCounter = 0;
+    coreHeld = true;
+    int coreId = corePolicy->getCores(0)[0];
+    createThreadOnCore(coreId, coreHolder);
+    // Occupy the core so that the deadline threads all become runnable
+    // before any of them runs.
+    uint64_t now = Cycles::rdtsc();
+    uint64_t period = Cycles::fromSeconds(10);
+    int ids[] = {3, 1, 2};
+    for (int id : ids)
+        createThreadOnCoreWithAttributes(
+            ThreadAttributes(DEFAULT_PRIORITY, CorePolicy::DEADLINE_CLASS,
+                             now + id * period),
+            coreId, deadlineRecorder, id);
+    coreHeld = false;
+    limitedTimeWait([]() -> bool { return completionCounter == 3; });
+    EXPECT_EQ(1, deadlineOrder[0]);
+    EXPECT_EQ(2, deadlineOrder[1]);
+    EXPECT_EQ(3, deadlineOrder[2]);
+    completionCounter = 0;
+}
+
+void
+deadlineSetter(uint64_t deadlineInCycles) {
+    setDeadline(deadlineInCycles);
+    completionCounter = getDeadline() == deadlineInCycles;
+}
+
+TEST_F(ArachneTest, deadline_missesAreCounted) {
+    PerfStats before;
+    PerfStats::collectStats(&before, corePolicy->getCores(0));
+    completionCounter = -1;
+    // The first deadline has passed when the thread sets a new one, and the
+    // second has passed when it exits.
+    createThreadWithDeadline(1, deadlineSetter, 2);
+    limitedTimeWait([]() -> bool { return completionCounter != -1; });
+    EXPECT_EQ(1, completionCounter);
+    limitedTimeWait([&before]() -> bool {
+        PerfStats after;
+        PerfStats::collectStats(&after, corePolicy->getCores(0));
+        return after.numDeadlineMisses - before.numDeadlineMisses == 2;
+    });
+    PerfStats after;
+    PerfStats::collectStats(&after, corePolicy->getCores(0));
+    EXPECT_EQ(2U, after.numDeadlineMisses - before.numDeadlineMisses);
+
+    // Threads of other classes have no deadline.
+    completionCounter = -1;
+    createThread(deadlineSetter, 2);
+    limitedTimeWait([]() -> bool { return completionCounter != -1; });
+    EXPECT_EQ(0, completionCounter);
+    completionCounter = 0;
+}
+
 TEST_F(ArachneTest, parseOptions_appOptionsOnly) {
     // See comment in parseOptions_noOptions
     shutDown();
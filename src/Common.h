@@ -19,9 +19,11 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <atomic>
+#include <vector>
 #include "utils.h"
 #include "circular_buffer.h"
 #include "fiber_syscall.h"
+#include "TimerWheel.h"
 #include <liburing.h>
 
 // This file exists to resolve circular dependencies.
@@ -45,11 +47,109 @@ namespace Arachne {
 #endif
 
 // Largest number of Arachne threads that can be simultaneously created on each
-// core.
-const int maxThreadsPerCore = 56;
+// core; set with the --maxThreadsPerCore option.
+extern int maxThreadsPerCore;
 
+// Upper bound on maxThreadsPerCore.
+const int MAX_THREADS_PER_CORE = 1024;
+
+// Number of 64-bit words in the largest mask with one bit per context.
+const int MAX_CONTEXT_WORDS = MAX_THREADS_PER_CORE / 64;
+
+// Number of 64-bit words in use in each mask with one bit per context, as
+// determined by maxThreadsPerCore.
+extern int numContextWords;
+
+/**
+ * Return the word of a per-core context mask which holds the bit for the
+ * context with the given idInCore.
+ */
+inline int
+contextWord(int idInCore) {
+    return idInCore >> 6;
+}
+
+/**
+ * Return the bit within its word of a per-core context mask which corresponds
+ * to the context with the given idInCore.
+ */
+inline uint64_t
+contextBit(int idInCore) {
+    return 1UL << (idInCore & 63);
+}
+
+// Number of priority levels for Arachne threads. Runnable threads at a higher
+// level run before those at lower levels; see setPriority().
+const int NUM_PRIORITY_LEVELS = 4;
+
+// Priority level of threads created without specifying one. It is the lowest
+// level, so that applications which do not use priorities pay nothing for
+// the higher ones.
+const int DEFAULT_PRIORITY = 0;
+
+// Number of stack size classes. A thread created with a stack class runs on a
+// stack of that class's size taken from a per-core pool, instead of on the
+// stackSize bytes of its ThreadContext's own stack.
+const int NUM_STACK_CLASSES = 4;
+
+// The size in bytes of the stacks of each stack class.
+const size_t STACK_CLASS_SIZES[NUM_STACK_CLASSES] = {
+    16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024};
+
+// Stack class of threads that run on their ThreadContext's own stack.
+const int OWN_STACK = -1;
+
+// Number of thread classes whose default stack class setStackClass() can
+// choose; threads of higher classes run on their ThreadContext's own stack.
+const int MAX_STACK_THREAD_CLASSES = 64;
+
+// Number of buckets in a StackUsageHistogram. Bucket i counts threads whose
+// deepest stack use was at most 1 KB << i bytes.
+const int NUM_STACK_USAGE_BUCKETS = 16;
+
+// Number of size classes of out-of-line buffers for the main functions and
+// arguments of threads that do not fit in ThreadContext::threadInvocation.
+const int NUM_INVOCATION_CLASSES = 3;
+
+// The number of bytes of main function and arguments that buffers of each
+// invocation class hold.
+constexpr size_t INVOCATION_CLASS_SIZES[NUM_INVOCATION_CLASSES] = {128, 256,
+                                                                   512};
+
+// Number of buffers a core allocates at once when it runs out of buffers of
+// an invocation class.
+const int INVOCATION_BUFFERS_PER_CHUNK = 32;
+
+// Number of times in a row that threads on a core may hand it to each other
+// with switchTo() before one of them goes through dispatch(), so that timers,
+// other threads and the core arbiter are not starved.
+const uint32_t MAX_CONSECUTIVE_SWITCHES = 32;
+
+// Number of fiber-local storage slots in each ThreadContext, and hence the
+// largest number of keys that createFiberLocalKey() hands out.
+const int NUM_FIBER_LOCAL_SLOTS = 8;
+
+struct Core;
 struct ThreadContext;
+struct InjectedThread;
+
+/**
+ * The header of an out-of-line buffer holding the main function and
+ * arguments of a thread; the buffer's contents follow it.
+ */
+struct alignas(16) InvocationBuffer {
+    /// The next buffer on the free list this buffer is on.
+    InvocationBuffer* next;
+
+    /// The core whose buffers this buffer belongs to, or NULL if it was
+    /// allocated with malloc.
+    Core* owner;
+
+    /// The invocation class of this buffer.
+    int invocationClass;
+};
 struct MaskAndCount;
+struct OccupiedSlots;
 
 /**
  * This class holds all the state associated with a particular core in Arachne.
@@ -70,19 +170,35 @@ struct Core {
     bool coreDeschedulingScheduled;
 
     /**
-     * This variable holds the index into the current kernel thread's
-     * localThreadContexts that it will check first the next time it looks for
-     * a thread to run. It is used to implement round-robin scheduling of
-     * Arachne threads.
+     * Number of switchTo() handoffs on this core since dispatch() last ran;
+     * see MAX_CONSECUTIVE_SWITCHES.
+     */
+    uint32_t consecutiveSwitches;
+
+    /**
+     * For each priority level, this variable holds the index into the current
+     * kernel thread's localThreadContexts that it will check first the next
+     * time it looks for a thread to run at that level. It is used to
+     * implement round-robin scheduling of Arachne threads.
      */
-    uint8_t nextCandidateIndex = 0;
+    uint16_t nextCandidateIndex[NUM_PRIORITY_LEVELS];
 
     /**
-     * This is the highest-indexed context known to be occupied on a given
-     * core. Additional occupied contexts are immediately above this context
-     * and have no unoccupied contexts between them.
+     * For each priority level, a bitmask in which set bits represent contexts
+     * at that level that may be runnable. dispatch() takes the contents of
+     * runnableThreads into these masks once per round and clears each bit as
+     * it examines the context; wakeups raised by this core itself are
+     * recorded here directly.
      */
-    uint8_t highestOccupiedContext;
+    uint64_t privateRunnableMask[NUM_PRIORITY_LEVELS][MAX_CONTEXT_WORDS];
+
+    /**
+     * For each priority level, the time (in cycles) at which dispatch() first
+     * passed over a runnable thread at that level in favor of a higher level,
+     * or 0 if it has not done so since last running a thread at that level.
+     * Used to age starved levels.
+     */
+    uint64_t levelWaitingSince[NUM_PRIORITY_LEVELS];
 
     /**
      * The unique identifier given by the Linux kernel for this core.
@@ -93,11 +209,65 @@ struct Core {
      * A bitmask in which set bits represent contexts that should run with
      * elevated priority.
      * Each call to dispatch() will examine this bitmask before searching other
-     * contexts. When reducing the number of cores, this value (if nonzero)
-     * should be cleared, since all non-terminated threads on this core will be
-     * migrated away from this thread.
+     * contexts, but does not let a thread overtake runnable threads at a
+     * higher priority level. When reducing the number of cores, this value
+     * (if nonzero) should be cleared, since all non-terminated threads on this
+     * core will be migrated away from this thread.
+     */
+    uint64_t privatePriorityMask[MAX_CONTEXT_WORDS];
+
+    /**
+     * Set bits represent contexts on this core that host threads of
+     * CorePolicy::DEADLINE_CLASS, which dispatch() runs earliest deadline
+     * first. dispatch() adds the contents of newDeadlineThreads to this mask
+     * and drops bits of contexts that no longer host such threads.
+     */
+    uint64_t deadlineThreads[MAX_CONTEXT_WORDS];
+
+    /**
+     * Threads injected into this core which are waiting for a free context,
+     * oldest first, linked through InjectedThread::next; see
+     * injectedThreads.
+     */
+    InjectedThread* heldInjectedThreads;
+
+    /**
+     * The last thread in heldInjectedThreads; only valid if that is not NULL.
+     */
+    InjectedThread* heldInjectedThreadsTail;
+
+    /**
+     * For each stack class, the unused stacks of that class held by this
+     * core. A thread takes a stack from the pool of the core it starts on
+     * and returns it to the pool of the core it exits on.
+     */
+    std::vector<void*> stackPools[NUM_STACK_CLASSES];
+
+    /**
+     * For each stack class, the number of stacks at the front of its stack
+     * pool whose memory trimLocalStacks() has released; the pools are used
+     * last in, first out, so these are the ones that have gone unused since.
+     */
+    size_t numTrimmedPooledStacks[NUM_STACK_CLASSES];
+
+    /**
+     * For each invocation class, buffers of this core that are free, linked
+     * through InvocationBuffer::next. Only this core touches these lists.
      */
-    uint64_t privatePriorityMask;
+    InvocationBuffer* freeInvocationBuffers[NUM_INVOCATION_CLASSES];
+
+    /**
+     * For each invocation class, buffers of this core that threads exiting
+     * on other cores have freed. Other cores push onto these lists, and this
+     * core takes them whole when freeInvocationBuffers runs dry.
+     */
+    std::atomic<InvocationBuffer*> remoteInvocationBuffers
+        [NUM_INVOCATION_CLASSES];
+
+    /**
+     * The memory that this core's invocation buffers were carved from.
+     */
+    std::vector<void*> invocationChunks;
 
     /**
      * This pointer allows fast access to the current kernel thread's
@@ -106,6 +276,12 @@ struct Core {
      */
     ThreadContext** localThreadContexts;
 
+    /**
+     * The deadlines of the threads in this core's contexts, indexed by
+     * idInCore; see allDeadlines.
+     */
+    uint64_t* localDeadlines;
+
     /**
      * This is the context of the thread that a given core is currently
      * executing. If the core is not executing a context, it polls for threads
@@ -122,20 +298,113 @@ struct Core {
      */
     std::atomic<MaskAndCount>* localOccupiedAndCount;
 
+    /**
+     * Used in place of localOccupiedAndCount when maxThreadsPerCore exceeds
+     * MaskAndCount::MAX_THREADS.
+     */
+    OccupiedSlots* localOccupiedSlots;
+
     /**
      * The ith bit is set to prevent migration of the ThreadContext at index i.
      * To prevent migration of active contexts, runtime code must set the bit
      * corresponding to loadedContext before clearing the occupied flag at
-     * thread exit.
+     * thread exit. At most one context per core is pinned at a time.
+     * This mask, like highPriorityThreads and runnableThreads, spans
+     * numContextWords words.
      */
     std::atomic<uint64_t>* localPinnedContexts;
 
     /**
      * Setting a jth bit indicates that the priority of the thread living at
-     * index j is temporarily raised.
+     * index j is temporarily raised within its priority level.
      */
     std::atomic<uint64_t>* highPriorityThreads;
 
+    /**
+     * Setting the jth bit indicates that the thread living at index j was
+     * created on or migrated to this core with CorePolicy::DEADLINE_CLASS;
+     * it is set before the thread is marked runnable.
+     */
+    std::atomic<uint64_t>* newDeadlineThreads;
+
+    /**
+     * Setting the jth bit indicates that the thread living at index j may
+     * have become runnable. Bits are set after wakeupTimeInCycles is set to
+     * 0, and wakeupTimeInCycles remains authoritative, so a stale bit only
+     * costs dispatch() a check.
+     * There is one mask of numContextWords words per priority level, stored
+     * one after another starting with level 0; see markRunnable().
+     */
+    std::atomic<uint64_t>* runnableThreads;
+
+    /**
+     * Nonzero means that an idle core has asked this core to hand over a
+     * runnable thread; the value is one more than the id of that core.
+     */
+    std::atomic<int> stealRequest;
+
+    /**
+     * When enableWorkStealing is set, the number of candidates in this
+     * core's runnable masks at the start of its latest dispatch() round.
+     * Unlike the number of occupied contexts, this leaves out blocked
+     * threads, so idle cores use it to choose a core to steal from.
+     */
+    std::atomic<uint32_t> numRunnable;
+
+    /**
+     * True means that trimStacks() has asked this core to release the stack
+     * memory of its long-unoccupied contexts; dispatch() does so at the end
+     * of its next round.
+     */
+    std::atomic<bool> trimStacksRequested;
+
+    /**
+     * The time (in cycles) at which this core last tried to steal work from
+     * another core.
+     */
+    uint64_t lastStealAttempt;
+
+    /**
+     * True while this core's kernel thread is blocked, or about to block, in
+     * parkCore(). Any core that makes work available to this one must then
+     * signal parkFd.
+     */
+    std::atomic<bool> parked;
+
+    /**
+     * True while this core's kernel thread is blocked in idleCorePrivate().
+     * Such a core runs nothing until it is unidled, so other cores need not
+     * wait for it to catch up with shared state such as registrations.
+     */
+    std::atomic<bool> idled;
+
+    /**
+     * An eventfd which this core blocks on while parked. It is also
+     * registered with sys_io_ring, so that completions wake the core.
+     */
+    int parkFd;
+
+    /**
+     * Timers of threads on this core that are sleeping or waiting with a
+     * timeout. Only accessed by the kernel thread that owns this core.
+     */
+    TimerWheel timerWheel;
+
+    /**
+     * Timers of threads that other cores have migrated onto this core, linked
+     * through Timer::nextMigrated. The owning core moves them into timerWheel
+     * the next time it dispatches.
+     */
+    std::atomic<Timer*> migratedTimers;
+
+    /**
+     * Threads that other kernel threads have submitted to this core with
+     * injectThread(), newest first, linked through InjectedThread::next.
+     * dispatch() moves them to heldInjectedThreads once per round and gives
+     * them contexts as slots allow, so submitters never touch the slot maps.
+     */
+    std::atomic<InjectedThread*> injectedThreads;
+
     /*
      * System call queue for io_uring supported operations.
      */
@@ -146,15 +415,98 @@ struct Core {
     intrusive_list<syscall_wait_request> pending_requests;
 
     /*
-     * For future use.
+     * syscall_wait_requests of this core that are free, linked through
+     * syscall_wait_request::next_free. Only this core touches this list.
+     */
+    syscall_wait_request *free_syscall_requests;
+
+    /*
+     * syscall_wait_requests of this core that threads on other cores have
+     * freed. Other cores push onto this list, and this core takes it whole
+     * when free_syscall_requests runs dry.
      */
+    std::atomic<syscall_wait_request *> remote_syscall_requests;
 
     /*
-     * Used to communicate with poll thread the number of items
-     * in sys_io_ring.
+     * The memory that this core's syscall_wait_requests were carved from.
+     */
+    std::vector<void *> syscall_request_chunks;
+
+    /*
+     * The versions of the registered file and buffer tables that
+     * sys_io_ring has registered; 0 if it has registered none.
+     */
+    uint64_t registered_files_generation;
+    uint64_t registered_buffers_generation;
+
+    /*
+     * The registrations_generation that sys_io_ring is up to date with, or
+     * UINT64_MAX while this core is offline or has no ring. Changes to the
+     * tables wait for every core to catch up.
+     */
+    std::atomic<uint64_t> registrations_seen;
+
+    /*
+     * Registered buffers of this core that are free, linked through
+     * registered_buffer::next. Only this core touches this list.
+     */
+    registered_buffer *free_registered_buffers;
+
+    /*
+     * Registered buffers of this core that threads on other cores have
+     * returned; this core takes them whole when its own list runs dry.
+     */
+    std::atomic<registered_buffer *> remote_registered_buffers;
+
+    /*
+     * The provided buffer ring for multishot recvs on sys_io_ring, or
+     * nullptr until a thread of this core starts one.
+     */
+    struct io_uring_buf_ring *recv_buf_ring;
+
+    /*
+     * The memory of the buffers in recv_buf_ring, and for each buffer id
+     * the length of the data in the buffer and the next buffer queued
+     * after it on its recv_stream.
+     */
+    char *recv_buffers;
+    uint32_t *recv_buffer_len;
+    int32_t *recv_buffer_next;
+
+    /*
+     * For each buffer id, true from the completion that filled the buffer
+     * until it is given back. A new recv_buf_ring starts with only the
+     * buffers that are not out, so that none is in the ring twice.
+     */
+    bool *recv_buffer_out;
+
+    /* The number of buffers in recv_buf_ring that the kernel may fill. */
+    unsigned recv_buffers_in_ring;
+
+    /*
+     * Multishot recvs of this core that ended with ENOBUFS while every
+     * buffer was out; they are armed again when a buffer is given back.
+     */
+    intrusive_list<syscall_wait_request> starved_recv_streams;
+
+    /*
+     * Buffers of this core that threads on other cores have given back,
+     * linked through recv_buffer_next; -1 if there are none.
+     */
+    std::atomic<int32_t> remote_recv_buffers{-1};
+
+    /*
+     * The number of SQEs queued in sys_io_ring that have not been
+     * submitted yet; see flush_submissions().
      */
     std::atomic<uint32_t> sys_io_ring_backlog;
 
+    /*
+     * If sys_io_ring_backlog is non-zero, the cycle counter when the
+     * first SQE in the backlog was queued.
+     */
+    uint64_t sys_io_ring_backlog_since;
+
     /*
      * Circular ring buffer of system call operations.
      */
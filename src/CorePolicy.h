@@ -137,6 +137,14 @@ class CorePolicy {
         bool mustFree;
     };
 
+    /**
+     * Threads created with this class carry a deadline and are scheduled
+     * earliest-deadline-first, ahead of all other threads on their core.
+     * Implementors that support deadline threads should return the cores
+     * such threads may be placed on from getCores(DEADLINE_CLASS).
+     */
+    static const int DEADLINE_CLASS = 2;
+
     /**
      * Invoked by an Arachne kernel thread after it wakes up on a dedicated
      * core and sets up state to run the Arachne scheduler.
@@ -0,0 +1,117 @@
+/* Copyright (c) 2018 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * This microbenchmark measures the cost of creating a batch of threads with
+ * createThreads() against creating the same threads one at a time with
+ * createThread(), and the cost of creating and joining a thread on a stack from
+ * each stack class against a thread on its own stack, along with the stack
+ * memory the pools hold afterwards. Arachne options such as --minNumCores may
+ * be passed on the command line.
+ */
+
+#include <stdio.h>
+#include "Arachne.h"
+#include "PerfStats.h"
+#include "PerfUtils/Cycles.h"
+
+using PerfUtils::Cycles;
+
+namespace {
+
+const int NUM_ITERATIONS = 10000;
+const int BATCH_SIZES[] = {8, 16, 32};
+const int MAX_BATCH_SIZE = 32;
+
+void
+noop() {}
+
+/**
+ * Create and join NUM_ITERATIONS batches of the given size, and return the
+ * average number of cycles spent creating one batch.
+ */
+uint64_t
+timeBatches(int batchSize, bool batched) {
+    Arachne::ThreadId threadIds[MAX_BATCH_SIZE];
+    uint64_t totalCycles = 0;
+    for (int i = 0; i < NUM_ITERATIONS; i++) {
+        uint64_t startTime = Cycles::rdtsc();
+        if (batched) {
+            Arachne::createThreads(batchSize, threadIds, noop);
+        } else {
+            for (int j = 0; j < batchSize; j++)
+                threadIds[j] = Arachne::createThread(noop);
+        }
+        totalCycles += Cycles::rdtsc() - startTime;
+        for (int j = 0; j < batchSize; j++)
+            if (threadIds[j] != Arachne::NullThread)
+                Arachne::join(threadIds[j]);
+    }
+    return totalCycles / NUM_ITERATIONS;
+}
+
+/**
+ * Create and join NUM_ITERATIONS threads of the given stack class, and return
+ * the average number of cycles from creating one thread to its join.
+ */
+uint64_t
+timeStackClass(int stackClass) {
+    uint64_t startTime = Cycles::rdtsc();
+    for (int i = 0; i < NUM_ITERATIONS; i++) {
+        Arachne::ThreadId id =
+            Arachne::createThreadWithStackClass(0, stackClass, noop);
+        if (id != Arachne::NullThread)
+            Arachne::join(id);
+    }
+    return (Cycles::rdtsc() - startTime) / NUM_ITERATIONS;
+}
+
+void
+runBenchmark() {
+    printf("%10s %18s %18s\n", "BatchSize", "createThread (ns)",
+           "createThreads (ns)");
+    for (int batchSize : BATCH_SIZES) {
+        uint64_t loopCycles = timeBatches(batchSize, false);
+        uint64_t batchCycles = timeBatches(batchSize, true);
+        printf("%10d %18lu %18lu\n", batchSize,
+               Cycles::toNanoseconds(loopCycles),
+               Cycles::toNanoseconds(batchCycles));
+    }
+
+    printf("\n%10s %18s\n", "StackSize", "create+join (ns)");
+    printf("%10d %18lu\n", Arachne::stackSize,
+           Cycles::toNanoseconds(timeStackClass(Arachne::OWN_STACK)));
+    for (int stackClass = 0; stackClass < Arachne::NUM_STACK_CLASSES;
+         stackClass++) {
+        printf("%10lu %18lu\n", Arachne::STACK_CLASS_SIZES[stackClass],
+               Cycles::toNanoseconds(timeStackClass(stackClass)));
+    }
+    Arachne::PerfStats stats;
+    Arachne::PerfStats::collectStats(
+        &stats, Arachne::getCorePolicy()->getCores(0));
+    printf("\nPooled stack memory: %lu bytes in %lu stacks\n",
+           stats.pooledStackBytes, stats.numStackPoolMisses);
+    Arachne::shutDown();
+}
+
+}  // namespace
+
+int
+main(int argc, const char** argv) {
+    Arachne::init(&argc, argv);
+    Arachne::createThread(runBenchmark);
+    Arachne::waitForTermination();
+    return 0;
+}
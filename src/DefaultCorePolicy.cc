@@ -85,6 +85,7 @@ CorePolicy::CoreList
 DefaultCorePolicy::getCores(int threadClass) {
     switch (threadClass) {
         case DEFAULT:
+        case DEADLINE:
             return sharedCores;
         case EXCLUSIVE:
             int coreId = getExclusiveCore();
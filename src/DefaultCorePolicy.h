@@ -41,7 +41,11 @@ class DefaultCorePolicy : public CorePolicy {
      * Applications using this CorePolicy must create threads using one of
      * these classes.
      */
-    enum ThreadClass { DEFAULT = 0, EXCLUSIVE = 1 };
+    enum ThreadClass {
+        DEFAULT = 0,
+        EXCLUSIVE = 1,
+        DEADLINE = CorePolicy::DEADLINE_CLASS
+    };
 
   private:
     int getExclusiveCore();
@@ -163,6 +163,14 @@ TEST_F(DefaultCorePolicyTest, DefaultCorePolicy_getCoresDefault) {
     EXPECT_EQ(corePolicy.getCores(DefaultCorePolicy::DEFAULT).size(), 2U);
 }
 
+TEST_F(DefaultCorePolicyTest, DefaultCorePolicy_getCoresDeadline) {
+    DefaultCorePolicy corePolicy(4, /*estimateLoad=*/false);
+    EXPECT_EQ(corePolicy.getCores(DefaultCorePolicy::DEADLINE).size(), 0U);
+    corePolicy.coreAvailable(5);
+    EXPECT_EQ(corePolicy.getCores(DefaultCorePolicy::DEADLINE).size(), 1U);
+    EXPECT_EQ(corePolicy.getCores(DefaultCorePolicy::DEADLINE)[0], 5);
+}
+
 TEST_F(DefaultCorePolicyTest, DefaultCorePolicy_getCoresExclusive) {
     DefaultCorePolicy* corePolicy =
         reinterpret_cast<DefaultCorePolicy*>(Arachne::getCorePolicy());
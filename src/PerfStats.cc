@@ -125,12 +125,27 @@ PerfStats::collectStats(PerfStats* total, CorePolicy::CoreList coreList) {
         // declaration order in PerfStats.h.
         total->idleCycles += stats->idleCycles;
         total->totalCycles += stats->totalCycles;
+        total->parkedCycles += stats->parkedCycles;
         total->weightedLoadedCycles += stats->weightedLoadedCycles;
         total->numThreadsCreated += stats->numThreadsCreated;
         total->numThreadsFinished += stats->numThreadsFinished;
         total->numCoreIncrements += stats->numCoreIncrements;
         total->numCoreDecrements += stats->numCoreDecrements;
         total->numContendedCreations += stats->numContendedCreations;
+        total->numStealAttempts += stats->numStealAttempts;
+        total->numStealSuccesses += stats->numStealSuccesses;
+        total->numStealFailures += stats->numStealFailures;
+        for (int level = 0; level < NUM_PRIORITY_LEVELS; level++)
+            total->numRunsAtPriority[level] += stats->numRunsAtPriority[level];
+        total->numPriorityAgings += stats->numPriorityAgings;
+        total->numDeadlineMisses += stats->numDeadlineMisses;
+        total->numThreadsInjected += stats->numThreadsInjected;
+        total->numStackPoolMisses += stats->numStackPoolMisses;
+        total->pooledStackBytes += stats->pooledStackBytes;
+        total->numDirectSwitches += stats->numDirectSwitches;
+        total->reclaimedStackBytes += stats->reclaimedStackBytes;
+        total->numSubmissionBatches += stats->numSubmissionBatches;
+        total->numSubmittedRequests += stats->numSubmittedRequests;
     }
 }
 }  // namespace Arachne
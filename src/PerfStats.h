@@ -19,6 +19,7 @@
 #include <memory>
 #include <vector>
 
+#include "Common.h"
 #include "CorePolicy.h"
 #include "SpinLock.h"
 
@@ -55,6 +56,11 @@ struct PerfStats {
     // useful work and idle time.
     uint64_t totalCycles;
 
+    // Number of cycles during which this core's kernel thread was parked
+    // because it had nothing to run. These cycles are also counted in
+    // idleCycles.
+    uint64_t parkedCycles;
+
     // Number of threads run in one pass through a dispatch cycle
     // multiplied by the number of cycles that dispatch cycle took.
     uint64_t weightedLoadedCycles;
@@ -76,6 +82,57 @@ struct PerfStats {
     // bitmask.
     uint64_t numContendedCreations;
 
+    // Number of times this core found nothing to run and asked another core
+    // to hand over a runnable thread.
+    uint64_t numStealAttempts;
+
+    // Number of requests to steal work which this core answered by handing
+    // over at least one thread.
+    uint64_t numStealSuccesses;
+
+    // Number of requests to steal work which this core turned down, because
+    // it had no threads to spare.
+    uint64_t numStealFailures;
+
+    // Number of times dispatch() ran a thread at each priority level.
+    uint64_t numRunsAtPriority[NUM_PRIORITY_LEVELS];
+
+    // Number of times dispatch() ran a thread at a lower priority level
+    // ahead of runnable threads at a higher level, because the lower level
+    // had been passed over for priorityAgingNs.
+    uint64_t numPriorityAgings;
+
+    // Number of threads of CorePolicy::DEADLINE_CLASS on this core that
+    // exited, or were given a new deadline, after their deadline had passed.
+    uint64_t numDeadlineMisses;
+
+    // Number of threads submitted with injectThread() that this core has
+    // started.
+    uint64_t numThreadsInjected;
+
+    // Number of stacks this core has mapped for its stack pools because the
+    // pool for a thread's stack class was empty; each costs the thread's
+    // creation an mmap.
+    uint64_t numStackPoolMisses;
+
+    // Number of bytes of pooled stacks this core has mapped, less those it
+    // has unmapped, or trimmed while they sat unused in its pools. Stacks
+    // move between cores with their threads, so only the total is exact.
+    uint64_t pooledStackBytes;
+
+    // Number of times threads on this core handed the core directly to a
+    // blocked thread with switchTo(), bypassing dispatch().
+    uint64_t numDirectSwitches;
+
+    // Number of bytes of resident stack memory this core has returned to the
+    // operating system, on descheduling or for trimStacks().
+    uint64_t reclaimedStackBytes;
+
+    // Number of times this core submitted the requests queued in its
+    // io_uring, and the number of requests those submissions carried.
+    uint64_t numSubmissionBatches;
+    uint64_t numSubmittedRequests;
+
     /// Used to protect the allCoreStats and coreStatsHeld vectors.
     static SpinLock mutex;
 
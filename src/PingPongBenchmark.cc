@@ -0,0 +1,104 @@
+/* Copyright (c) 2018 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * This microbenchmark measures the round-trip time of two threads on one core
+ * handing control back and forth, once with schedule() followed by block()
+ * and once with switchTo(). Arachne options such as --minNumCores may be
+ * passed on the command line.
+ */
+
+#include <stdio.h>
+#include <atomic>
+#include "Arachne.h"
+#include "PerfUtils/Cycles.h"
+
+using PerfUtils::Cycles;
+
+namespace {
+
+const int NUM_ROUNDS = 1000000;
+
+/// The player whose turn it is to run.
+std::atomic<int> turn;
+
+/// The two players, which are set before ready.
+Arachne::ThreadId players[2];
+std::atomic<bool> ready;
+
+/// Cycles player 0 measured for all of the rounds.
+uint64_t totalCycles;
+
+/**
+ * Top-level function for one of the two players, which hands control to the
+ * other player NUM_ROUNDS times.
+ */
+void
+player(int self, bool direct) {
+    while (!ready)
+        Arachne::yield();
+    Arachne::ThreadId peer = players[1 - self];
+    uint64_t startTime = Cycles::rdtsc();
+    for (int i = 0; i < NUM_ROUNDS; i++) {
+        while (turn != self)
+            Arachne::block();
+        turn = 1 - self;
+        if (direct)
+            Arachne::switchTo(peer);
+        else
+            Arachne::schedule(peer);
+    }
+    if (self == 0) {
+        totalCycles = Cycles::rdtsc() - startTime;
+        // With switchTo(), the other player blocked in its last handoff.
+        Arachne::schedule(peer);
+    }
+}
+
+/**
+ * Return the average number of nanoseconds for one round trip between two
+ * players on the given core.
+ */
+uint64_t
+timeRoundTrip(int coreId, bool direct) {
+    turn = 0;
+    ready = false;
+    players[0] = Arachne::createThreadOnCore(coreId, player, 0, direct);
+    players[1] = Arachne::createThreadOnCore(coreId, player, 1, direct);
+    ready = true;
+    Arachne::join(players[0]);
+    Arachne::join(players[1]);
+    return Cycles::toNanoseconds(totalCycles) / NUM_ROUNDS;
+}
+
+void
+runBenchmark() {
+    int coreId = Arachne::getCorePolicy()->getCores(0)[0];
+    printf("%24s %18s\n", "Handoff", "Round trip (ns)");
+    printf("%24s %18lu\n", "schedule() + block()",
+           timeRoundTrip(coreId, false));
+    printf("%24s %18lu\n", "switchTo()", timeRoundTrip(coreId, true));
+    Arachne::shutDown();
+}
+
+}  // namespace
+
+int
+main(int argc, const char** argv) {
+    Arachne::init(&argc, argv);
+    Arachne::createThread(runBenchmark);
+    Arachne::waitForTermination();
+    return 0;
+}
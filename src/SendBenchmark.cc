@@ -0,0 +1,145 @@
+/* Copyright (c) 2018 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * This microbenchmark measures the throughput of Arachne::send() against
+ * Arachne::send_zc() over a loopback TCP connection, for several message
+ * sizes. A receiver thread on another core, if there is one, drains the
+ * connection. Arachne options such as --minNumCores may be passed on the
+ * command line.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include "Arachne.h"
+#include "PerfUtils/Cycles.h"
+
+using PerfUtils::Cycles;
+
+namespace {
+
+const size_t BYTES_PER_RUN = 1UL << 30;
+const size_t MESSAGE_SIZES[] = {16 * 1024, 64 * 1024, 256 * 1024,
+                                1024 * 1024};
+const size_t MAX_MESSAGE_SIZE = 1024 * 1024;
+
+char sendBuffer[MAX_MESSAGE_SIZE];
+char receiveBuffer[MAX_MESSAGE_SIZE];
+
+/// Bytes the receiver has read so far.
+std::atomic<uint64_t> bytesReceived;
+
+void
+checkResult(ssize_t rc, const char* what) {
+    if (rc < 0) {
+        fprintf(stderr, "%s failed: %s\n", what, strerror(-rc));
+        abort();
+    }
+}
+
+/**
+ * Top-level function of the receiver, which reads from fd until the
+ * connection is closed.
+ */
+void
+receiver(int fd) {
+    for (;;) {
+        ssize_t rc = Arachne::recv(fd, receiveBuffer, sizeof(receiveBuffer),
+                                   0, -1ULL);
+        checkResult(rc, "recv");
+        if (rc == 0)
+            break;
+        bytesReceived += rc;
+    }
+    ::close(fd);
+}
+
+/**
+ * Send BYTES_PER_RUN bytes over fd in messages of the given size, and return
+ * the throughput in MB/s once the receiver has read everything sent.
+ */
+double
+measureThroughput(int fd, size_t messageSize, bool zeroCopy) {
+    uint64_t startBytes = bytesReceived;
+    uint64_t startTime = Cycles::rdtsc();
+    size_t sent = 0;
+    while (sent < BYTES_PER_RUN) {
+        ssize_t rc =
+            zeroCopy
+                ? Arachne::send_zc(fd, sendBuffer, messageSize, 0, -1ULL)
+                : Arachne::send(fd, sendBuffer, messageSize, 0, -1ULL);
+        checkResult(rc, zeroCopy ? "send_zc" : "send");
+        sent += rc;
+    }
+    while (bytesReceived < startBytes + sent)
+        Arachne::yield();
+    double seconds = Cycles::toSeconds(Cycles::rdtsc() - startTime);
+    return static_cast<double>(sent) / seconds / 1e6;
+}
+
+void
+runBenchmark() {
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrlen = sizeof(addr);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0 ||
+        bind(listener, reinterpret_cast<sockaddr*>(&addr), addrlen) != 0 ||
+        listen(listener, 1) != 0 ||
+        getsockname(listener, reinterpret_cast<sockaddr*>(&addr),
+                    &addrlen) != 0) {
+        perror("SendBenchmark listener");
+        abort();
+    }
+    int sender = socket(AF_INET, SOCK_STREAM, 0);
+    if (::connect(sender, reinterpret_cast<sockaddr*>(&addr), addrlen) != 0) {
+        perror("SendBenchmark connect");
+        abort();
+    }
+    int receiverFd = ::accept(listener, NULL, NULL);
+    ::close(listener);
+
+    Arachne::CorePolicy::CoreList cores =
+        Arachne::getCorePolicy()->getCores(0);
+    Arachne::ThreadId receiverId = Arachne::createThreadOnCore(
+        cores[cores.size() - 1], receiver, receiverFd);
+
+    printf("%14s %16s %16s\n", "Message (KB)", "send (MB/s)",
+           "send_zc (MB/s)");
+    for (size_t messageSize : MESSAGE_SIZES) {
+        double copied = measureThroughput(sender, messageSize, false);
+        double zeroCopy = measureThroughput(sender, messageSize, true);
+        printf("%14lu %16.0f %16.0f\n", messageSize / 1024, copied, zeroCopy);
+    }
+    ::close(sender);
+    Arachne::join(receiverId);
+    Arachne::shutDown();
+}
+
+}  // namespace
+
+int
+main(int argc, const char** argv) {
+    Arachne::init(&argc, argv);
+    Arachne::createThread(runBenchmark);
+    Arachne::waitForTermination();
+    return 0;
+}
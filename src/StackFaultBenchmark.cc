@@ -0,0 +1,109 @@
+/* Copyright (c) 2018 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * This microbenchmark counts the page faults that threads take when they
+ * first touch their stacks, and how long the first batch of threads takes
+ * compared to later batches that reuse the same stacks. Run it with and
+ * without --hugePages and --prefault to compare; other Arachne options such
+ * as --minNumCores may also be passed on the command line.
+ */
+
+#include <stdio.h>
+#include <sys/resource.h>
+#include "Arachne.h"
+#include "PerfUtils/Cycles.h"
+
+using PerfUtils::Cycles;
+
+namespace {
+
+const int NUM_BATCHES = 10;
+const int BATCH_SIZE = 50;
+
+// The number of bytes of its stack each thread touches.
+const size_t TOUCHED_STACK_BYTES = 256 * 1024;
+
+/**
+ * Return the number of page faults the process has taken so far.
+ */
+uint64_t
+pageFaults() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt + usage.ru_majflt;
+}
+
+void
+touchStack() {
+    volatile char buffer[TOUCHED_STACK_BYTES];
+    for (size_t i = 0; i < TOUCHED_STACK_BYTES; i += PAGE_SIZE)
+        buffer[i] = 1;
+    static_cast<void>(buffer[0]);
+}
+
+/**
+ * Create and join a batch of threads that touch their stacks, and return the
+ * number of cycles it took.
+ */
+uint64_t
+runBatch() {
+    Arachne::ThreadId threadIds[BATCH_SIZE];
+    uint64_t startTime = Cycles::rdtsc();
+    for (int i = 0; i < BATCH_SIZE; i++)
+        threadIds[i] = Arachne::createThread(touchStack);
+    for (int i = 0; i < BATCH_SIZE; i++)
+        if (threadIds[i] != Arachne::NullThread)
+            Arachne::join(threadIds[i]);
+    return Cycles::rdtsc() - startTime;
+}
+
+uint64_t initFaults;
+
+void
+runBenchmark() {
+    uint64_t startFaults = pageFaults();
+    uint64_t firstBatchCycles = runBatch();
+    uint64_t firstBatchFaults = pageFaults() - startFaults;
+
+    startFaults = pageFaults();
+    uint64_t laterBatchCycles = 0;
+    for (int i = 1; i < NUM_BATCHES; i++)
+        laterBatchCycles += runBatch();
+    uint64_t laterBatchFaults = (pageFaults() - startFaults) / (NUM_BATCHES - 1);
+    laterBatchCycles /= NUM_BATCHES - 1;
+
+    printf("hugePages %d prefault %d\n", Arachne::useHugePages,
+           Arachne::prefaultMemory);
+    printf("%14s %12s %12s\n", "", "Faults", "Time (ns)");
+    printf("%14s %12lu %12s\n", "init", initFaults, "");
+    printf("%14s %12lu %12lu\n", "first batch", firstBatchFaults,
+           Cycles::toNanoseconds(firstBatchCycles));
+    printf("%14s %12lu %12lu\n", "later batches", laterBatchFaults,
+           Cycles::toNanoseconds(laterBatchCycles));
+    Arachne::shutDown();
+}
+
+}  // namespace
+
+int
+main(int argc, const char** argv) {
+    uint64_t startFaults = pageFaults();
+    Arachne::init(&argc, argv);
+    initFaults = pageFaults() - startFaults;
+    Arachne::createThread(runBenchmark);
+    Arachne::waitForTermination();
+    return 0;
+}
@@ -0,0 +1,129 @@
+/* Copyright (c) 2018 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * This microbenchmark measures the cost of setting up and tearing down the
+ * syscall_wait_request and iovec copy behind each io_uring system call, with
+ * the per-core free lists against new and malloc, and the time of a whole
+ * Arachne::preadv() from a temporary file for several numbers of iovecs.
+ * Arachne options such as --minNumCores may be passed on the command line.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "Arachne.h"
+#include "PerfUtils/Cycles.h"
+
+using PerfUtils::Cycles;
+
+namespace {
+
+const int NUM_ITERATIONS = 100000;
+const int IOVEC_COUNTS[] = {1, 4, 8};
+const int MAX_IOVECS = 8;
+const size_t IOVEC_SIZE = 512;
+
+char buffers[MAX_IOVECS][IOVEC_SIZE];
+struct iovec iovecs[MAX_IOVECS];
+
+/**
+ * Return the average number of nanoseconds to set up and tear down one
+ * request with the given number of iovecs, either from the free lists or the
+ * way every request used to be: with new, plus malloc for more than one
+ * iovec.
+ */
+uint64_t
+timeRequests(int iovcnt, bool pooled) {
+    Arachne::ThreadContext* context = Arachne::core.loadedContext;
+    uint64_t startTime = Cycles::rdtsc();
+    for (int i = 0; i < NUM_ITERATIONS; i++) {
+        Arachne::syscall_wait_request* request;
+        struct iovec* iovp;
+        if (pooled) {
+            request = Arachne::alloc_syscall_request(context, 0);
+            iovp = request->iov;
+        } else {
+            request = new Arachne::syscall_wait_request(context, 0);
+            iovp = request->iov;
+            if (iovcnt > 1) {
+                request->ext_arg = malloc(sizeof(*iovp) * iovcnt);
+                iovp = static_cast<struct iovec*>(request->ext_arg);
+            }
+        }
+        memcpy(iovp, iovecs, sizeof(*iovp) * iovcnt);
+        if (pooled) {
+            Arachne::free_syscall_request(request);
+        } else {
+            free(request->ext_arg);
+            delete request;
+        }
+    }
+    return Cycles::toNanoseconds(Cycles::rdtsc() - startTime) / NUM_ITERATIONS;
+}
+
+/**
+ * Return the average number of nanoseconds for Arachne::preadv() to read the
+ * given number of iovecs from fd.
+ */
+uint64_t
+timePreadv(int fd, int iovcnt) {
+    uint64_t startTime = Cycles::rdtsc();
+    for (int i = 0; i < NUM_ITERATIONS; i++) {
+        ssize_t rc = Arachne::preadv(fd, iovecs, iovcnt, 0, -1ULL);
+        if (rc != static_cast<ssize_t>(IOVEC_SIZE * iovcnt)) {
+            fprintf(stderr, "preadv failed: %s\n", strerror(-rc));
+            abort();
+        }
+    }
+    return Cycles::toNanoseconds(Cycles::rdtsc() - startTime) / NUM_ITERATIONS;
+}
+
+void
+runBenchmark() {
+    for (int i = 0; i < MAX_IOVECS; i++) {
+        iovecs[i].iov_base = buffers[i];
+        iovecs[i].iov_len = IOVEC_SIZE;
+    }
+    char path[] = "/tmp/SyscallBenchmarkXXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0 || ftruncate(fd, sizeof(buffers)) != 0) {
+        perror("SyscallBenchmark temporary file");
+        abort();
+    }
+    unlink(path);
+
+    printf("%8s %18s %18s %14s\n", "Iovecs", "new+malloc (ns)",
+           "free lists (ns)", "preadv (ns)");
+    for (int iovcnt : IOVEC_COUNTS) {
+        uint64_t heapNs = timeRequests(iovcnt, false);
+        uint64_t pooledNs = timeRequests(iovcnt, true);
+        printf("%8d %18lu %18lu %14lu\n", iovcnt, heapNs, pooledNs,
+               timePreadv(fd, iovcnt));
+    }
+    ::close(fd);
+    Arachne::shutDown();
+}
+
+}  // namespace
+
+int
+main(int argc, const char** argv) {
+    Arachne::init(&argc, argv);
+    Arachne::createThread(runBenchmark);
+    Arachne::waitForTermination();
+    return 0;
+}
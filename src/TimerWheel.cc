@@ -0,0 +1,207 @@
+/* Copyright (c) 2021 Matthew Macy
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "TimerWheel.h"
+
+namespace Arachne {
+
+const int TimerWheel::LEVEL_BITS;
+const int TimerWheel::SLOTS_PER_LEVEL;
+const uint64_t TimerWheel::SLOT_MASK;
+const int TimerWheel::NUM_LEVELS;
+
+// Constructor
+TimerWheel::TimerWheel()
+    : currentTick(0), tickShift(0), numTimers(0), occupiedSlots(), overflow() {}
+
+/**
+ * Prepare this wheel for use by a core. Must only be invoked when the wheel
+ * holds no timers.
+ *
+ * \param now
+ *     The current value of the cycle counter.
+ * \param cyclesPerTick
+ *     The resolution of the wheel; rounded down to a power of two.
+ */
+void
+TimerWheel::reset(uint64_t now, uint64_t cyclesPerTick) {
+    tickShift = 0;
+    while ((2UL << tickShift) <= cyclesPerTick)
+        tickShift++;
+    currentTick = now >> tickShift;
+}
+
+/**
+ * Arm a timer whose context and deadline have already been filled in.
+ *
+ * \return
+ *     True if the timer was added. False means that the deadline has already
+ *     passed, and the caller should treat the timer as expired.
+ */
+bool
+TimerWheel::add(Timer* timer) {
+    uint64_t expiryTick =
+        (timer->deadline + (1UL << tickShift) - 1) >> tickShift;
+    if (expiryTick <= currentTick)
+        return false;
+    insert(timer);
+    return true;
+}
+
+/**
+ * Disarm a timer previously added to this wheel; the timer will not expire.
+ */
+void
+TimerWheel::cancel(Timer* timer) {
+    timer->unlink();
+    timer->wheel = NULL;
+    timer->deadline = 0;
+    numTimers--;
+    if (timer->level < NUM_LEVELS &&
+        slots[timer->level][timer->slot].empty())
+        occupiedSlots[timer->level] &= ~(1UL << timer->slot);
+}
+
+/**
+ * Slow path of advance(): walk the wheel up to targetTick. Empty stretches of
+ * the wheel are skipped using the occupancy masks, so the cost does not
+ * depend on how long it has been since the previous call.
+ */
+void
+TimerWheel::expire(uint64_t targetTick, ExpireHandler handler) {
+    while (currentTick < targetTick) {
+        if (numTimers == 0) {
+            currentTick = targetTick;
+            return;
+        }
+
+        uint64_t nextTick = nextEventTick();
+        if (nextTick > targetTick) {
+            currentTick = targetTick;
+            return;
+        }
+        currentTick = nextTick;
+
+        if ((currentTick & SLOT_MASK) == 0)
+            cascade(1);
+
+        uint8_t index = static_cast<uint8_t>(currentTick & SLOT_MASK);
+        intrusive_list<Timer>& expired = slots[0][index];
+        while (!expired.empty()) {
+            Timer* timer = &expired.front();
+            expired.pop_front();
+            timer->wheel = NULL;
+            timer->deadline = 0;
+            numTimers--;
+            handler(timer);
+        }
+        occupiedSlots[0] &= ~(1UL << index);
+    }
+}
+
+/**
+ * Return the cycle counter value at which advance() may next find an expired
+ * timer, or ~0 if the wheel is empty. This may be earlier than the earliest
+ * deadline when that deadline lies beyond the bottom level of the wheel.
+ */
+uint64_t
+TimerWheel::nextExpiry() const {
+    if (numTimers == 0)
+        return ~0UL;
+    return nextEventTick() << tickShift;
+}
+
+/**
+ * Find the next tick after currentTick at which a timer may expire or
+ * cascade. Must only be invoked when the wheel holds timers.
+ */
+uint64_t
+TimerWheel::nextEventTick() const {
+    uint64_t position = currentTick & SLOT_MASK;
+    uint64_t laterSlots =
+        position == SLOT_MASK ? 0
+                              : occupiedSlots[0] & (~0UL << (position + 1));
+    if (laterSlots)
+        return (currentTick & ~SLOT_MASK) + __builtin_ctzll(laterSlots);
+
+    int level = 1;
+    if (!occupiedSlots[0]) {
+        while (level < NUM_LEVELS && !occupiedSlots[level])
+            level++;
+    }
+    int shift = LEVEL_BITS * level;
+    return ((currentTick >> shift) + 1) << shift;
+}
+
+/**
+ * Link a timer into the slot covering its deadline, relative to currentTick.
+ * The deadline must not precede currentTick.
+ */
+void
+TimerWheel::insert(Timer* timer) {
+    uint64_t expiryTick =
+        (timer->deadline + (1UL << tickShift) - 1) >> tickShift;
+    uint64_t delta = expiryTick - currentTick;
+    numTimers++;
+    timer->wheel = this;
+    for (int level = 0; level < NUM_LEVELS; level++) {
+        if (delta < (1UL << (LEVEL_BITS * (level + 1)))) {
+            uint8_t index = static_cast<uint8_t>(
+                (expiryTick >> (LEVEL_BITS * level)) & SLOT_MASK);
+            timer->level = static_cast<uint8_t>(level);
+            timer->slot = index;
+            slots[level][index].push_back(*timer);
+            occupiedSlots[level] |= 1UL << index;
+            return;
+        }
+    }
+    timer->level = NUM_LEVELS;
+    timer->slot = 0;
+    overflow.push_back(*timer);
+}
+
+/**
+ * Redistribute the timers in the current slot of the given level into lower
+ * levels; invoked each time the level below wraps around. Higher levels are
+ * cascaded first, since they may feed the slot being cascaded.
+ */
+void
+TimerWheel::cascade(int level) {
+    intrusive_list<Timer>* source;
+    if (level == NUM_LEVELS) {
+        source = &overflow;
+    } else {
+        uint8_t index = static_cast<uint8_t>(
+            (currentTick >> (LEVEL_BITS * level)) & SLOT_MASK);
+        if (index == 0)
+            cascade(level + 1);
+        source = &slots[level][index];
+        occupiedSlots[level] &= ~(1UL << index);
+    }
+    intrusive_list<Timer> pending;
+    while (!source->empty()) {
+        Timer* timer = &source->front();
+        source->pop_front();
+        pending.push_back(*timer);
+    }
+    while (!pending.empty()) {
+        Timer* timer = &pending.front();
+        pending.pop_front();
+        numTimers--;
+        insert(timer);
+    }
+}
+
+}  // namespace Arachne
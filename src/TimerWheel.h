@@ -0,0 +1,149 @@
+/* Copyright (c) 2021 Matthew Macy
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ARACHNE_TIMERWHEEL_H_
+#define ARACHNE_TIMERWHEEL_H_
+
+#include <stdint.h>
+#include "intrusive_list.h"
+#include "utils.h"
+
+namespace Arachne {
+
+struct ThreadContext;
+class TimerWheel;
+
+/**
+ * A pending wakeup for an Arachne thread that is sleeping or waiting with a
+ * timeout. Each ThreadContext embeds exactly one Timer, since a thread can
+ * wait for at most one deadline at a time.
+ */
+struct Timer : public intrusive_list_base_hook<> {
+    Timer()
+        : context(NULL),
+          deadline(0),
+          wheel(NULL),
+          nextMigrated(NULL),
+          level(0),
+          slot(0) {}
+
+    /// The thread to make runnable when this timer expires.
+    ThreadContext* context;
+
+    /// Cycle counter value at or after which the thread may run again.
+    uint64_t deadline;
+
+    /// The wheel this timer is currently linked into, or NULL if the timer is
+    /// not armed or is in transit between cores after a migration.
+    TimerWheel* wheel;
+
+    /// Link used while this timer waits in a core's list of timers that were
+    /// migrated to it from other cores.
+    Timer* nextMigrated;
+
+    /// Position of this timer in its wheel; used to maintain the occupancy
+    /// masks when a timer is cancelled.
+    uint8_t level;
+    uint8_t slot;
+
+    /// A timer is armed from the time it is added to a wheel until it expires
+    /// or is cancelled; deadline is zero whenever it is not armed.
+    bool armed() const { return deadline != 0; }
+
+    DISALLOW_COPY_AND_ASSIGN(Timer);
+};
+
+/**
+ * A hierarchical timing wheel holding the timers of all threads on a single
+ * core. Arming and cancelling a timer are O(1), and advancing the wheel
+ * touches only the slots which contain expired timers, so the cost of
+ * dispatch() no longer grows with the number of sleeping threads.
+ *
+ * Each level has SLOTS_PER_LEVEL slots, and a slot at level i covers
+ * SLOTS_PER_LEVEL^i ticks. Timers further out than the top level can reach
+ * wait in an overflow list which is re-examined each time the top level
+ * wraps. Timers never fire early; they may fire up to one tick late.
+ *
+ * This class is not thread-safe; it must only be accessed by the kernel
+ * thread which owns the enclosing Core.
+ */
+class TimerWheel {
+  public:
+    /// Invoked for each timer as it expires.
+    typedef void (*ExpireHandler)(Timer* timer);
+
+    TimerWheel();
+    void reset(uint64_t now, uint64_t cyclesPerTick);
+    bool add(Timer* timer);
+    void cancel(Timer* timer);
+
+    /**
+     * Hand every timer whose deadline is at or before now to handler,
+     * removing it from the wheel. This is invoked on every pass through
+     * dispatch(), so the common case of an empty wheel is kept inline.
+     *
+     * \param now
+     *     The current value of the cycle counter.
+     * \param handler
+     *     Invoked once for each expired timer, after it has been disarmed.
+     */
+    void advance(uint64_t now, ExpireHandler handler) {
+        if (numTimers == 0) {
+            currentTick = now >> tickShift;
+            return;
+        }
+        expire(now >> tickShift, handler);
+    }
+
+    uint64_t nextExpiry() const;
+
+    /// Return the number of timers currently armed in this wheel.
+    uint32_t size() const { return numTimers; }
+
+    static const int LEVEL_BITS = 6;
+    static const int SLOTS_PER_LEVEL = 1 << LEVEL_BITS;
+    static const uint64_t SLOT_MASK = SLOTS_PER_LEVEL - 1;
+    static const int NUM_LEVELS = 4;
+
+  private:
+    void expire(uint64_t targetTick, ExpireHandler handler);
+    uint64_t nextEventTick() const;
+    void insert(Timer* timer);
+    void cascade(int level);
+
+    /// The last tick whose expired timers have been handed out. Timers which
+    /// expire at or before this tick are never added to the wheel.
+    uint64_t currentTick;
+
+    /// log2 of the number of cycles in one tick.
+    int tickShift;
+
+    /// Number of timers linked into slots or the overflow list.
+    uint32_t numTimers;
+
+    /// Bit j of occupiedSlots[i] is set when slots[i][j] is nonempty.
+    uint64_t occupiedSlots[NUM_LEVELS];
+
+    intrusive_list<Timer> slots[NUM_LEVELS][SLOTS_PER_LEVEL];
+
+    /// Timers which expire beyond the range of the top level.
+    intrusive_list<Timer> overflow;
+
+    DISALLOW_COPY_AND_ASSIGN(TimerWheel);
+};
+
+}  // namespace Arachne
+
+#endif  // ARACHNE_TIMERWHEEL_H_
@@ -0,0 +1,148 @@
+/* Copyright (c) 2021 Matthew Macy
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <vector>
+#include "gtest/gtest.h"
+
+#define private public
+#include "TimerWheel.h"
+#undef private
+
+namespace Arachne {
+
+static std::vector<Timer*> expired;
+
+static void
+recordExpiry(Timer* timer) {
+    expired.push_back(timer);
+}
+
+struct TimerWheelTest : public ::testing::Test {
+    virtual void SetUp() {
+        expired.clear();
+        wheel.reset(/*now=*/1000, /*cyclesPerTick=*/1);
+    }
+
+    TimerWheel wheel;
+};
+
+TEST_F(TimerWheelTest, TimerWheel_reset) {
+    wheel.reset(1024, 100);
+    EXPECT_EQ(6, wheel.tickShift);
+    EXPECT_EQ(16U, wheel.currentTick);
+}
+
+TEST_F(TimerWheelTest, TimerWheel_addExpired) {
+    Timer timer;
+    timer.deadline = 1000;
+    EXPECT_FALSE(wheel.add(&timer));
+    EXPECT_EQ(0U, wheel.size());
+}
+
+TEST_F(TimerWheelTest, TimerWheel_advance) {
+    Timer first, second;
+    first.deadline = 1010;
+    second.deadline = 1020;
+    EXPECT_TRUE(wheel.add(&first));
+    EXPECT_TRUE(wheel.add(&second));
+    EXPECT_EQ(2U, wheel.size());
+
+    wheel.advance(1009, recordExpiry);
+    EXPECT_TRUE(expired.empty());
+    wheel.advance(1015, recordExpiry);
+    ASSERT_EQ(1U, expired.size());
+    EXPECT_EQ(&first, expired[0]);
+    EXPECT_FALSE(first.armed());
+    EXPECT_EQ(NULL, first.wheel);
+    wheel.advance(1020, recordExpiry);
+    ASSERT_EQ(2U, expired.size());
+    EXPECT_EQ(&second, expired[1]);
+    EXPECT_EQ(0U, wheel.size());
+    EXPECT_EQ(0U, wheel.occupiedSlots[0]);
+}
+
+TEST_F(TimerWheelTest, TimerWheel_cancel) {
+    Timer timer;
+    timer.deadline = 1010;
+    wheel.add(&timer);
+    wheel.cancel(&timer);
+    EXPECT_FALSE(timer.armed());
+    EXPECT_EQ(0U, wheel.size());
+    EXPECT_EQ(0U, wheel.occupiedSlots[0]);
+    wheel.advance(2000, recordExpiry);
+    EXPECT_TRUE(expired.empty());
+}
+
+TEST_F(TimerWheelTest, TimerWheel_cascade) {
+    Timer near, middle, far;
+    near.deadline = 1000 + 70;
+    middle.deadline = 1000 + 5000;
+    far.deadline = 1000 + (1UL << 30);
+    wheel.add(&near);
+    wheel.add(&middle);
+    wheel.add(&far);
+    EXPECT_EQ(1, near.level);
+    EXPECT_EQ(2, middle.level);
+    EXPECT_EQ(TimerWheel::NUM_LEVELS, far.level);
+
+    wheel.advance(1000 + 69, recordExpiry);
+    EXPECT_TRUE(expired.empty());
+    wheel.advance(1000 + 70, recordExpiry);
+    ASSERT_EQ(1U, expired.size());
+    EXPECT_EQ(&near, expired[0]);
+
+    wheel.advance(1000 + 4999, recordExpiry);
+    EXPECT_EQ(1U, expired.size());
+    wheel.advance(1000 + 5000, recordExpiry);
+    ASSERT_EQ(2U, expired.size());
+    EXPECT_EQ(&middle, expired[1]);
+
+    wheel.advance(1000 + (1UL << 30) - 1, recordExpiry);
+    EXPECT_EQ(2U, expired.size());
+    wheel.advance(1000 + (1UL << 30), recordExpiry);
+    ASSERT_EQ(3U, expired.size());
+    EXPECT_EQ(&far, expired[2]);
+    EXPECT_EQ(0U, wheel.size());
+}
+
+TEST_F(TimerWheelTest, TimerWheel_nextExpiry) {
+    EXPECT_EQ(~0UL, wheel.nextExpiry());
+    Timer near, far;
+    near.deadline = 1010;
+    far.deadline = 1000 + 5000;
+    wheel.add(&far);
+    // Timers beyond the bottom level report when they next cascade.
+    EXPECT_EQ(4096UL, wheel.nextExpiry());
+    wheel.add(&near);
+    EXPECT_EQ(1010UL, wheel.nextExpiry());
+    wheel.cancel(&near);
+    wheel.cancel(&far);
+    EXPECT_EQ(~0UL, wheel.nextExpiry());
+}
+
+TEST_F(TimerWheelTest, TimerWheel_resolution) {
+    // Timers never fire before their deadline, even when it falls within a
+    // tick.
+    wheel.reset(0, 64);
+    Timer timer;
+    timer.deadline = 100;
+    wheel.add(&timer);
+    wheel.advance(99, recordExpiry);
+    EXPECT_TRUE(expired.empty());
+    wheel.advance(128, recordExpiry);
+    EXPECT_EQ(1U, expired.size());
+}
+
+}  // namespace Arachne
@@ -1,10 +1,1238 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
 #include "fiber_syscall.h"
 #include "Arachne.h"
 
 namespace Arachne {
 
+syscall_wait_request *
+alloc_syscall_request(ThreadContext *context, uint32_t generation)
+{
+    syscall_wait_request *request = core.free_syscall_requests;
+
+    if (request == nullptr) {
+        request = core.remote_syscall_requests.exchange(nullptr, std::memory_order_acquire);
+    }
+    if (request == nullptr) {
+        size_t chunk_size = sizeof(syscall_wait_request) * SYSCALL_REQUESTS_PER_CHUNK;
+        char *chunk = static_cast<char *>(alignedAlloc(chunk_size));
+
+        core.syscall_request_chunks.push_back(chunk);
+        for (int i = 0; i < SYSCALL_REQUESTS_PER_CHUNK; i++) {
+            auto free_request = reinterpret_cast<syscall_wait_request *>(chunk) + i;
+            free_request->next_free = request;
+            request = free_request;
+        }
+    }
+    core.free_syscall_requests = request->next_free;
+    request = new (request) syscall_wait_request(context, generation);
+    request->owner = std::addressof(core);
+    return request;
+}
+
+void
+free_syscall_request(syscall_wait_request *request)
+{
+    Core *owner = request->owner;
+
+    if (request->ext_arg) {
+        free(request->ext_arg);
+    }
+    request->~syscall_wait_request();
+    if (owner == std::addressof(core)) {
+        request->next_free = core.free_syscall_requests;
+        core.free_syscall_requests = request;
+    } else {
+        auto &remote_requests = owner->remote_syscall_requests;
+        request->next_free = remote_requests.load(std::memory_order_relaxed);
+        while (!remote_requests.compare_exchange_weak(request->next_free, request,
+                                                      std::memory_order_release)) {
+            continue;
+        }
+    }
+}
+
+/*
+ * Copy the caller's iovecs into the request, which must outlive the
+ * caller's array until the kernel has read it, and return the copy.
+ */
+static struct iovec *
+copy_iovecs(syscall_wait_request *request, const struct iovec *iovin, int iovcnt)
+{
+    struct iovec *iovp = &request->iov[0];
+
+    if (iovcnt > SYSCALL_INLINE_IOVECS) {
+        request->ext_arg = malloc(sizeof(*iovin)*iovcnt);
+        iovp = static_cast<struct iovec *>(request->ext_arg);
+    }
+    memcpy(iovp, iovin, sizeof(*iovin)*iovcnt);
+    return iovp;
+}
+
+void
+flush_submissions()
+{
+    uint32_t backlog = core.sys_io_ring_backlog.load(std::memory_order_relaxed);
+
+    if (backlog == 0) {
+        return;
+    }
+    int rc = io_uring_submit(std::addressof(core.sys_io_ring));
+    if (rc <= 0) {
+        /* The SQEs stay in the ring, and in the backlog, so that the next
+         * pass submits them again. */
+        if (rc < 0 && rc != -EBUSY && rc != -EAGAIN && rc != -EINTR) {
+            ARACHNE_LOG(WARNING, "io_uring_submit failed: %s", strerror(-rc));
+        }
+        return;
+    }
+    uint32_t submitted = std::min(static_cast<uint32_t>(rc), backlog);
+    core.sys_io_ring_backlog.store(backlog - submitted, std::memory_order_relaxed);
+    PerfStats::threadStats->numSubmissionBatches++;
+    PerfStats::threadStats->numSubmittedRequests += submitted;
+}
+
+/*
+ * Return a free SQE of this core's ring. If the ring is full, submit what
+ * is queued and let other threads run until an SQE frees up.
+ */
+static struct io_uring_sqe *
+get_sqe()
+{
+    struct io_uring_sqe *sqe;
+
+    while ((sqe = io_uring_get_sqe(std::addressof(core.sys_io_ring))) == nullptr) {
+        flush_submissions();
+        yield();
+    }
+    return sqe;
+}
+
+/*
+ * Count a newly prepared SQE into the core's backlog, leaving it for
+ * flush_submissions() unless the backlog has reached submitBatchSize.
+ */
+static void
+queue_submission()
+{
+    uint32_t backlog = core.sys_io_ring_backlog.load(std::memory_order_relaxed);
+
+    if (backlog == 0) {
+        core.sys_io_ring_backlog_since = Cycles::rdtsc();
+    }
+    backlog++;
+    core.sys_io_ring_backlog.store(backlog, std::memory_order_relaxed);
+    if (backlog >= submitBatchSize) {
+        flush_submissions();
+    }
+}
+
+/*
+ * Protects the tables and the pool below.
+ */
+static SpinLock registration_lock("registration_lock", false);
+
+/*
+ * The registered file table, shared by all per-core rings; empty slots
+ * hold -1.
+ */
+static std::vector<int> registered_files;
+
+/*
+ * The registered buffer table, shared by all per-core rings.
+ */
+static std::vector<struct iovec> registered_buffers;
+
+/*
+ * Incremented whenever the corresponding table changes, so that each core
+ * can tell whether its ring has registered the latest version.
+ */
+static std::atomic<uint64_t> files_generation(0);
+static std::atomic<uint64_t> buffers_generation(0);
+std::atomic<uint64_t> registrations_generation(0);
+
+/*
+ * The buffers of the pool, and those not yet handed to any core.
+ */
+static registered_buffer *pool_buffers;
+static unsigned pool_count;
+static registered_buffer *unclaimed_buffers;
+
+/*
+ * Bring the registered files and buffers of this core's ring up to date.
+ */
+void
+update_registrations()
+{
+    struct io_uring *ring = std::addressof(core.sys_io_ring);
+    uint64_t seen = registrations_generation.load(std::memory_order_acquire);
+    uint64_t generation = files_generation.load(std::memory_order_acquire);
+
+    if (core.registered_files_generation != generation) {
+        std::vector<int> files;
+        {
+            std::lock_guard<SpinLock> _(registration_lock);
+            generation = files_generation.load(std::memory_order_relaxed);
+            files = registered_files;
+        }
+        int rc;
+        if (core.registered_files_generation == 0) {
+            rc = io_uring_register_files(ring, files.data(), files.size());
+        } else {
+            rc = io_uring_register_files_update(ring, 0, files.data(), files.size());
+        }
+        if (rc < 0) {
+            ARACHNE_LOG(ERROR, "Failed to register files: %s", strerror(-rc));
+        } else {
+            core.registered_files_generation = generation;
+        }
+    }
+
+    generation = buffers_generation.load(std::memory_order_acquire);
+    if (core.registered_buffers_generation != generation) {
+        std::vector<struct iovec> buffers;
+        {
+            std::lock_guard<SpinLock> _(registration_lock);
+            generation = buffers_generation.load(std::memory_order_relaxed);
+            buffers = registered_buffers;
+        }
+        if (core.registered_buffers_generation != 0) {
+            io_uring_unregister_buffers(ring);
+            core.registered_buffers_generation = 0;
+        }
+        int rc = 0;
+        if (!buffers.empty()) {
+            rc = io_uring_register_buffers(ring, buffers.data(), buffers.size());
+        }
+        if (rc < 0) {
+            ARACHNE_LOG(ERROR, "Failed to register buffers: %s", strerror(-rc));
+        } else {
+            core.registered_buffers_generation = generation;
+        }
+    }
+    /* A failure was logged above; the next fixed operation retries. */
+    core.registrations_seen.store(seen, std::memory_order_release);
+}
+
+void
+drop_registrations()
+{
+    struct io_uring *ring = std::addressof(core.sys_io_ring);
+
+    if (core.registered_files_generation != 0) {
+        io_uring_unregister_files(ring);
+        core.registered_files_generation = 0;
+    }
+    if (core.registered_buffers_generation != 0) {
+        io_uring_unregister_buffers(ring);
+        core.registered_buffers_generation = 0;
+    }
+    core.registrations_seen.store(UINT64_MAX, std::memory_order_release);
+}
+
+/*
+ * Bring the ring of the calling thread's core up to date, and return that
+ * core, or nullptr for a kernel thread that is not an Arachne core. Kept out
+ * of line so that it reads the thread-local core afresh after a yield().
+ */
+static Core * __attribute__((noinline))
+catch_up_registrations()
+{
+    if (core.loadedContext == NULL) {
+        return nullptr;
+    }
+    if (core.registrations_seen.load(std::memory_order_acquire) <
+        registrations_generation.load(std::memory_order_acquire)) {
+        update_registrations();
+    }
+    return std::addressof(core);
+}
+
+/*
+ * Return once the ring of every active core has applied the tables as of
+ * the given registrations_generation. Parked cores are woken to do so, and
+ * idled cores, which catch up when they are unidled, are skipped.
+ *
+ * The caller's own ring is brought up to date on every pass: yield() returns
+ * at once when the caller is alone on its core, so nothing else would, and
+ * a concurrent registration on another core may be waiting for it.
+ */
+static void
+wait_for_registrations(uint64_t generation)
+{
+    for (Core *c : coreMap) {
+        if (c == nullptr) {
+            continue;
+        }
+        while (c->registrations_seen.load(std::memory_order_acquire) < generation) {
+            Core *self = catch_up_registrations();
+            if (c == self || c->idled.load()) {
+                break;
+            }
+            if (c->parked.load()) {
+                unparkCore(c);
+            }
+            yield();
+        }
+    }
+    catch_up_registrations();
+}
+
+int
+register_files(const int *fds, unsigned nr)
+{
+    std::vector<int> dups(nr);
+
+    for (unsigned i = 0; i < nr; i++) {
+        dups[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, 0);
+        if (dups[i] < 0) {
+            int rc = -errno;
+            while (i > 0) {
+                ::close(dups[--i]);
+            }
+            return rc;
+        }
+    }
+    int first = -ENFILE;
+    uint64_t generation = 0;
+    {
+        std::lock_guard<SpinLock> _(registration_lock);
+        if (registered_files.empty()) {
+            registered_files.assign(MAX_REGISTERED_FILES, -1);
+        }
+        unsigned run = 0;
+        for (int slot = 0; slot < MAX_REGISTERED_FILES && nr > 0; slot++) {
+            run = registered_files[slot] == -1 ? run + 1 : 0;
+            if (run == nr) {
+                first = slot + 1 - nr;
+                memcpy(&registered_files[first], dups.data(), sizeof(*fds) * nr);
+                files_generation++;
+                generation = ++registrations_generation;
+                break;
+            }
+        }
+    }
+    if (first < 0) {
+        for (int fd : dups) {
+            ::close(fd);
+        }
+        return first;
+    }
+    wait_for_registrations(generation);
+    return first;
+}
+
+int
+unregister_files(int slot, unsigned nr)
+{
+    std::vector<int> dups;
+    uint64_t generation;
+    {
+        std::lock_guard<SpinLock> _(registration_lock);
+        if (slot < 0 || slot + nr > registered_files.size()) {
+            return -EINVAL;
+        }
+        for (unsigned i = 0; i < nr; i++) {
+            if (registered_files[slot + i] != -1) {
+                dups.push_back(registered_files[slot + i]);
+            }
+            registered_files[slot + i] = -1;
+        }
+        files_generation++;
+        generation = ++registrations_generation;
+    }
+    wait_for_registrations(generation);
+    for (int fd : dups) {
+        ::close(fd);
+    }
+    return 0;
+}
+
+int
+register_buffers(const struct iovec *iovs, unsigned nr)
+{
+    uint64_t generation;
+    int first = -1;
+    {
+        std::lock_guard<SpinLock> _(registration_lock);
+        /* Slots without memory are free. */
+        unsigned run = 0;
+        for (size_t slot = 0; slot < registered_buffers.size() && nr > 0; slot++) {
+            run = registered_buffers[slot].iov_base == nullptr ? run + 1 : 0;
+            if (run == nr) {
+                first = slot + 1 - nr;
+                break;
+            }
+        }
+        if (first < 0) {
+            if (registered_buffers.size() + nr > MAX_REGISTERED_BUFFERS) {
+                return -ENOBUFS;
+            }
+            first = registered_buffers.size();
+            registered_buffers.resize(first + nr);
+        }
+        std::copy(iovs, iovs + nr, registered_buffers.begin() + first);
+        buffers_generation++;
+        generation = ++registrations_generation;
+    }
+    wait_for_registrations(generation);
+    return first;
+}
+
+int
+unregister_buffers(int index, unsigned nr)
+{
+    uint64_t generation;
+    {
+        std::lock_guard<SpinLock> _(registration_lock);
+        if (index < 0 || index + nr > registered_buffers.size()) {
+            return -EINVAL;
+        }
+        if (pool_buffers != nullptr && index < pool_buffers[0].index + static_cast<int>(pool_count) &&
+            index + static_cast<int>(nr) > pool_buffers[0].index) {
+            return -EBUSY;
+        }
+        for (unsigned i = 0; i < nr; i++) {
+            registered_buffers[index + i] = {nullptr, 0};
+        }
+        while (!registered_buffers.empty() && registered_buffers.back().iov_base == nullptr) {
+            registered_buffers.pop_back();
+        }
+        buffers_generation++;
+        generation = ++registrations_generation;
+    }
+    wait_for_registrations(generation);
+    return 0;
+}
+
+int
+create_registered_buffer_pool(size_t buffer_size, unsigned count)
+{
+    if (buffer_size == 0 || buffer_size > UINT32_MAX || count == 0) {
+        return -EINVAL;
+    }
+    std::vector<struct iovec> iovs(count);
+    registered_buffer *buffers = new registered_buffer[count];
+    char *memory = static_cast<char *>(alignedAlloc(buffer_size * count, PAGE_SIZE));
+
+    for (unsigned i = 0; i < count; i++) {
+        iovs[i].iov_base = memory + i * buffer_size;
+        iovs[i].iov_len = buffer_size;
+    }
+    int rc = 0;
+    uint64_t generation = 0;
+    {
+        std::lock_guard<SpinLock> _(registration_lock);
+        if (pool_buffers != nullptr) {
+            rc = -EBUSY;
+        } else if (registered_buffers.size() + count > MAX_REGISTERED_BUFFERS) {
+            rc = -ENOBUFS;
+        } else {
+            pool_buffers = buffers;
+            pool_count = count;
+            for (unsigned i = 0; i < count; i++) {
+                buffers[i].base = iovs[i].iov_base;
+                buffers[i].len = buffer_size;
+                buffers[i].index = registered_buffers.size() + i;
+                buffers[i].owner = nullptr;
+                buffers[i].next = i + 1 < count ? &buffers[i + 1] : nullptr;
+            }
+            unclaimed_buffers = buffers;
+            registered_buffers.insert(registered_buffers.end(), iovs.begin(), iovs.end());
+            buffers_generation++;
+            generation = ++registrations_generation;
+        }
+    }
+    if (rc == 0) {
+        wait_for_registrations(generation);
+        return 0;
+    }
+    delete[] buffers;
+    free(memory);
+    return rc;
+}
+
+registered_buffer *
+borrow_registered_buffer()
+{
+    registered_buffer *buffer = core.free_registered_buffers;
+
+    if (buffer == nullptr) {
+        buffer = core.remote_registered_buffers.exchange(nullptr, std::memory_order_acquire);
+    }
+    if (buffer == nullptr) {
+        std::lock_guard<SpinLock> _(registration_lock);
+        for (int i = 0; i < REGISTERED_BUFFER_BATCH && unclaimed_buffers; i++) {
+            registered_buffer *claimed = unclaimed_buffers;
+            unclaimed_buffers = claimed->next;
+            claimed->owner = std::addressof(core);
+            claimed->next = buffer;
+            buffer = claimed;
+        }
+    }
+    if (buffer != nullptr) {
+        core.free_registered_buffers = buffer->next;
+    }
+    return buffer;
+}
+
+void
+return_registered_buffer(registered_buffer *buffer)
+{
+    Core *owner = buffer->owner;
+
+    if (owner == std::addressof(core)) {
+        buffer->next = core.free_registered_buffers;
+        core.free_registered_buffers = buffer;
+    } else {
+        auto &remote_buffers = owner->remote_registered_buffers;
+        buffer->next = remote_buffers.load(std::memory_order_relaxed);
+        while (!remote_buffers.compare_exchange_weak(buffer->next, buffer,
+                                                     std::memory_order_release)) {
+            continue;
+        }
+    }
+}
+
+/*
+ * The size and number of the buffers in each core's provided buffer ring;
+ * see setup_recv_buffers().
+ */
+static size_t recv_buffer_size;
+static unsigned recv_buffer_count;
+
+/*
+ * A multishot recv. Its owner is the core whose ring serves it; completions
+ * queue the buffers they fill on the stream, linked through the
+ * recv_buffer_next array of the owner, until a thread takes them with
+ * recv_multishot().
+ */
+struct recv_stream : public syscall_wait_request {
+    DISALLOW_COPY_AND_ASSIGN(recv_stream);
+    recv_stream(ThreadContext *context, uint32_t generation, int sockfd, int flags) :
+        syscall_wait_request(context, generation),
+        lock("recv_stream", false),
+        head(-1),
+        tail(-1),
+        armed(false),
+        starved(false),
+        waiting(false),
+        final_result(0),
+        recv_flags(flags)
+        {
+            this->fd = sockfd;
+        }
+
+    /* Protects the fields below, since the thread using the stream may
+     * have migrated away from the core whose ring serves it. */
+    SpinLock lock;
+    /* The oldest and newest buffers not yet taken; -1 if none. */
+    int32_t head;
+    int32_t tail;
+    /* True while the multishot recv is in the owner core's ring, or
+     * starved. */
+    bool armed;
+    /* True while the stream is on the owner's starved_recv_streams. */
+    bool starved;
+    /* True while tid waits in recv_multishot() for a completion. */
+    bool waiting;
+    /* The result of the completion that ended the recv. */
+    int final_result;
+    int recv_flags;
+};
+
+int
+setup_recv_buffers(size_t buffer_size, unsigned count)
+{
+    if (recv_buffer_count != 0) {
+        return -EBUSY;
+    }
+    if (buffer_size == 0 || buffer_size > UINT32_MAX || count == 0 ||
+        count > 32768 || (count & (count - 1)) != 0) {
+        return -EINVAL;
+    }
+    recv_buffer_size = buffer_size;
+    recv_buffer_count = count;
+    return 0;
+}
+
+/*
+ * Set up this core's provided buffer ring if it has none yet.
+ */
 static int
-cancel_syscall(syscall_wait_request *req, uint64_t wakeup_time)
+ensure_recv_buffers()
+{
+    if (likely(core.recv_buf_ring != nullptr)) {
+        return 0;
+    }
+    if (recv_buffer_count == 0) {
+        return -EINVAL;
+    }
+    if (core.recv_buffers == nullptr) {
+        core.recv_buffers = static_cast<char *>(alignedAlloc(recv_buffer_size * recv_buffer_count, PAGE_SIZE));
+        core.recv_buffer_len = new uint32_t[recv_buffer_count];
+        core.recv_buffer_next = new int32_t[recv_buffer_count];
+        core.recv_buffer_out = new bool[recv_buffer_count]();
+    }
+    int rc;
+    struct io_uring_buf_ring *br = io_uring_setup_buf_ring(std::addressof(core.sys_io_ring),
+                                                           recv_buffer_count, RECV_BUFFER_GROUP, 0, &rc);
+    if (br == nullptr) {
+        return rc;
+    }
+    /* Buffers still out from a previous ring join this one when they are
+     * given back. */
+    int mask = io_uring_buf_ring_mask(recv_buffer_count);
+    unsigned added = 0;
+    for (unsigned bid = 0; bid < recv_buffer_count; bid++) {
+        if (!core.recv_buffer_out[bid]) {
+            io_uring_buf_ring_add(br, core.recv_buffers + bid * recv_buffer_size,
+                                  recv_buffer_size, bid, mask, added++);
+        }
+    }
+    io_uring_buf_ring_advance(br, added);
+    core.recv_buffers_in_ring = added;
+    core.recv_buf_ring = br;
+    return 0;
+}
+
+void
+release_recv_buf_ring()
+{
+    if (core.recv_buf_ring == nullptr) {
+        return;
+    }
+    io_uring_free_buf_ring(std::addressof(core.sys_io_ring), core.recv_buf_ring,
+                           recv_buffer_count, RECV_BUFFER_GROUP);
+    core.recv_buf_ring = nullptr;
+    core.recv_buffers_in_ring = 0;
+}
+
+void
+free_recv_buffers()
+{
+    release_recv_buf_ring();
+    free(core.recv_buffers);
+    delete[] core.recv_buffer_len;
+    delete[] core.recv_buffer_next;
+    delete[] core.recv_buffer_out;
+    core.recv_buffers = nullptr;
+    core.recv_buffer_len = nullptr;
+    core.recv_buffer_next = nullptr;
+    core.recv_buffer_out = nullptr;
+    core.remote_recv_buffers = -1;
+}
+
+/*
+ * Queue the stream's multishot recv on this core's ring, in the given SQE.
+ */
+static void
+queue_recv_stream(recv_stream *stream, struct io_uring_sqe *sqe)
+{
+    io_uring_prep_recv_multishot(sqe, stream->fd, nullptr, 0, stream->recv_flags);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_BUFFER_GROUP;
+    io_uring_sqe_set_data(sqe, stream);
+    core.pending_requests.push_back(*stream);
+    queue_submission();
+}
+
+/*
+ * Queue the stream's multishot recv on this core's ring.
+ */
+static void
+submit_recv_stream(recv_stream *stream)
+{
+    queue_recv_stream(stream, get_sqe());
+}
+
+/*
+ * Rearm the streams that ran out of buffers, now that the buffer ring holds
+ * some again. This also runs in dispatch() through check_for_completions(),
+ * so it must not yield: a stream that finds no free SQE stays starved, and
+ * check_for_completions() retries it on its next pass.
+ */
+static void
+rearm_starved_recv_streams()
+{
+    while (!core.starved_recv_streams.empty() && core.recv_buffers_in_ring > 0) {
+        struct io_uring_sqe *sqe = io_uring_get_sqe(std::addressof(core.sys_io_ring));
+        if (sqe == nullptr) {
+            return;
+        }
+        recv_stream *stream = static_cast<recv_stream *>(&core.starved_recv_streams.front());
+        core.starved_recv_streams.pop_front();
+        stream->starved = false;
+        queue_recv_stream(stream, sqe);
+    }
+}
+
+/*
+ * Put a buffer of this core back in its provided buffer ring.
+ */
+static void
+recycle_recv_buffer(int32_t bid)
+{
+    core.recv_buffer_out[bid] = false;
+    if (core.recv_buf_ring == nullptr) {
+        return;
+    }
+    io_uring_buf_ring_add(core.recv_buf_ring, core.recv_buffers + bid * recv_buffer_size,
+                          recv_buffer_size, bid, io_uring_buf_ring_mask(recv_buffer_count), 0);
+    io_uring_buf_ring_advance(core.recv_buf_ring, 1);
+    core.recv_buffers_in_ring++;
+    if (unlikely(!core.starved_recv_streams.empty())) {
+        rearm_starved_recv_streams();
+    }
+}
+
+/*
+ * Recycle the buffers that other cores gave back to this core.
+ */
+static void
+reclaim_remote_recv_buffers()
+{
+    int32_t bid = core.remote_recv_buffers.exchange(-1, std::memory_order_acquire);
+
+    while (bid != -1) {
+        int32_t next = core.recv_buffer_next[bid];
+        recycle_recv_buffer(bid);
+        bid = next;
+    }
+}
+
+void
+return_recv_buffer(const recv_buffer &buffer)
+{
+    Core *owner = buffer.owner;
+
+    if (owner == std::addressof(core)) {
+        recycle_recv_buffer(buffer.bid);
+    } else {
+        int32_t head = owner->remote_recv_buffers.load(std::memory_order_relaxed);
+        do {
+            owner->recv_buffer_next[buffer.bid] = head;
+        } while (!owner->remote_recv_buffers.compare_exchange_weak(head, buffer.bid,
+                                                                   std::memory_order_release));
+    }
+}
+
+/*
+ * Submit the stream's multishot recv to this core's ring.
+ */
+static int
+arm_recv_stream(recv_stream *stream)
+{
+    int rc = ensure_recv_buffers();
+
+    if (rc < 0) {
+        return rc;
+    }
+    reclaim_remote_recv_buffers();
+    {
+        std::lock_guard<SpinLock> _(stream->lock);
+        stream->owner = std::addressof(core);
+        stream->armed = true;
+    }
+    submit_recv_stream(stream);
+    return 0;
+}
+
+/*
+ * Invoked by check_for_completions() on the core whose ring serves the
+ * stream, for each of its completions.
+ */
+static void
+complete_recv_stream(syscall_wait_request *request, int res, uint32_t flags)
+{
+    recv_stream *stream = static_cast<recv_stream *>(request);
+    std::lock_guard<SpinLock> _(stream->lock);
+
+    if (flags & IORING_CQE_F_BUFFER) {
+        int32_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        core.recv_buffer_len[bid] = res > 0 ? res : 0;
+        core.recv_buffer_next[bid] = -1;
+        core.recv_buffer_out[bid] = true;
+        core.recv_buffers_in_ring--;
+        if (stream->tail < 0) {
+            stream->head = bid;
+        } else {
+            core.recv_buffer_next[stream->tail] = bid;
+        }
+        stream->tail = bid;
+    }
+    if (!(flags & IORING_CQE_F_MORE)) {
+        stream->unlink();
+        if (res == -ENOBUFS && core.recv_buffers_in_ring == 0) {
+            /* Rearming now would only fail again, so leave it to
+             * recycle_recv_buffer() once a buffer is given back. */
+            stream->starved = true;
+            core.starved_recv_streams.push_back(*stream);
+            return;
+        }
+        /* The kernel may end a multishot recv that delivered data, for
+         * instance when the completion queue overflows; that one is simply
+         * rearmed, like one that ran out of buffers. */
+        stream->final_result = res > 0 ? -EAGAIN : res;
+        stream->armed = false;
+    }
+    if (stream->waiting) {
+        stream->waiting = false;
+        schedule(stream->tid);
+    }
+}
+
+int
+recv_multishot_start(int sockfd, int flags, recv_stream **stream)
+{
+    recv_stream *new_stream = new recv_stream(core.loadedContext, core.loadedContext->generation,
+                                              sockfd, flags);
+    new_stream->on_completion = complete_recv_stream;
+    int rc = arm_recv_stream(new_stream);
+
+    if (rc < 0) {
+        delete new_stream;
+        return rc;
+    }
+    *stream = new_stream;
+    return 0;
+}
+
+ssize_t
+recv_multishot(recv_stream *stream, recv_buffer *buffer, uint64_t timeout_ms)
+{
+    uint64_t wakeup_time = -1ULL;
+
+    if (timeout_ms != -1ULL) {
+        wakeup_time = Cycles::rdtsc() + Cycles::fromMilliseconds(std::max(timeout_ms, 1UL));
+    }
+    for (;;) {
+        bool rearm = false;
+        {
+            std::lock_guard<SpinLock> _(stream->lock);
+            if (stream->head >= 0) {
+                Core *owner = stream->owner;
+                int32_t bid = stream->head;
+                stream->head = owner->recv_buffer_next[bid];
+                if (stream->head < 0) {
+                    stream->tail = -1;
+                }
+                buffer->data = owner->recv_buffers + bid * recv_buffer_size;
+                buffer->len = owner->recv_buffer_len[bid];
+                buffer->bid = bid;
+                buffer->owner = owner;
+                return buffer->len;
+            }
+            if (!stream->armed) {
+                if (stream->final_result != -ENOBUFS && stream->final_result != -EAGAIN) {
+                    return stream->final_result;
+                }
+                rearm = true;
+            } else if (wakeup_time != -1ULL && Cycles::rdtsc() >= wakeup_time) {
+                return -ETIME;
+            } else {
+                stream->waiting = true;
+                stream->tid = ThreadId(core.loadedContext, core.loadedContext->generation);
+            }
+        }
+        if (rearm) {
+            int rc = arm_recv_stream(stream);
+            if (rc < 0) {
+                return rc;
+            }
+            continue;
+        }
+        if (wakeup_time != -1ULL) {
+            armTimer(wakeup_time);
+        }
+        dispatch();
+        std::lock_guard<SpinLock> _(stream->lock);
+        stream->waiting = false;
+    }
+}
+
+/*
+ * Cancel a multishot request from the core whose ring holds it.
+ */
+static void
+cancel_multishot(syscall_wait_request *request)
+{
+    syscall_wait_request cancel_request(core.loadedContext, core.loadedContext->generation);
+    struct io_uring_sqe *sqe = get_sqe();
+
+    cancel_request.opcode = IORING_OP_ASYNC_CANCEL;
+    cancel_request.refcount_local = 1;
+    io_uring_prep_cancel(sqe, request, 0);
+    io_uring_sqe_set_data(sqe, &cancel_request);
+    core.pending_requests.push_back(cancel_request);
+    queue_submission();
+    while (cancel_request.result == INCOMPLETE_REQUEST) {
+        dispatch();
+    }
+    cancel_request.unlink();
+}
+
+/*
+ * Cancel the stream's recv from the core whose ring serves it. A starved
+ * stream has no recv in the ring, so it simply ends.
+ */
+static void
+cancel_recv_stream(recv_stream *stream)
+{
+    if (!stream->starved) {
+        cancel_multishot(stream);
+        return;
+    }
+    std::lock_guard<SpinLock> _(stream->lock);
+    stream->unlink();
+    stream->starved = false;
+    stream->final_result = -ECANCELED;
+    stream->armed = false;
+    if (stream->waiting) {
+        stream->waiting = false;
+        schedule(stream->tid);
+    }
+}
+
+void
+recv_multishot_stop(recv_stream *stream)
+{
+    bool cancel_sent = false;
+
+    for (;;) {
+        Core *owner;
+        {
+            std::lock_guard<SpinLock> _(stream->lock);
+            if (!stream->armed) {
+                break;
+            }
+            owner = stream->owner;
+            if (cancel_sent) {
+                stream->waiting = true;
+                stream->tid = ThreadId(core.loadedContext, core.loadedContext->generation);
+            }
+        }
+        if (cancel_sent) {
+            dispatch();
+        } else if (owner == std::addressof(core)) {
+            cancel_recv_stream(stream);
+            cancel_sent = true;
+        } else if (createThreadOnCore(owner->id, cancel_recv_stream, stream) != NullThread) {
+            cancel_sent = true;
+        } else {
+            yield();
+        }
+    }
+    recv_buffer buffer;
+    while (stream->head >= 0) {
+        recv_multishot(stream, &buffer, -1ULL);
+        return_recv_buffer(buffer);
+    }
+    delete stream;
+}
+
+/*
+ * One core's share of an acceptor: its listener and multishot accept.
+ * Completions queue accepted fds on the shard for its accept loop thread,
+ * which creates their handler threads.
+ */
+struct accept_shard : public syscall_wait_request {
+    DISALLOW_COPY_AND_ASSIGN(accept_shard);
+    accept_shard(ThreadContext *context, uint32_t generation, acceptor *parent,
+                 int listen_fd, int core_id) :
+        syscall_wait_request(context, generation),
+        lock("accept_shard", false),
+        parent(parent),
+        core_id(core_id),
+        armed(false),
+        waiting(false),
+        stopping(false),
+        end_result(0)
+        {
+            this->fd = listen_fd;
+        }
+
+    /* Protects the fields below. */
+    SpinLock lock;
+    acceptor *parent;
+    /* The core that the shard's connections are handled on. */
+    int core_id;
+    /* Accepted fds that have no handler thread yet. */
+    std::vector<int> accepted;
+    /* True while the multishot accept is in the owner core's ring. */
+    bool armed;
+    /* True while the accept loop waits for a completion. */
+    bool waiting;
+    /* True once stop_acceptor() has been called. */
+    bool stopping;
+    /* The result of the completion that last ended the multishot accept. */
+    int end_result;
+    /* The accept loop thread. */
+    ThreadId loop;
+};
+
+struct acceptor {
+    std::function<void(int)> handler;
+    std::vector<accept_shard *> shards;
+};
+
+/*
+ * Invoked by check_for_completions() for each completion of a shard's
+ * multishot accept.
+ */
+static void
+complete_accept(syscall_wait_request *request, int res, uint32_t flags)
+{
+    accept_shard *shard = static_cast<accept_shard *>(request);
+    std::lock_guard<SpinLock> _(shard->lock);
+
+    if (res >= 0) {
+        shard->accepted.push_back(res);
+    }
+    if (!(flags & IORING_CQE_F_MORE)) {
+        /* accept_loop() reports this, so that it can rate-limit it. */
+        shard->end_result = res;
+        shard->armed = false;
+        shard->unlink();
+    }
+    if (shard->waiting) {
+        shard->waiting = false;
+        schedule(shard->tid);
+    }
+}
+
+/*
+ * Submit the shard's multishot accept to this core's ring.
+ */
+static void
+arm_accept_shard(accept_shard *shard)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+
+    io_uring_prep_multishot_accept(sqe, shard->fd, nullptr, nullptr, SOCK_CLOEXEC);
+    io_uring_sqe_set_data(sqe, shard);
+    {
+        std::lock_guard<SpinLock> _(shard->lock);
+        shard->owner = std::addressof(core);
+        shard->armed = true;
+    }
+    core.pending_requests.push_back(*shard);
+    queue_submission();
+}
+
+/*
+ * Main function of the thread that serves a shard on its core: keep the
+ * multishot accept armed and create a handler thread for every accepted
+ * fd, until stop_acceptor() is called.
+ */
+static void
+accept_loop(accept_shard *shard)
+{
+    bool cancel_sent = false;
+    bool first = true;
+    /* Whether the current arm has accepted anything, and the number of
+     * arms in a row before it that accepted nothing. */
+    bool accepted_since_arm = false;
+    int failed_arms = 0;
+
+    for (;;) {
+        std::vector<int> accepted;
+        bool armed, stopping;
+        int end_result;
+        {
+            std::lock_guard<SpinLock> _(shard->lock);
+            accepted.swap(shard->accepted);
+            armed = shard->armed;
+            stopping = shard->stopping;
+            end_result = shard->end_result;
+            if (accepted.empty() && (armed || stopping)) {
+                shard->waiting = true;
+                shard->tid = ThreadId(core.loadedContext, core.loadedContext->generation);
+            }
+        }
+        if (!accepted.empty()) {
+            accepted_since_arm = true;
+        }
+        for (int fd : accepted) {
+            if (stopping) {
+                ::close(fd);
+                continue;
+            }
+            while (createThreadOnCore(shard->core_id, shard->parent->handler, fd) == NullThread) {
+                yield();
+            }
+        }
+        if (stopping && !armed) {
+            break;
+        }
+        if (stopping && !cancel_sent) {
+            if (shard->owner == std::addressof(core)) {
+                cancel_multishot(shard);
+                cancel_sent = true;
+            } else if (createThreadOnCore(shard->owner->id, cancel_multishot,
+                                          static_cast<syscall_wait_request *>(shard)) != NullThread) {
+                cancel_sent = true;
+            }
+            continue;
+        }
+        if (!armed && !stopping) {
+            // The accept ended, for instance because the process ran out of
+            // fds; give other threads a chance to close some first, backing
+            // off while rearming keeps failing.
+            if (!first) {
+                failed_arms = accepted_since_arm ? 0 : failed_arms + 1;
+                if (end_result < 0 && end_result != -ECANCELED &&
+                    (failed_arms & (failed_arms - 1)) == 0) {
+                    ARACHNE_LOG(WARNING, "Multishot accept on fd %d ended: %s",
+                                shard->fd, strerror(-end_result));
+                }
+                if (failed_arms == 0) {
+                    yield();
+                } else {
+                    uint64_t delay = ACCEPT_RETRY_MAX_NS;
+                    if (failed_arms <= 16) {
+                        delay = std::min(ACCEPT_RETRY_MIN_NS << (failed_arms - 1),
+                                         ACCEPT_RETRY_MAX_NS);
+                    }
+                    nanosleep(delay);
+                }
+            }
+            first = false;
+            accepted_since_arm = false;
+            arm_accept_shard(shard);
+            continue;
+        }
+        if (accepted.empty()) {
+            dispatch();
+            std::lock_guard<SpinLock> _(shard->lock);
+            shard->waiting = false;
+        }
+    }
+    ::close(shard->fd);
+}
+
+/*
+ * Create a listener bound to addr with SO_REUSEPORT; return its fd, or a
+ * negative errno.
+ */
+static int
+open_listener(const struct sockaddr *addr, socklen_t addrlen, int backlog)
+{
+    int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int one = 1;
+
+    if (fd < 0) {
+        return -errno;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+        bind(fd, addr, addrlen) != 0 || listen(fd, backlog) != 0) {
+        int rc = -errno;
+        ::close(fd);
+        return rc;
+    }
+    return fd;
+}
+
+int
+start_acceptor(const struct sockaddr *addr, socklen_t addrlen, int backlog,
+               const std::vector<int> &cores, std::function<void(int)> handler,
+               acceptor **out)
+{
+    struct sockaddr_storage bound;
+    acceptor *new_acceptor = new acceptor;
+    int rc = 0;
+
+    if (cores.empty() || addrlen > sizeof(bound)) {
+        delete new_acceptor;
+        return -EINVAL;
+    }
+    memcpy(&bound, addr, addrlen);
+    new_acceptor->handler = std::move(handler);
+    for (int core_id : cores) {
+        int fd = open_listener(reinterpret_cast<struct sockaddr *>(&bound), addrlen, backlog);
+        if (fd < 0) {
+            rc = fd;
+            break;
+        }
+        if (new_acceptor->shards.empty()) {
+            // Bind the remaining listeners to the port the kernel chose.
+            socklen_t len = sizeof(bound);
+            getsockname(fd, reinterpret_cast<struct sockaddr *>(&bound), &len);
+        }
+        new_acceptor->shards.push_back(new accept_shard(nullptr, 0, new_acceptor, fd, core_id));
+    }
+    for (size_t i = 0; rc == 0 && i < new_acceptor->shards.size(); i++) {
+        accept_shard *shard = new_acceptor->shards[i];
+        shard->loop = createThreadOnCore(shard->core_id, accept_loop, shard);
+        if (shard->loop == NullThread) {
+            rc = -EAGAIN;
+        }
+    }
+    if (rc < 0) {
+        stop_acceptor(new_acceptor);
+        return rc;
+    }
+    *out = new_acceptor;
+    return 0;
+}
+
+void
+stop_acceptor(acceptor *acceptor)
+{
+    for (accept_shard *shard : acceptor->shards) {
+        std::lock_guard<SpinLock> _(shard->lock);
+        shard->stopping = true;
+        if (shard->waiting) {
+            shard->waiting = false;
+            schedule(shard->tid);
+        }
+    }
+    for (accept_shard *shard : acceptor->shards) {
+        if (shard->loop != NullThread) {
+            join(shard->loop);
+        } else {
+            ::close(shard->fd);
+        }
+        delete shard;
+    }
+    delete acceptor;
+}
+
+/*
+ * Invoked by check_for_completions() for each completion of a zero-copy
+ * send. The kernel posts the result first and, if it pinned the caller's
+ * memory, flags it IORING_CQE_F_MORE and posts a notification once it no
+ * longer uses that memory; the request only completes then.
+ */
+static void
+complete_zero_copy(syscall_wait_request *request, int res, uint32_t flags)
+{
+    if (!(flags & IORING_CQE_F_NOTIF)) {
+        request->deferred_result = res;
+        if (flags & IORING_CQE_F_MORE) {
+            return;
+        }
+    }
+    request->result = request->deferred_result;
+    if (unlikely(request->cancelled)) {
+        free_syscall_request(request);
+        return;
+    }
+    (*request->refcount)--;
+    if (*request->refcount == 0) {
+        schedule(request->tid);
+    }
+}
+
+/*
+ * If wait is set, the request may still be using the caller's memory, so
+ * rather than leaving it to be freed when it completes, wait for it; if it
+ * managed to complete successfully, return its result.
+ */
+static int
+cancel_syscall(syscall_wait_request *req, uint64_t wakeup_time, bool wait = false)
 {
     struct io_uring_sqe *sqe;
     syscall_wait_request cancel_request(core.loadedContext, core.loadedContext->generation);
@@ -18,21 +1246,29 @@ cancel_syscall(syscall_wait_request *req, uint64_t wakeup_time)
     cancel_request.refcount_local = 1;
     cancel_request.refcount = &cancel_request.refcount_local;
 
-    while ((sqe = io_uring_get_sqe(std::addressof(core.sys_io_ring))) == nullptr) {
-        yield();
-    }
+    sqe = get_sqe();
 
     io_uring_prep_cancel(sqe, req, 0);
     io_uring_sqe_set_data(sqe, &cancel_request);
     core.pending_requests.push_back(cancel_request);
-    io_uring_submit(std::addressof(core.sys_io_ring));
+    queue_submission();
     dispatch();
+    if (wait) {
+        core.pending_requests.push_back(*req);
+        while (cancel_request.result == INCOMPLETE_REQUEST ||
+               req->result == INCOMPLETE_REQUEST) {
+            dispatch();
+        }
+        req->unlink();
+    }
     cancel_request.unlink();
     if (req->result != INCOMPLETE_REQUEST) {
-          if (req->ext_arg) {
-              free(req->ext_arg);
+          if (wait && req->result >= 0) {
+              int rc = req->result;
+              free_syscall_request(req);
+              return rc;
           }
-          delete req;
+          free_syscall_request(req);
     } else {
         req->cancelled = true;
     }
@@ -43,7 +1279,14 @@ cancel_syscall(syscall_wait_request *req, uint64_t wakeup_time)
     }
 }
 
-template<uint8_t opcode>
+/*
+ * sqe_flags are IOSQE_* flags for the request; with IOSQE_FIXED_FILE, fd is
+ * a slot in the registered file table. For IORING_OP_READ_FIXED and
+ * IORING_OP_WRITE_FIXED, flags is the index of the registered buffer. For
+ * IORING_OP_SEND_ZC with fixed_buffer, off is the index of the registered
+ * buffer that argptr points into.
+ */
+template<uint8_t opcode, uint8_t sqe_flags = 0, bool fixed_buffer = false>
 int
 uring_syscall(int fd, void *argptr, uint64_t argint,
               uint64_t off, int flags, uint64_t timeout_ms)
@@ -58,9 +1301,21 @@ uring_syscall(int fd, void *argptr, uint64_t argint,
                   opcode == IORING_OP_FSYNC || opcode == IORING_OP_SEND ||
                   opcode == IORING_OP_SENDMSG || opcode == IORING_OP_ACCEPT ||
                   opcode == IORING_OP_CONNECT || opcode == IORING_OP_CLOSE ||
-                  opcode == IORING_OP_POLL_ADD);
+                  opcode == IORING_OP_POLL_ADD || opcode == IORING_OP_RECV ||
+                  opcode == IORING_OP_RECVMSG || opcode == IORING_OP_READ_FIXED ||
+                  opcode == IORING_OP_WRITE_FIXED || opcode == IORING_OP_SEND_ZC ||
+                  opcode == IORING_OP_SENDMSG_ZC);
+    const bool zero_copy = opcode == IORING_OP_SEND_ZC || opcode == IORING_OP_SENDMSG_ZC;
     assert(core.id >= 0 && core.localOccupiedAndCount != nullptr);
 
+    if ((sqe_flags & IOSQE_FIXED_FILE) || opcode == IORING_OP_READ_FIXED ||
+        opcode == IORING_OP_WRITE_FIXED || fixed_buffer) {
+        if (unlikely(core.registered_files_generation != files_generation.load(std::memory_order_relaxed) ||
+                     core.registered_buffers_generation != buffers_generation.load(std::memory_order_relaxed))) {
+            update_registrations();
+        }
+    }
+
     switch (opcode) {
         case IORING_OP_WRITEV:
         case IORING_OP_READV:
@@ -69,10 +1324,8 @@ uring_syscall(int fd, void *argptr, uint64_t argint,
             break;
     }
 
-    while ((sqe = io_uring_get_sqe(std::addressof(core.sys_io_ring))) == nullptr) {
-        yield();
-    }
-    syscall_wait_request *request = new syscall_wait_request(core.loadedContext, core.loadedContext->generation);
+    sqe = get_sqe();
+    syscall_wait_request *request = alloc_syscall_request(core.loadedContext, core.loadedContext->generation);
 
     request->fd = fd;
     request->offset = off;
@@ -81,20 +1334,16 @@ uring_syscall(int fd, void *argptr, uint64_t argint,
     request->refcount_local = 1;
     request->refcount = &request->refcount_local;
     if (iovcnt) {
-        iovp = &request->iov[0];
-
-        if (iovcnt > 1) {
-            request->ext_arg = malloc(sizeof(*iovin)*iovcnt);
-            iovp = static_cast<struct iovec *>(request->ext_arg);
-        }
-        memcpy(iovp, iovin, sizeof(*iovin)*iovcnt);
+        iovp = copy_iovecs(request, iovin, iovcnt);
     }
     uint64_t min_delay = 1;
     uint64_t wakeup_time = -1ULL;
     if (timeout_ms != -1ULL) {
         wakeup_time = Cycles::rdtsc() + Cycles::fromMilliseconds(std::max(timeout_ms, min_delay));
     }
-    core.loadedContext->wakeupTimeInCycles = wakeup_time;
+    core.loadedContext->wakeupTimeInCycles = ThreadContext::BLOCKED;
+    if (wakeup_time != -1ULL)
+        armTimer(wakeup_time);
      switch (opcode) {
         case IORING_OP_WRITEV:
         case IORING_OP_READV:
@@ -106,6 +1355,28 @@ uring_syscall(int fd, void *argptr, uint64_t argint,
          case IORING_OP_SENDMSG:
              io_uring_prep_sendmsg(sqe, fd, (const struct msghdr *)argptr, flags);
              break;
+         case IORING_OP_SEND_ZC:
+             if (fixed_buffer) {
+                 io_uring_prep_send_zc_fixed(sqe, fd, argptr, argint, flags, 0, off);
+             } else {
+                 io_uring_prep_send_zc(sqe, fd, argptr, argint, flags, 0);
+             }
+             break;
+         case IORING_OP_SENDMSG_ZC:
+             io_uring_prep_sendmsg_zc(sqe, fd, (const struct msghdr *)argptr, flags);
+             break;
+         case IORING_OP_RECV:
+             io_uring_prep_recv(sqe, fd, argptr, argint, flags);
+             break;
+         case IORING_OP_RECVMSG:
+             io_uring_prep_recvmsg(sqe, fd, (struct msghdr *)argptr, flags);
+             break;
+         case IORING_OP_READ_FIXED:
+             io_uring_prep_read_fixed(sqe, fd, argptr, argint, off, flags);
+             break;
+         case IORING_OP_WRITE_FIXED:
+             io_uring_prep_write_fixed(sqe, fd, argptr, argint, off, flags);
+             break;
          case IORING_OP_ACCEPT:
              io_uring_prep_accept(sqe, fd, (struct sockaddr *)argptr, (socklen_t *) argint, flags);
              break;
@@ -119,20 +1390,21 @@ uring_syscall(int fd, void *argptr, uint64_t argint,
              io_uring_prep_poll_add(sqe, fd, argint);
              break;
      }
+    sqe->flags |= sqe_flags;
+    if (zero_copy) {
+        request->on_completion = complete_zero_copy;
+    }
     io_uring_sqe_set_data(sqe, request);
     core.pending_requests.push_back(*request);
-    io_uring_submit(std::addressof(core.sys_io_ring));
+    queue_submission();
     dispatch();
     request->unlink();
     rc = request->result;
     if (rc == INCOMPLETE_REQUEST) {
-        return cancel_syscall(request, wakeup_time);
+        return cancel_syscall(request, wakeup_time, zero_copy);
     }
     rc = request->result;
-    if (request->ext_arg) {
-        free(request->ext_arg);
-    }
-    delete request;
+    free_syscall_request(request);
     return rc;
 }
 
@@ -151,10 +1423,8 @@ uring_syscallv(int opcount, int *fds, struct iovec **iovs, int *iovcnts, uint64_
 
     syscall_wait_request **requests = (syscall_wait_request **)alloca(sizeof(void *) * opcount);
     for (int i = 0; i < opcount; i++) {
-        while ((sqe = io_uring_get_sqe(std::addressof(core.sys_io_ring))) == nullptr) {
-            yield();
-        }
-        syscall_wait_request *request = new syscall_wait_request(core.loadedContext, core.loadedContext->generation);
+        sqe = get_sqe();
+        syscall_wait_request *request = alloc_syscall_request(core.loadedContext, core.loadedContext->generation);
         requests[i] = request;
         if (i == 0) {
             refcount = request->refcount = &request->refcount_local;
@@ -168,24 +1438,21 @@ uring_syscallv(int opcount, int *fds, struct iovec **iovs, int *iovcnts, uint64_
             iovcnt = request->iovcnt = iovcnts[i];
         request->opcode = opcode;
         if (iovcnt) {
-            iovp = &request->iov[0];
-            if (iovcnt > 1) {
-                request->ext_arg = malloc(sizeof(*iovp)*iovcnt);
-                iovp = static_cast<struct iovec *>(request->ext_arg);
-            }
-            memcpy(iovp, iovs[i], sizeof(*iovp)*iovcnt);
+            iovp = copy_iovecs(request, iovs[i], iovcnt);
         }
         io_uring_prep_rw(opcode, sqe, fds[i], iovp, iovcnt, off);
         io_uring_sqe_set_data(sqe, request);
         core.pending_requests.push_back(*request);
-        io_uring_submit(std::addressof(core.sys_io_ring));
+        queue_submission();
     }
     uint64_t min_delay = 1;
     uint64_t wakeup_time = -1ULL;
     if (timeout_ms != -1ULL) {
         wakeup_time = Cycles::rdtsc() + Cycles::fromMilliseconds(std::max(timeout_ms, min_delay));
     }
-    core.loadedContext->wakeupTimeInCycles = wakeup_time;
+    core.loadedContext->wakeupTimeInCycles = ThreadContext::BLOCKED;
+    if (wakeup_time != -1ULL)
+        armTimer(wakeup_time);
 
     dispatch();
     if (unlikely(*requests[0]->refcount != 0)) {
@@ -208,10 +1475,7 @@ uring_syscallv(int opcount, int *fds, struct iovec **iovs, int *iovcnts, uint64_
             rc = rcs[i];
         request->unlink();
         rc = request->result;
-        if (request->ext_arg) {
-            free(request->ext_arg);
-        }
-        delete request;
+        free_syscall_request(request);
     }
     return rc;
 }
@@ -264,6 +1528,84 @@ sendmsg(int sockfd, const struct msghdr *msg, int flags, uint64_t timeout_ms)
     return uring_syscall<IORING_OP_SENDMSG>(sockfd, (void *)(uintptr_t)msg, /* len */ 0, /* off */ 0, flags, timeout_ms);
 }
 
+ssize_t
+recv(int sockfd, void *buf, size_t len, int flags, uint64_t timeout_ms)
+{
+    return uring_syscall<IORING_OP_RECV>(sockfd, buf, len, /* off */ 0, flags, timeout_ms);
+}
+
+ssize_t
+recvmsg(int sockfd, struct msghdr *msg, int flags, uint64_t timeout_ms)
+{
+    return uring_syscall<IORING_OP_RECVMSG>(sockfd, msg, /* len */ 0, /* off */ 0, flags, timeout_ms);
+}
+
+ssize_t
+preadv_fixed_file(int slot, const struct iovec *iov, int iovcnt, uint64_t off, uint64_t timeout_ms)
+{
+    return uring_syscall<IORING_OP_READV, IOSQE_FIXED_FILE>(slot, (void *)(uintptr_t)iov, iovcnt, off, /* flags */ 0, timeout_ms);
+}
+
+ssize_t
+pwritev_fixed_file(int slot, struct iovec *iov, int iovcnt, uint64_t off, uint64_t timeout_ms)
+{
+    return uring_syscall<IORING_OP_WRITEV, IOSQE_FIXED_FILE>(slot, iov, iovcnt, off, /* flags */ 0, timeout_ms);
+}
+
+ssize_t
+send_fixed_file(int slot, const void *buf, size_t len, int flags, uint64_t timeout_ms)
+{
+    return uring_syscall<IORING_OP_SEND, IOSQE_FIXED_FILE>(slot, (void *)(uintptr_t)buf, len, /* off */ 0, flags, timeout_ms);
+}
+
+ssize_t
+recv_fixed_file(int slot, void *buf, size_t len, int flags, uint64_t timeout_ms)
+{
+    return uring_syscall<IORING_OP_RECV, IOSQE_FIXED_FILE>(slot, buf, len, /* off */ 0, flags, timeout_ms);
+}
+
+ssize_t
+pread_fixed(int fd, void *buf, size_t len, int buf_index, uint64_t off, uint64_t timeout_ms)
+{
+    return uring_syscall<IORING_OP_READ_FIXED>(fd, buf, len, off, buf_index, timeout_ms);
+}
+
+ssize_t
+pwrite_fixed(int fd, const void *buf, size_t len, int buf_index, uint64_t off, uint64_t timeout_ms)
+{
+    return uring_syscall<IORING_OP_WRITE_FIXED>(fd, (void *)(uintptr_t)buf, len, off, buf_index, timeout_ms);
+}
+
+ssize_t
+pread_fixed_file(int slot, void *buf, size_t len, int buf_index, uint64_t off, uint64_t timeout_ms)
+{
+    return uring_syscall<IORING_OP_READ_FIXED, IOSQE_FIXED_FILE>(slot, buf, len, off, buf_index, timeout_ms);
+}
+
+ssize_t
+pwrite_fixed_file(int slot, const void *buf, size_t len, int buf_index, uint64_t off, uint64_t timeout_ms)
+{
+    return uring_syscall<IORING_OP_WRITE_FIXED, IOSQE_FIXED_FILE>(slot, (void *)(uintptr_t)buf, len, off, buf_index, timeout_ms);
+}
+
+ssize_t
+send_zc(int sockfd, const void *buf, size_t len, int flags, uint64_t timeout_ms)
+{
+    return uring_syscall<IORING_OP_SEND_ZC>(sockfd, (void *)(uintptr_t)buf, len, /* off */ 0, flags, timeout_ms);
+}
+
+ssize_t
+sendmsg_zc(int sockfd, const struct msghdr *msg, int flags, uint64_t timeout_ms)
+{
+    return uring_syscall<IORING_OP_SENDMSG_ZC>(sockfd, (void *)(uintptr_t)msg, /* len */ 0, /* off */ 0, flags, timeout_ms);
+}
+
+ssize_t
+send_zc_fixed(int sockfd, const void *buf, size_t len, int flags, int buf_index, uint64_t timeout_ms)
+{
+    return uring_syscall<IORING_OP_SEND_ZC, 0, true>(sockfd, (void *)(uintptr_t)buf, len, buf_index, flags, timeout_ms);
+}
+
 #if KERNEL_VERSION >= 515
 int
 accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
@@ -354,16 +1696,24 @@ check_for_completions(struct io_uring *ring)
 {
     struct io_uring_cqe *cqe;
 
+    if (unlikely(core.remote_recv_buffers.load(std::memory_order_relaxed) != -1)) {
+        reclaim_remote_recv_buffers();
+    }
+    if (unlikely(!core.starved_recv_streams.empty())) {
+        rearm_starved_recv_streams();
+    }
     while (io_uring_peek_cqe(ring, &cqe) == 0) {
         syscall_wait_request *request = (syscall_wait_request *)io_uring_cqe_get_data(cqe);
+        if (request->on_completion) {
+            request->on_completion(request, cqe->res, cqe->flags);
+            io_uring_cqe_seen(ring, cqe);
+            continue;
+        }
         request->result = cqe->res;
 
         io_uring_cqe_seen(ring, cqe);
         if (unlikely(request->cancelled)) {
-            if (request->ext_arg) {
-                free(request->ext_arg);
-            }
-            delete request;
+            free_syscall_request(request);
             continue;
         }
         (*request->refcount)--;
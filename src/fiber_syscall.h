@@ -94,6 +94,9 @@
 #pragma once
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <atomic>
+#include <functional>
+#include <vector>
 
 #include "intrusive_list.h"
 #include "ThreadId.h"
@@ -103,6 +106,65 @@
 namespace Arachne {
 #define INCOMPLETE_REQUEST -255
 
+    struct Core;
+
+    /*
+     * Number of iovecs a syscall_wait_request holds inline. Requests with
+     * more than this allocate their copy of the iovecs separately.
+     */
+    const int SYSCALL_INLINE_IOVECS = 8;
+
+    /*
+     * Number of syscall_wait_requests a core allocates at once when its
+     * free list runs dry.
+     */
+    const int SYSCALL_REQUESTS_PER_CHUNK = 64;
+
+    /*
+     * Number of slots in the registered file table of every per-core ring.
+     */
+    const int MAX_REGISTERED_FILES = 1024;
+
+    /*
+     * Number of slots in the registered buffer table; this is the kernel's
+     * IORING_MAX_REG_BUFFERS.
+     */
+    const int MAX_REGISTERED_BUFFERS = 16384;
+
+    /*
+     * Number of registered buffers a core takes from the shared pool at
+     * once when its own free list runs dry.
+     */
+    const int REGISTERED_BUFFER_BATCH = 16;
+
+    /*
+     * The buffer group id of the per-core provided buffer rings that
+     * multishot recvs take their buffers from.
+     */
+    const int RECV_BUFFER_GROUP = 0;
+
+    /*
+     * Bounds of the delay before an acceptor rearms a multishot accept
+     * that keeps ending without accepting anything, for instance because
+     * the process is out of fds; the delay doubles with each such arm.
+     */
+    const uint64_t ACCEPT_RETRY_MIN_NS = 1000000;
+    const uint64_t ACCEPT_RETRY_MAX_NS = 100000000;
+
+    /*
+     * A buffer from the pool made by create_registered_buffer_pool().
+     */
+    struct registered_buffer {
+        void *base;
+        uint32_t len;
+        /* The buffer's index in the registered buffer table. */
+        uint16_t index;
+        /* The core whose free list the buffer returns to. */
+        Core *owner;
+        /* The next buffer on the free list this buffer is on. */
+        registered_buffer *next;
+    };
+
     struct syscall_request {
         uint16_t code;
         uint8_t  arg_count;
@@ -110,25 +172,56 @@ namespace Arachne {
         uint64_t result;
     };
 
+    /*
+     * Data that a multishot recv delivered into a buffer of a provided
+     * buffer ring. The buffer must be given back with return_recv_buffer().
+     */
+    struct recv_buffer {
+        void *data;
+        uint32_t len;
+        uint16_t bid;
+        /* The core whose buffer ring the buffer belongs to. */
+        Core *owner;
+    };
+
+    struct recv_stream;
+    struct acceptor;
+
     struct syscall_wait_request : public intrusive_list_base_hook<> {
         ThreadId tid;
         bool cancelled;
+        /*
+         * For requests that complete many times, such as multishot recvs,
+         * the function check_for_completions() hands each completion to;
+         * nullptr for requests that complete once.
+         */
+        void (*on_completion)(syscall_wait_request *request, int res, uint32_t flags);
         uint8_t opcode;
         uint16_t iovcnt;
         int result;
+        /* For zero-copy sends, the result held back until the kernel is
+         * done with the caller's memory. */
+        int deferred_result;
 
         int fd;
         uint32_t refcount_local;
         uint32_t *refcount;
         uint64_t offset;
         void * ext_arg;
-        struct iovec iov[1];
+
+        /* The core whose free list this request returns to. */
+        Core *owner;
+        /* The next request on the free list this request is on. */
+        syscall_wait_request *next_free;
+        struct iovec iov[SYSCALL_INLINE_IOVECS];
 
         DISALLOW_COPY_AND_ASSIGN(syscall_wait_request);
         syscall_wait_request(ThreadContext *context, uint32_t generation) :
             tid(context, generation),
             cancelled(false),
+            on_completion(nullptr),
             result(INCOMPLETE_REQUEST),
+            deferred_result(INCOMPLETE_REQUEST),
             offset(0),
             ext_arg(nullptr)
             {
@@ -139,6 +232,136 @@ namespace Arachne {
 
     void check_for_completions(struct io_uring *ring);
 
+    /*
+     * System calls queue their SQEs in the core's ring without submitting
+     * them. dispatch() calls this once per pass, or sooner when the batch
+     * is full or its oldest entry is too old, to submit them all at once.
+     * Whatever the kernel does not take stays queued for the next call.
+     */
+    void flush_submissions();
+
+    /*
+     * Registered files and buffers spare the kernel the fd lookup and the
+     * page pinning of every operation. They are registered with every
+     * per-core ring: the calls below return once every active core has
+     * applied the change to its ring, and a core that comes online applies
+     * the tables to its new ring.
+     *
+     * register_files() places duplicates of nr fds in consecutive slots of
+     * the registered file table and returns the first slot, or a negative
+     * errno; the caller may close its own fds right away.
+     * unregister_files() empties the slots again and closes the
+     * duplicates, so that no ring keeps the files open.
+     */
+    int register_files(const int *fds, unsigned nr);
+    int unregister_files(int slot, unsigned nr);
+
+    /*
+     * Place nr buffers in consecutive free slots of the registered buffer
+     * table and return the index of the first one, or a negative errno.
+     * Changing the table makes every ring re-register all of it, which
+     * waits for the ring to go idle, so buffers are best registered during
+     * startup. unregister_buffers() frees the slots again; the buffers of
+     * the pool below cannot be unregistered.
+     */
+    int register_buffers(const struct iovec *iovs, unsigned nr);
+    int unregister_buffers(int index, unsigned nr);
+
+    /*
+     * Incremented whenever the registered file or buffer table changes.
+     * dispatch() calls update_registrations() when it exceeds the core's
+     * registrations_seen, and a core gives its registrations up
+     * with drop_registrations() when it goes offline.
+     */
+    extern std::atomic<uint64_t> registrations_generation;
+    void update_registrations();
+    void drop_registrations();
+
+    /*
+     * Register count buffers of buffer_size bytes each for threads to borrow
+     * with borrow_registered_buffer(). There can be only one such pool.
+     * Returns 0 or a negative errno.
+     */
+    int create_registered_buffer_pool(size_t buffer_size, unsigned count);
+
+    /*
+     * Borrow a buffer from the pool, or return nullptr if all are in use.
+     * A buffer may be given back on any core.
+     */
+    registered_buffer *borrow_registered_buffer();
+    void return_registered_buffer(registered_buffer *buffer);
+
+    /*
+     * Give every core a provided buffer ring of count buffers of
+     * buffer_size bytes for multishot recvs; count must be a power of two.
+     * Must be called once, before the first recv_multishot_start().
+     * Returns 0 or a negative errno.
+     */
+    int setup_recv_buffers(size_t buffer_size, unsigned count);
+
+    /*
+     * Start a multishot recv on sockfd. Rather than every waiting thread
+     * owning a buffer, data lands in buffers of the core's provided buffer
+     * ring as it arrives, so idle connections hold no buffer memory. On
+     * success, stores the new stream in *stream and returns 0.
+     */
+    int recv_multishot_start(int sockfd, int flags, recv_stream **stream);
+
+    /*
+     * Wait for the next buffer of data on the stream. Returns its length,
+     * 0 at end of file, or a negative errno such as -ETIME.
+     */
+    ssize_t recv_multishot(recv_stream *stream, recv_buffer *buffer, uint64_t timeout_ms);
+
+    /*
+     * Give a buffer from recv_multishot() back to its ring; this may be
+     * done on any core.
+     */
+    void return_recv_buffer(const recv_buffer &buffer);
+
+    /*
+     * Cancel the stream's recv, give back any data it still holds and free
+     * it.
+     */
+    void recv_multishot_stop(recv_stream *stream);
+
+    /*
+     * Free this core's provided buffer ring before its sys_io_ring is
+     * replaced; buffers that threads hold keep their ids for the next ring.
+     * free_recv_buffers() also frees the buffers, when the core's kernel
+     * thread exits.
+     */
+    void release_recv_buf_ring();
+    void free_recv_buffers();
+
+    /*
+     * Serve connections to addr from each of the given cores. Every core
+     * gets its own SO_REUSEPORT listener with a multishot accept armed on
+     * its ring, and every connection it accepts is handed to a new thread
+     * running handler(fd) on that same core, so that the connection stays
+     * core-local for its whole lifetime. If addr has port 0, the port the
+     * first listener is bound to is used for all of them. On success,
+     * stores the new acceptor in *out and returns 0.
+     */
+    int start_acceptor(const struct sockaddr *addr, socklen_t addrlen, int backlog,
+                       const std::vector<int> &cores, std::function<void(int)> handler,
+                       acceptor **out);
+
+    /*
+     * Stop accepting, close the listeners and free the acceptor; threads
+     * already handling connections are unaffected. Must be called from an
+     * Arachne thread.
+     */
+    void stop_acceptor(acceptor *acceptor);
+
+    /*
+     * Requests come from per-core free lists rather than the heap. A
+     * request may be freed on any core, for instance after its thread
+     * migrated; it then goes back to the core that allocated it.
+     */
+    syscall_wait_request *alloc_syscall_request(ThreadContext *context, uint32_t generation);
+    void free_syscall_request(syscall_wait_request *request);
+
     /*
      * Functions supported by io_uring on 5.4
      */
@@ -159,6 +382,21 @@ namespace Arachne {
 
     ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags, uint64_t timeout_ms);
 
+    /*
+     * supported in 6.0 (6.1 for sendmsg_zc)
+     *
+     * Zero-copy variants of send() and sendmsg(): the kernel transmits
+     * straight from the caller's memory instead of copying it into socket
+     * buffers, which pays off for payloads of tens of kilobytes and up.
+     * They return only once the kernel no longer references the memory,
+     * even after a timeout, so the buffer may be reused right away.
+     * send_zc_fixed() sends from entry buf_index of the registered buffer
+     * table.
+     */
+    ssize_t send_zc(int sockfd, const void *buf, size_t len, int flags, uint64_t timeout_ms);
+    ssize_t sendmsg_zc(int sockfd, const struct msghdr *msg, int flags, uint64_t timeout_ms);
+    ssize_t send_zc_fixed(int sockfd, const void *buf, size_t len, int flags, int buf_index, uint64_t timeout_ms);
+
 
     /*
      * supported in 5.6
@@ -168,6 +406,25 @@ namespace Arachne {
 
     ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags, uint64_t timeout_ms);
 
+    /*
+     * Variants of the calls above that name the file by its slot in the
+     * registered file table.
+     */
+    ssize_t preadv_fixed_file(int slot, const struct iovec *iov, int iovcnt, uint64_t off, uint64_t timeout_ms);
+    ssize_t pwritev_fixed_file(int slot, struct iovec *iov, int iovcnt, uint64_t off, uint64_t timeout_ms);
+    ssize_t send_fixed_file(int slot, const void *buf, size_t len, int flags, uint64_t timeout_ms);
+    ssize_t recv_fixed_file(int slot, void *buf, size_t len, int flags, uint64_t timeout_ms);
+
+    /*
+     * Reads and writes to a buffer that lies within entry buf_index of the
+     * registered buffer table (READ_FIXED/WRITE_FIXED), naming the file by
+     * fd or by its registered slot.
+     */
+    ssize_t pread_fixed(int fd, void *buf, size_t len, int buf_index, uint64_t off, uint64_t timeout_ms);
+    ssize_t pwrite_fixed(int fd, const void *buf, size_t len, int buf_index, uint64_t off, uint64_t timeout_ms);
+    ssize_t pread_fixed_file(int slot, void *buf, size_t len, int buf_index, uint64_t off, uint64_t timeout_ms);
+    ssize_t pwrite_fixed_file(int slot, const void *buf, size_t len, int buf_index, uint64_t off, uint64_t timeout_ms);
+
     /*
      * supported in 5.6 -- emulated with poll for earlier
      */